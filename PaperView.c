@@ -1,4 +1,8 @@
+#define _XOPEN_SOURCE 700 // for realpath
 #include <math.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <mupdf/fitz.h>
 #include <mupdf/pdf.h> /* for pdf specifics and forms */
 #include <mupdf/ucdn.h>
@@ -13,9 +17,370 @@ const int PAGE_SEPARATOR_HEIGHT = 18;
 #define MAX_ZOOM 6
 // don't approximate zoom above this level; approximation often takes longer
 #define MAX_APPROXIMATE_ZOOM 2
+#define STORE_SIZE FZ_STORE_DEFAULT
+// decode images of this many pages past the prerendered next/previous ones
+#define PREDECODE_DISTANCE 2
+#define DEFAULT_PREDECODE_SHARE 0.25f
+// how long predecoding waits before trying again after yielding to rendering
+#define PREDECODE_BACKOFF_MS 5
+// show the partially rendered page if rendering takes longer than this
+#define PROGRESSIVE_DELAY_US 300000
+#define PROGRESSIVE_REDRAW_INTERVAL_MS 100
+// extra handles of the document for loading pages in the background
+#define DEFAULT_DOC_INSTANCES 1
+// height of the mark of forward searches that only found points, in points
+#define SYNCTEX_MARK_HEIGHT 10
+// longest goto_page waits for the destination to render before switching
+#define GOTO_MAX_WAIT_MS 250
+// most pages side by side in a row, see set_columns
+#define MAX_COLUMNS 8
+// pages draw_callback draws at most, leaving room in the page cache for the
+// rows it prerenders and for the pages being rendered
+#define MAX_FRAME_PAGES (PAGE_CACHE_LEN - 3 * MAX_COLUMNS)
+// width of the page overview thumbnails, in pixels
+#define THUMBNAIL_WIDTH 128
+// white space kept around the content of pages when trimming their margins
+#define TRIM_PADDING 8
+// rows and columns of the grids links and words are bucketed in, see
+// build_link_grid
+#define LINK_GRID_SIZE 16
+// how long the pointer stays on a link before its destination is prefetched
+#define LINK_PREFETCH_DELAY_MS 150
+// size of the destination previews shown in link tooltips, in pixels
+#define LINK_PREVIEW_WIDTH 320
+#define LINK_PREVIEW_HEIGHT 96
+// emit counted-matches at most this often while the document is searched
+#define SEARCH_REPORT_INTERVAL_US 100000
+// pages extracted ahead of the first one not collected yet, per instance
+#define EXPORT_PAGES_PER_INSTANCE 4
+// pages the word index is built from by each of its jobs
+#define WORD_INDEX_PAGES_PER_JOB 16
+// bytes the text cache of all documents is trimmed to when one is opened
+#define TEXT_CACHE_MAX_SIZE (256 << 20)
+// of the labels show_jump_labels draws, in pixels
+#define JUMP_LABEL_FONT_SIZE 11
+
+#ifdef PAPER_ADAPTIVE_LOCKS
+// times to retry a taken lock before sleeping on it
+#define LOCK_SPIN_COUNT 100
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() g_thread_yield()
+#endif
+#endif
 
 G_DEFINE_TYPE_WITH_PRIVATE(PaperView, paper_view, GTK_TYPE_DRAWING_AREA);
 
+enum {
+  SIGNAL_SYNCTEX_EDIT,
+  SIGNAL_COUNTED_MATCHES,
+  SIGNAL_TEXT_EXPORTED,
+  SIGNAL_SAVE_PROGRESS,
+  SIGNAL_SAVE_FAILED,
+  SIGNAL_SYNCTEX_VIEWED,
+  SIGNAL_SELECTION_COPIED,
+  SIGNAL_COUNT
+};
+static guint signals[SIGNAL_COUNT];
+
+/*
+ * One pool of render threads shared by all the PaperViews, so that many open
+ * documents don't mean many threads competing with Emacs. Jobs of the focused
+ * view run first, then those of the other visible views; views of the same
+ * priority get a fair share, by ordering their jobs by a per-view sequence
+ * number that never lags behind the last dispatched one. Jobs keep the
+ * priority of their view as it was when they were queued, so that their
+ * order can't change under the sorted queue; reprioritize_jobs brings them
+ * up to date and sorts the queue again when views change priority.
+ */
+enum JobTier {
+  TIER_LOAD, // pages about to be drawn, or to be rendered in the background
+  TIER_RENDER,
+  TIER_COPY, // the selection the user is waiting for
+  TIER_SAVE,
+  TIER_SYNCTEX,
+  TIER_SEARCH,
+  TIER_EXPORT,
+  TIER_PREDECODE,
+  TIER_THUMBNAIL,
+  TIER_INDEX,    // the word index, a few pages per job
+  TIER_HOUSEKEEPING, // trimming the cache, for no view in particular
+};
+enum ViewPriority { VIEW_HIDDEN, VIEW_VISIBLE, VIEW_FOCUSED };
+
+struct RenderJob {
+  DocInfo *doci;
+  GFunc func; // called as func(data, doci)
+  gpointer data;
+  enum JobTier tier;
+  enum ViewPriority priority;
+  guint64 seq;
+  GList *link; // in scheduler.queued
+  gboolean uses_instances; // see schedule_instance_job
+};
+
+static struct RenderScheduler {
+  GThreadPool *pool;
+  int max_threads; // 0 for the number of processors
+  // protects dispatched_seq, queued and the DocInfo.sched_seq's
+  GMutex mutex;
+  guint64 dispatched_seq;
+  GQueue queued; // the jobs not dispatched yet
+  DocInfo *focused;
+} scheduler;
+
+static enum ViewPriority view_priority(DocInfo *doci) {
+  if (!doci)
+    return VIEW_HIDDEN;
+  if (g_atomic_pointer_get(&scheduler.focused) == doci)
+    return VIEW_FOCUSED;
+  return g_atomic_int_get(&doci->is_visible) ? VIEW_VISIBLE : VIEW_HIDDEN;
+}
+
+static gint compare_jobs(gconstpointer a, gconstpointer b, gpointer user_data) {
+  const struct RenderJob *ja = a, *jb = b;
+  if (ja->tier != jb->tier)
+    return ja->tier - jb->tier;
+  if (ja->priority != jb->priority)
+    return jb->priority - ja->priority;
+  return ja->seq < jb->seq ? -1 : ja->seq > jb->seq;
+}
+
+// Push JOB, with the current priority of its view, to the shared threads.
+static void push_job(struct RenderJob *job) {
+  g_mutex_lock(&scheduler.mutex);
+  job->priority = view_priority(job->doci);
+  g_queue_push_tail(&scheduler.queued, job);
+  job->link = scheduler.queued.tail;
+  // under the mutex, so that reprioritize_jobs can't change priorities while
+  // the pool compares them
+  g_thread_pool_push(scheduler.pool, job, NULL);
+  g_mutex_unlock(&scheduler.mutex);
+}
+
+static void thread_run_job(gpointer data, gpointer user_data) {
+  struct RenderJob *job = data;
+  g_mutex_lock(&scheduler.mutex);
+  scheduler.dispatched_seq = MAX(scheduler.dispatched_seq, job->seq);
+  g_queue_delete_link(&scheduler.queued, job->link);
+  g_mutex_unlock(&scheduler.mutex);
+  job->func(job->data, job->doci);
+  if (job->uses_instances) {
+    // hand the instance over to the next job waiting for one; DOCI stays
+    // alive while that's queued, and close_doc_instances may free it as soon
+    // as this is unlocked otherwise
+    struct DocInstances *instances = &job->doci->instances;
+    g_mutex_lock(&instances->lock);
+    struct RenderJob *next = g_queue_pop_head(&instances->waiting);
+    if (!next)
+      instances->dispatched--;
+    if (--instances->jobs == 0)
+      g_cond_broadcast(&instances->cond);
+    g_mutex_unlock(&instances->lock);
+    if (next)
+      push_job(next);
+  }
+  free(job);
+}
+
+// Make a job for FUNC(DATA, DOCI), numbered in the order it's queued.
+static struct RenderJob *new_job(DocInfo *doci, enum JobTier tier, GFunc func,
+                                 gpointer data, gboolean uses_instances) {
+  struct RenderJob *job = malloc(sizeof(*job));
+  job->doci = doci;
+  job->func = func;
+  job->data = data;
+  job->tier = tier;
+  job->priority = view_priority(doci);
+  job->uses_instances = uses_instances;
+  g_mutex_lock(&scheduler.mutex);
+  if (!scheduler.pool) {
+    int threads = scheduler.max_threads ? scheduler.max_threads
+                                        : (int)g_get_num_processors();
+    scheduler.pool = g_thread_pool_new(thread_run_job, NULL, threads, FALSE,
+                                       NULL);
+    g_thread_pool_set_sort_function(scheduler.pool, compare_jobs, NULL);
+  }
+  if (!doci) {
+    job->seq = scheduler.dispatched_seq + 1;
+  } else if (doci->batch.is_open && doci->batch.seq) {
+    job->seq = doci->batch.seq;
+  } else {
+    job->seq = doci->sched_seq =
+        MAX(doci->sched_seq, scheduler.dispatched_seq) + 1;
+    if (doci->batch.is_open)
+      doci->batch.seq = job->seq;
+  }
+  g_mutex_unlock(&scheduler.mutex);
+  return job;
+}
+
+/*
+ * Queue FUNC(DATA, DOCI) on the shared render threads. The caller must keep
+ * DOCI alive until FUNC is done, e.g. by holding a reference to its widget;
+ * DOCI is NULL for jobs of no view in particular. Jobs are only scheduled
+ * from the GTK thread.
+ */
+static void schedule_job(DocInfo *doci, enum JobTier tier, GFunc func,
+                         gpointer data) {
+  push_job(new_job(doci, tier, func, data, FALSE));
+}
+
+/*
+ * Like schedule_job, for FUNC that takes one of the document instances of
+ * DOCI from instances.idle. Only as many of these are on the shared threads
+ * as there are instances, so that none of the threads waits for one while
+ * other jobs are queued; the rest wait in instances.waiting, in the order
+ * they'd be dispatched. The instances aren't closed until all are done.
+ */
+static void schedule_instance_job(DocInfo *doci, enum JobTier tier,
+                                  GFunc func, gpointer data) {
+  struct RenderJob *job = new_job(doci, tier, func, data, TRUE);
+  struct DocInstances *instances = &doci->instances;
+  g_mutex_lock(&instances->lock);
+  instances->jobs++;
+  gboolean is_free = instances->dispatched < instances->count;
+  if (is_free)
+    instances->dispatched++;
+  else
+    g_queue_insert_sorted(&instances->waiting, job, compare_jobs, NULL);
+  g_mutex_unlock(&instances->lock);
+  if (is_free)
+    push_job(job);
+}
+
+/*
+ * Give the jobs DOCI queues until end_job_batch the same sequence number, so
+ * that they're dispatched together instead of interleaved with the jobs of
+ * other views, e.g. to render a whole row of pages in parallel.
+ */
+static void begin_job_batch(DocInfo *doci) {
+  doci->batch.is_open = TRUE;
+  doci->batch.seq = 0;
+}
+
+static void end_job_batch(DocInfo *doci) { doci->batch.is_open = FALSE; }
+
+/*
+ * Give the queued jobs the current priorities of their views and sort the
+ * queue again. push_job holds the mutex too, so nothing is compared
+ * meanwhile.
+ */
+static void reprioritize_jobs(void) {
+  g_mutex_lock(&scheduler.mutex);
+  if (scheduler.pool) {
+    for (GList *l = scheduler.queued.head; l; l = l->next) {
+      struct RenderJob *job = l->data;
+      job->priority = view_priority(job->doci);
+    }
+    g_thread_pool_set_sort_function(scheduler.pool, compare_jobs, NULL);
+  }
+  g_mutex_unlock(&scheduler.mutex);
+}
+
+// Set the number of shared render threads; 0 for the number of processors.
+void set_render_threads(int n) {
+  g_mutex_lock(&scheduler.mutex);
+  scheduler.max_threads = MAX(n, 0);
+  if (scheduler.pool)
+    g_thread_pool_set_max_threads(
+        scheduler.pool, n > 0 ? n : (int)g_get_num_processors(), NULL);
+  g_mutex_unlock(&scheduler.mutex);
+}
+
+// Give the jobs of WIDGET priority over those of all other views.
+void set_focused_view(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  if (g_atomic_pointer_get(&scheduler.focused) == &c->doci)
+    return;
+  g_atomic_pointer_set(&scheduler.focused, &c->doci);
+  reprioritize_jobs();
+}
+
+/*
+ * A job of a view on the shared threads, the first member of the args of the
+ * job: RUN(args, doci) runs on one of the threads, then DONE(args) on the GTK
+ * thread. DONE returns FALSE once the job is over, after freeing the args,
+ * or TRUE if it goes on, in which case it's queued again with
+ * queue_background_job, right away or later, maybe with another RUN or
+ * tier. The widget is referenced from submit_background_job until the job is
+ * over, so that the view, and with it its DocInfo, outlives the job even if
+ * it's closed meanwhile.
+ */
+typedef struct BackgroundJob {
+  GtkWidget *widget;
+  GFunc run;
+  GSourceFunc done;
+  enum JobTier tier;
+  gboolean uses_instances; // see schedule_instance_job
+} BackgroundJob;
+
+// runs on the GTK thread once RUN of JOB is done
+static gboolean finish_background_job(void *data) {
+  BackgroundJob *job = data;
+  GtkWidget *widget = job->widget;
+  if (!job->done(job))
+    g_object_unref(widget);
+  return FALSE;
+}
+
+static void thread_run_background_job(gpointer data, gpointer user_data) {
+  BackgroundJob *job = data;
+  job->run(job, user_data);
+  gdk_threads_add_idle(finish_background_job, job);
+}
+
+static void queue_background_job(BackgroundJob *job) {
+  PaperViewPrivate *c =
+      paper_view_get_instance_private(PAPER_VIEW(job->widget));
+  if (job->uses_instances)
+    schedule_instance_job(&c->doci, job->tier, thread_run_background_job,
+                          job);
+  else
+    schedule_job(&c->doci, job->tier, thread_run_background_job, job);
+}
+
+static void init_background_job(BackgroundJob *job, GtkWidget *widget,
+                                enum JobTier tier, GFunc run,
+                                GSourceFunc done) {
+  job->widget = g_object_ref(widget);
+  job->run = run;
+  job->done = done;
+  job->tier = tier;
+  job->uses_instances = FALSE;
+}
+
+// Queue JOB of WIDGET, see BackgroundJob.
+static void submit_background_job(BackgroundJob *job, GtkWidget *widget,
+                                  enum JobTier tier, GFunc run,
+                                  GSourceFunc done) {
+  init_background_job(job, widget, tier, run, done);
+  queue_background_job(job);
+}
+
+// Like submit_background_job, for RUN that takes a document instance.
+static void submit_background_instance_job(BackgroundJob *job,
+                                           GtkWidget *widget,
+                                           enum JobTier tier, GFunc run,
+                                           GSourceFunc done) {
+  init_background_job(job, widget, tier, run, done);
+  job->uses_instances = TRUE;
+  queue_background_job(job);
+}
+
+/*
+ * Like submit_background_job, but run JOB right here on the GTK thread, e.g.
+ * when waiting for it is better than showing an approximation. DONE still
+ * runs from the main loop, as it would after a thread.
+ */
+static void run_background_job(BackgroundJob *job, GtkWidget *widget,
+                               GFunc run, GSourceFunc done) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  init_background_job(job, widget, TIER_RENDER, run, done);
+  thread_run_background_job(job, &c->doci);
+}
+
 int locationcmp(fz_location a, fz_location b) {
   int chapcmp = a.chapter - b.chapter;
   return chapcmp != 0 ? chapcmp : a.page - b.page;
@@ -26,871 +391,4812 @@ void drop_page(fz_context *ctx, Page *page) {
     return;
   fz_drop_page(ctx, page->page);
   fz_drop_stext_page(ctx, page->page_text);
+  search_text_free(page->search_text);
   fz_drop_separations(ctx, page->seps);
   fz_drop_link(ctx, page->links);
+  free(page->link_grid.cell_starts);
+  free(page->link_grid.links);
+  free(page->word_grid.cell_starts);
+  free(page->word_grid.boxes);
   fz_drop_display_list(ctx, page->display_list);
+  fz_drop_display_list(ctx, page->annot_list);
   cairo_surface_destroy(page->cache.rendered.surface);
+  cairo_surface_destroy(page->cache.annots.surface);
+  cairo_surface_destroy(page->cache.rendered.partial);
   free(page->cache.selection.quads.quads);
   free(page->cache.search.quads.quads);
 }
 
-void load_page(DocInfo *doci, fz_location location, Page *page) {
-  fz_context *ctx = doci->ctx;
+// Return the range of grid cells along one axis that [LO, HI] overlaps.
+static void link_grid_span(float lo, float hi, float start, float end,
+                           int *first, int *last) {
+  float cell = (end - start) / LINK_GRID_SIZE;
+  *first = fz_clampi((lo - start) / cell, 0, LINK_GRID_SIZE - 1);
+  *last = fz_clampi((hi - start) / cell, 0, LINK_GRID_SIZE - 1);
+}
+
+/*
+ * Bucket the links of PAGE by the cells of a grid over the page that their
+ * rects overlap, so that find_link_at only tests the links of one cell.
+ */
+static void build_link_grid(Page *page) {
+  LinkGrid *grid = &page->link_grid;
+  fz_rect b = page->page_bounds;
+  if (!page->links || fz_is_empty_rect(b))
+    return;
+  grid->cell_starts =
+      calloc(LINK_GRID_SIZE * LINK_GRID_SIZE + 1, sizeof(*grid->cell_starts));
+  // count the links of each cell, shifted by one for the prefix sum below
+  for (int pass = 0; pass < 2; pass++) {
+    for (fz_link *link = page->links; link; link = link->next) {
+      int x0, x1, y0, y1;
+      link_grid_span(link->rect.x0, link->rect.x1, b.x0, b.x1, &x0, &x1);
+      link_grid_span(link->rect.y0, link->rect.y1, b.y0, b.y1, &y0, &y1);
+      for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+          int cell = y * LINK_GRID_SIZE + x;
+          if (pass == 0)
+            grid->cell_starts[cell + 1]++;
+          else
+            grid->links[grid->cell_starts[cell]++] = link;
+        }
+      }
+    }
+    if (pass == 0) {
+      for (int i = 0; i < LINK_GRID_SIZE * LINK_GRID_SIZE; i++)
+        grid->cell_starts[i + 1] += grid->cell_starts[i];
+      grid->links = malloc(grid->cell_starts[LINK_GRID_SIZE * LINK_GRID_SIZE] *
+                           sizeof(*grid->links));
+    }
+  }
+  // filling moved each start to the start of the next cell; move them back
+  for (int i = LINK_GRID_SIZE * LINK_GRID_SIZE; i > 0; i--)
+    grid->cell_starts[i] = grid->cell_starts[i - 1];
+  grid->cell_starts[0] = 0;
+}
+
+// Return the link of PAGE under POINT, in page space, or NULL.
+static fz_link *find_link_at(Page *page, fz_point point) {
+  LinkGrid *grid = &page->link_grid;
+  fz_rect b = page->page_bounds;
+  if (!grid->cell_starts || !fz_is_point_inside_rect(point, b))
+    return NULL;
+  int x, y, same;
+  link_grid_span(point.x, point.x, b.x0, b.x1, &x, &same);
+  link_grid_span(point.y, point.y, b.y0, b.y1, &y, &same);
+  int cell = y * LINK_GRID_SIZE + x;
+  for (int i = grid->cell_starts[cell]; i < grid->cell_starts[cell + 1]; i++) {
+    if (fz_is_point_inside_rect(point, grid->links[i]->rect))
+      return grid->links[i];
+  }
+  return NULL;
+}
+
+/*
+ * Bucket the words of PAGE by the grid cell of their centers, in reading
+ * order within each cell, so that show_jump_labels finds the words in view
+ * without walking the text.
+ */
+static void build_word_grid(Page *page) {
+  WordGrid *grid = &page->word_grid;
+  fz_rect b = page->page_bounds;
+  if (!page->page_text || fz_is_empty_rect(b))
+    return;
+  fz_rect *boxes = NULL;
+  int count = 0, capacity = 0;
+  for (fz_stext_block *block = page->page_text->first_block; block;
+       block = block->next) {
+    if (block->type != FZ_STEXT_BLOCK_TEXT)
+      continue;
+    for (fz_stext_line *line = block->u.t.first_line; line;
+         line = line->next) {
+      fz_rect word = fz_empty_rect;
+      for (fz_stext_char *ch = line->first_char;; ch = ch->next) {
+        if (ch && !g_unichar_isspace(ch->c)) {
+          word = fz_union_rect(word, fz_rect_from_quad(ch->quad));
+          continue;
+        }
+        if (!fz_is_empty_rect(word)) {
+          if (count == capacity) {
+            capacity = MAX(64, capacity * 2);
+            boxes = realloc(boxes, capacity * sizeof(*boxes));
+          }
+          boxes[count++] = word;
+        }
+        word = fz_empty_rect;
+        if (!ch)
+          break;
+      }
+    }
+  }
+  int *cells = malloc(MAX(count, 1) * sizeof(*cells));
+  grid->cell_starts =
+      calloc(LINK_GRID_SIZE * LINK_GRID_SIZE + 1, sizeof(*grid->cell_starts));
+  // count the words of each cell, shifted by one for the prefix sum below
+  for (int i = 0; i < count; i++) {
+    int x, y, same;
+    link_grid_span((boxes[i].x0 + boxes[i].x1) / 2,
+                   (boxes[i].x0 + boxes[i].x1) / 2, b.x0, b.x1, &x, &same);
+    link_grid_span((boxes[i].y0 + boxes[i].y1) / 2,
+                   (boxes[i].y0 + boxes[i].y1) / 2, b.y0, b.y1, &y, &same);
+    cells[i] = y * LINK_GRID_SIZE + x;
+    grid->cell_starts[cells[i] + 1]++;
+  }
+  for (int i = 0; i < LINK_GRID_SIZE * LINK_GRID_SIZE; i++)
+    grid->cell_starts[i + 1] += grid->cell_starts[i];
+  grid->boxes = malloc(MAX(count, 1) * sizeof(*grid->boxes));
+  for (int i = 0; i < count; i++)
+    grid->boxes[grid->cell_starts[cells[i]]++] = boxes[i];
+  // filling moved each start to the start of the next cell; move them back
+  for (int i = LINK_GRID_SIZE * LINK_GRID_SIZE; i > 0; i--)
+    grid->cell_starts[i] = grid->cell_starts[i - 1];
+  grid->cell_starts[0] = 0;
+  free(cells);
+  free(boxes);
+}
+
+// Each char is highlighted by at most one quad, so this bounds the number of
+// quads a selection of TEXT can have.
+static int count_chars(fz_stext_page *text) {
+  int count = 0;
+  for (fz_stext_block *block = text->first_block; block; block = block->next) {
+    if (block->type != FZ_STEXT_BLOCK_TEXT)
+      continue;
+    for (fz_stext_line *line = block->u.t.first_line; line; line = line->next)
+      for (fz_stext_char *ch = line->first_char; ch; ch = ch->next)
+        count++;
+  }
+  return count;
+}
+
+/*
+ * Return the path of the file NAME in the cache directory of the document,
+ * creating the directory if needed. The directory is keyed by the path, size
+ * and modification time of the document, so caches of older versions of it
+ * are never used. Free the result with g_free.
+ */
+char *doc_cache_path(DocInfo *doci, const char *name) {
+  char *dir =
+      g_build_filename(g_get_user_cache_dir(), "paper", doci->cache_key, NULL);
+  g_mkdir_with_parents(dir, 0700);
+  char *res = g_build_filename(dir, name, NULL);
+  g_free(dir);
+  return res;
+}
+
+int page_number(DocInfo *doci, fz_location loc);
+
+// Return the path page N's text is kept at by text_cache_write.
+static char *text_cache_path(DocInfo *doci, int n) {
+  char *name = g_strdup_printf("text-%d" TEXT_CACHE_SUFFIX, n);
+  char *path = doc_cache_path(doci, name);
+  g_free(name);
+  return path;
+}
+
+/*
+ * Set *TEXT and *CONTENT_BOUNDS from LIST, the display list of a page, and
+ * keep them at CACHE_PATH for text_cache_read. Throws on errors.
+ */
+static void extract_display_list(fz_context *ctx, fz_display_list *list,
+                                 const char *cache_path, fz_stext_page **text,
+                                 fz_rect *content_bounds) {
+  *text = fz_new_stext_page_from_display_list(ctx, list, NULL);
+  *content_bounds = fz_empty_rect;
+  fz_device *device = fz_new_bbox_device(ctx, content_bounds);
+  fz_try(ctx) {
+    fz_run_display_list(ctx, list, device, fz_identity, fz_infinite_rect,
+                        NULL);
+  }
+  fz_always(ctx) {
+    fz_close_device(ctx, device);
+    fz_drop_device(ctx, device);
+  }
+  fz_catch(ctx) { fz_rethrow(ctx); }
+  text_cache_write(cache_path, *text, fz_bound_display_list(ctx, list),
+                   *content_bounds);
+}
+
+/*
+ * Return a display list of the annotations and form widgets of PAGE, with
+ * BOUNDS, or NULL if it has none. Throws on errors.
+ */
+static fz_display_list *new_annot_list(fz_context *ctx, fz_page *page,
+                                       fz_rect bounds) {
+  fz_display_list *list = fz_new_display_list(ctx, bounds);
+  fz_device *device = NULL;
+  fz_var(device);
+  fz_try(ctx) {
+    device = fz_new_list_device(ctx, list);
+    fz_run_page_annots(ctx, page, device, fz_identity, NULL);
+    fz_run_page_widgets(ctx, page, device, fz_identity, NULL);
+    fz_close_device(ctx, device);
+  }
+  fz_always(ctx) { fz_drop_device(ctx, device); }
+  fz_catch(ctx) {
+    fz_drop_display_list(ctx, list);
+    fz_rethrow(ctx);
+  }
+  if (fz_is_empty_rect(fz_bound_display_list(ctx, list))) {
+    fz_drop_display_list(ctx, list);
+    return NULL;
+  }
+  return list;
+}
+
+/*
+ * Load the page at LOCATION of DOC into PAGE. DOC can be any of the handles
+ * of the document, as long as CTX is the context it's used with. The text and
+ * content bounds come from the text cache when they're there.
+ */
+void load_page_from(DocInfo *doci, fz_context *ctx, fz_document *doc,
+                    fz_location location, Page *page) {
   memset(page, 0, sizeof(*page));
+  page->loc = location;
+  char *cache_path = text_cache_path(doci, page_number(doci, location));
   fz_try(ctx) {
     page->page =
-        fz_load_chapter_page(ctx, doci->doc, location.chapter, location.page);
+        fz_load_chapter_page(ctx, doc, location.chapter, location.page);
     page->seps = NULL; // TODO seps
     page->links = fz_load_links(ctx, page->page);
     page->page_bounds = fz_bound_page(ctx, page->page);
+    build_link_grid(page);
     page->display_list = fz_new_display_list(ctx, page->page_bounds);
-    // populate display_list
+    // populate display_list; the annotations go to a list of their own, so
+    // that editing them doesn't render the content again
     fz_device *device = fz_new_list_device(ctx, page->display_list);
-    fz_try(ctx) { fz_run_page(ctx, page->page, device, fz_identity, NULL); }
+    fz_try(ctx) {
+      fz_run_page_contents(ctx, page->page, device, fz_identity, NULL);
+    }
     fz_always(ctx) {
       fz_close_device(ctx, device);
       fz_drop_device(ctx, device);
     }
     fz_catch(ctx) { fz_rethrow(ctx); }
+    page->annot_list = new_annot_list(ctx, page->page, page->page_bounds);
+    fz_rect bounds;
     page->page_text =
-        fz_new_stext_page_from_display_list(ctx, page->display_list, NULL);
+        text_cache_read(ctx, cache_path, &bounds, &page->content_bounds);
+    if (!page->page_text)
+      extract_display_list(ctx, page->display_list, cache_path,
+                           &page->page_text, &page->content_bounds);
+    page->char_count = count_chars(page->page_text);
+    build_word_grid(page);
   }
   fz_catch(ctx) {
     fprintf(stderr, "error loading page %d,%d: %s\n", location.chapter,
             location.page, fz_caught_message(ctx));
   }
+  g_free(cache_path);
   PageRenderCache *cache = &page->cache;
   cache->rendered.surface = NULL;
+  cache->rendered.partial = NULL;
   cache->selection.id = 0;
   cache->rendered.id = 0;
   cache->search.id = 0;
 }
 
-int prev_ind_in_page_cache(DocInfo *doci, int i) {
-  int new = (i + PAGE_CACHE_LEN - 1) % PAGE_CACHE_LEN;
-  if (doci->page_cache.pages[new].cache.rendered.is_in_progress) {
-    // TODO: will cause infinite loop in case everything is being rendered.
-    // should detect that and wait or something.
-    fprintf(stderr, "progress loop: new=%d\n", new);
-    return prev_ind_in_page_cache(doci, new);
-  }
-  return new;
+void load_page(DocInfo *doci, fz_location location, Page *page) {
+  load_page_from(doci, doci->ctx, doci->doc, location, page);
 }
 
 /*
- * Return a pointer to a Page object at location LOC. The pointer might be
- * invalidated as soon a new page is fetched via get_page (like strtok).
+ * Fill chapter_starts in order from the page count of each chapter, on a
+ * handle of our own so that the GTK thread and the page loads aren't held up.
+ * Once closing, or if the document can't be opened again, the chapters left
+ * are counted as empty, so that no one waits for them forever.
  */
-Page *get_page(DocInfo *doci, fz_location loc) {
-  for (int i = 0; i < PAGE_CACHE_LEN; i++) {
-    if (locationcmp(loc, doci->page_cache.locs[i]) == 0) {
-      return &doci->page_cache.pages[i];
+static gpointer thread_count_chapters(gpointer data) {
+  DocInfo *doci = data;
+  struct ChapterCount *cc = &doci->chapters;
+  fz_context *ctx = fz_clone_context(doci->ctx);
+  fz_document *doc = NULL;
+  fz_try(ctx) { doc = fz_open_document(ctx, doci->filename); }
+  fz_catch(ctx) {
+    fprintf(stderr, "cannot open document for counting pages: %s\n",
+            fz_caught_message(ctx));
+  }
+  int total = doci->chapter_starts[doci->chapter_count];
+  for (int i = 0; i < doci->chapter_count - 1; i++) {
+    int pages = 0;
+    if (doc && !g_atomic_int_get(&doci->is_closing)) {
+      fz_try(ctx) { pages = fz_count_chapter_pages(ctx, doc, i); }
+      fz_catch(ctx) {
+        fprintf(stderr, "cannot count the pages of chapter %d: %s\n", i,
+                fz_caught_message(ctx));
+      }
     }
+    g_mutex_lock(&cc->lock);
+    doci->chapter_starts[i + 1] = MIN(doci->chapter_starts[i] + pages, total);
+    g_atomic_int_set(&cc->done, i + 2);
+    g_cond_broadcast(&cc->cond);
+    g_mutex_unlock(&cc->lock);
   }
-  int new_first = prev_ind_in_page_cache(doci, doci->page_cache.first);
-  Page *res = &doci->page_cache.pages[new_first];
-  drop_page(doci->ctx, res);
-  load_page(doci, loc, res);
-  doci->page_cache.locs[new_first] = loc;
-  doci->page_cache.first = new_first;
-  return res;
+  g_mutex_lock(&cc->lock);
+  g_atomic_int_set(&cc->done, doci->chapter_count + 1);
+  g_cond_broadcast(&cc->cond);
+  g_mutex_unlock(&cc->lock);
+  fz_drop_document(ctx, doc);
+  fz_drop_context(ctx);
+  return NULL;
 }
 
-Page *get_cur_page(DocInfo *doci) { return get_page(doci, doci->location); }
-
-fz_matrix get_scale_ctm(DocInfo *doci, Page *page) {
-  return fz_transform_page(page->page_bounds, 72.0f * doci->zoom, doci->rotate);
+/*
+ * Start filling chapter_starts, so that page numbers and locations convert
+ * without walking the chapters. Only the number of pages in the document is
+ * counted right away, as the layout needs it; the start of each chapter is
+ * counted in the background by thread_count_chapters. That's a thread of its
+ * own rather than a job on the shared threads: page loads there, and the GTK
+ * thread, wait for it, so it mustn't wait in the queue behind them.
+ */
+static void count_chapters(DocInfo *doci) {
+  struct ChapterCount *cc = &doci->chapters;
+  doci->chapter_starts =
+      malloc((doci->chapter_count + 1) * sizeof(*doci->chapter_starts));
+  doci->chapter_starts[0] = 0;
+  doci->chapter_starts[doci->chapter_count] =
+      fz_count_pages(doci->ctx, doci->doc);
+  g_mutex_init(&cc->lock);
+  g_cond_init(&cc->cond);
+  cc->thread = NULL;
+  if (doci->chapter_count > 1) {
+    cc->done = 1;
+    cc->thread = g_thread_new("chapters", thread_count_chapters, doci);
+  } else {
+    cc->done = doci->chapter_count + 1;
+  }
 }
 
 /*
- * Get the position of POINT whithin the boundries of the current or next pages.
+ * Wait until chapter_starts is filled up to the start of CHAPTER, or past
+ * page N, and return the number of its entries filled so far.
  */
-static void trace_point_to_page(GtkWidget *widget, DocInfo *doci,
-                                fz_point point, fz_point *res,
-                                fz_location *loc) {
-  *loc = doci->location;
-  fz_context *ctx = doci->ctx;
-  fz_point stopped = fz_make_point(-doci->scroll.x, -doci->scroll.y);
-  Page *page = get_page(doci, *loc);
-  while (1) {
-    fz_matrix scale_ctm = get_scale_ctm(doci, page);
-    fz_matrix draw_page_ctm =
-        fz_concat(fz_translate(stopped.x, stopped.y), scale_ctm);
-    fz_matrix draw_page_inv = fz_invert_matrix(draw_page_ctm);
-    *res = fz_transform_point(point, draw_page_inv);
-    stopped.y += page->page_bounds.y1 + PAGE_SEPARATOR_HEIGHT;
-    page = get_page(doci, *loc);
-    if (res->y < page->page_bounds.y1 + PAGE_SEPARATOR_HEIGHT) {
-      break;
-    }
-    *loc = fz_next_page(ctx, doci->doc, *loc);
-  };
+static int wait_for_chapters(DocInfo *doci, int chapter, int n) {
+  struct ChapterCount *cc = &doci->chapters;
+  int done = g_atomic_int_get(&cc->done);
+  if (done > chapter || doci->chapter_starts[done - 1] > n)
+    return done;
+  g_mutex_lock(&cc->lock);
+  while ((done = cc->done) <= chapter && doci->chapter_starts[done - 1] <= n)
+    g_cond_wait(&cc->cond, &cc->lock);
+  g_mutex_unlock(&cc->lock);
+  return done;
+}
+
+int page_number(DocInfo *doci, fz_location loc) {
+  wait_for_chapters(doci, loc.chapter, G_MAXINT);
+  return doci->chapter_starts[loc.chapter] + loc.page;
+}
+
+fz_location location_from_page_number(DocInfo *doci, int n) {
+  int done = wait_for_chapters(doci, doci->chapter_count, n);
+  // last chapter starting at or before N
+  int lo = 0, hi = MIN(done, doci->chapter_count) - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (doci->chapter_starts[mid] <= n)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return fz_make_location(lo, n - doci->chapter_starts[lo]);
 }
 
 /*
- * Set scroll.x so the current page is centered.
+ * Pages are laid out in rows of layout.columns pages. The layout index is a
+ * Fenwick tree over the row heights, so that both the offset of a row from the
+ * start of the document and the row at an offset are found in O(log n).
+ * Separators are drawn with a fixed pixel height, so they're added per zoom
+ * level rather than stored.
  */
-static void center_page(int surface_width, DocInfo *doci) {
-  Page *page = get_cur_page(doci);
-  fz_matrix scale_ctm = get_scale_ctm(doci, page);
-  fz_rect scaled_bounds = fz_transform_rect(page->page_bounds, scale_ctm);
-  fz_matrix scale_ctm_inv = fz_invert_matrix(scale_ctm);
-  fz_point centered_page_start = fz_transform_point(
-      fz_make_point(((float)scaled_bounds.x1 - surface_width) / 2, 0),
-      scale_ctm_inv);
 
-  doci->scroll.x = centered_page_start.x;
+// height of the gap between pages, in unzoomed units
+static double separator_height(DocInfo *doci) {
+  return PAGE_SEPARATOR_HEIGHT / doci->zoom;
 }
 
-static void highlight_quads(Quads *quads, cairo_t *cr, fz_matrix ctm) {
-  for (int i = 0; i < quads->count; i++) {
-    fz_quad box = fz_transform_quad(quads->quads[i], ctm);
-    double gray = 0.909;
-    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0 - gray);
-    cairo_move_to(cr, box.ul.x, box.ul.y);
-    cairo_line_to(cr, box.ur.x, box.ur.y);
-    cairo_line_to(cr, box.lr.x, box.lr.y);
-    cairo_line_to(cr, box.ll.x, box.ll.y);
-    cairo_line_to(cr, box.ul.x, box.ul.y);
-    cairo_fill(cr);
+static int page_row(Layout *layout, int n) {
+  return (n + layout->first_column) / layout->columns;
+}
+
+static int row_first_page(Layout *layout, int row) {
+  return MAX(row * layout->columns - layout->first_column, 0);
+}
+
+// one past the last page of ROW
+static int row_end_page(Layout *layout, int row) {
+  return MIN((row + 1) * layout->columns - layout->first_column,
+             layout->page_count);
+}
+
+static float page_height(Layout *layout, int n) {
+  return layout->heights[n] ? layout->heights[n] : layout->estimate;
+}
+
+static float compute_row_height(Layout *layout, int row) {
+  float res = 0;
+  for (int n = row_first_page(layout, row); n < row_end_page(layout, row); n++)
+    res = fz_max(res, page_height(layout, n));
+  return res;
+}
+
+static void layout_add(Layout *layout, int row, double delta) {
+  for (int i = row + 1; i <= layout->row_count; i += i & -i)
+    layout->tree[i] += delta;
+}
+
+// sum of the heights of the rows before ROW
+static double layout_heights_before(Layout *layout, int row) {
+  double sum = 0;
+  for (int i = row; i > 0; i -= i & -i)
+    sum += layout->tree[i];
+  return sum;
+}
+
+// (re)build the rows from the page heights, after the columns changed
+static void layout_build_rows(Layout *layout) {
+  free(layout->row_heights);
+  free(layout->tree);
+  layout->row_count = page_row(layout, layout->page_count - 1) + 1;
+  layout->row_heights =
+      malloc(layout->row_count * sizeof(*layout->row_heights));
+  layout->tree = calloc(layout->row_count + 1, sizeof(*layout->tree));
+  for (int i = 1; i <= layout->row_count; i++) {
+    layout->row_heights[i - 1] = compute_row_height(layout, i - 1);
+    layout->tree[i] += layout->row_heights[i - 1];
+    int parent = i + (i & -i);
+    if (parent <= layout->row_count)
+      layout->tree[parent] += layout->tree[i];
   }
 }
 
-void get_selection_bounds_for_page(fz_context *ctx, DocInfo *doci,
-                                   fz_location loc, fz_point *res_start,
-                                   fz_point *res_end) {
-  Page *page = get_page(doci, loc);
-  if (locationcmp(doci->selection.loc_start, loc) > 0 ||
-      locationcmp(doci->selection.loc_end, loc) < 0) { // out of bounds
-    page->cache.selection.quads.count = 0;
+/*
+ * Index all pages of DOCI in a single column with height ESTIMATE until their
+ * real heights are known through layout_set_height.
+ */
+static void layout_init(DocInfo *doci, float estimate) {
+  Layout *layout = &doci->layout;
+  layout->page_count = doci->chapter_starts[doci->chapter_count];
+  layout->estimate = estimate;
+  layout->heights = calloc(layout->page_count, sizeof(*layout->heights));
+  layout->columns = 1;
+  layout->first_column = 0;
+  layout_build_rows(layout);
+}
+
+static void layout_drop(Layout *layout) {
+  free(layout->heights);
+  free(layout->row_heights);
+  free(layout->tree);
+}
+
+static void layout_set_height(DocInfo *doci, int n, float height) {
+  Layout *layout = &doci->layout;
+  if (n < 0 || n >= layout->page_count || layout->heights[n] == height)
     return;
-  }
-  if (locationcmp(doci->selection.loc_start, loc) < 0) {
-    res_start->x = page->page_bounds.x0;
-    res_start->y = page->page_bounds.y0;
-  } else { // loc == loc_start
-    *res_start = doci->selection.start;
-  }
-  if (locationcmp(loc, doci->selection.loc_end) != 0) {
-    res_end->x = page->page_bounds.x1;
-    res_end->y = page->page_bounds.y1;
-  } else { // loc == loc_start
-    *res_end = doci->selection.end;
-  }
-  fz_snap_selection(ctx, page->page_text, res_start, res_end,
-                    doci->selection.mode);
+  layout->heights[n] = height;
+  int row = page_row(layout, n);
+  float old = layout->row_heights[row];
+  layout->row_heights[row] = compute_row_height(layout, row);
+  layout_add(layout, row, layout->row_heights[row] - old);
+}
+
+// Return the content of PAGE with a little padding, or all of it if it's blank.
+static fz_rect content_bounds(Page *page) {
+  if (fz_is_empty_rect(page->content_bounds))
+    return page->page_bounds;
+  return fz_intersect_rect(fz_expand_rect(page->content_bounds, TRIM_PADDING),
+                           page->page_bounds);
+}
+
+// Return the part of PAGE that is shown, in page space.
+fz_rect view_bounds(DocInfo *doci, Page *page) {
+  return doci->trim_margins ? content_bounds(page) : page->page_bounds;
+}
+
+static float view_width(DocInfo *doci, Page *page) {
+  fz_rect bounds = view_bounds(doci, page);
+  return bounds.x1 - bounds.x0;
+}
+
+static float view_height(DocInfo *doci, Page *page) {
+  fz_rect bounds = view_bounds(doci, page);
+  return bounds.y1 - bounds.y0;
+}
+
+// record the height of a page that was just loaded into the page cache
+static void note_page_loaded(DocInfo *doci, Page *page) {
+  layout_set_height(doci, page_number(doci, page->loc),
+                    view_height(doci, page));
 }
 
 /*
- * Return a string of the text selection spanning on all the pages with
- * selection. It's your responsibility to free the returned pointer. *res_len is
- * set to the strlen of the return value.
- * Return NULL if no selection is available.
+ * Forget the page heights, e.g. after the shown part of pages changed, and
+ * index them again from the cached pages and ESTIMATE.
  */
-char *get_selection(GtkWidget *widget, size_t *res_len) {
-  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  if (!c->doci.selection.is_active)
-    return NULL;
-  char *res = NULL;
-  // oh, what would I do to use open_memstream. Not standardized though.
-  size_t len = 0;
-  size_t size = 0;
-  for (fz_location loc = c->doci.selection.loc_start;
-       locationcmp(loc, c->doci.selection.loc_end) <= 0;
-       loc = fz_next_page(c->doci.ctx, c->doci.doc, loc)) {
-    Page *page = get_page(&c->doci, loc);
-    fz_point sel_start, sel_end;
-    get_selection_bounds_for_page(c->doci.ctx, &c->doci, loc, &sel_start,
-                                  &sel_end);
-    char *page_sel =
-        fz_copy_selection(c->doci.ctx, page->page_text, sel_start, sel_end, 0);
-    size_t n = strlen(page_sel);
-    size_t new_len = n + len;
-    if (new_len > size) {
-      size = fz_maxi(new_len + 1, size * 2);
-      res = realloc(res, size);
-      if (!res)
-        return NULL;
-    }
-    memcpy(&res[len], page_sel, n);
-    len = new_len;
-    fz_free(c->doci.ctx, page_sel);
+static void layout_reset(DocInfo *doci, float estimate) {
+  Layout *layout = &doci->layout;
+  memset(layout->heights, 0, layout->page_count * sizeof(*layout->heights));
+  layout->estimate = estimate;
+  for (int i = 0; i < doci->page_cache.len; i++) {
+    fz_location loc = doci->page_cache.locs[i];
+    if (loc.chapter >= 0)
+      layout->heights[page_number(doci, loc)] =
+          view_height(doci, doci->page_cache.pages[i]);
   }
-  if (res)
-    res[len] = '\0';
-  *res_len = len;
-  return res;
+  layout_build_rows(layout);
 }
 
-void ensure_selection_cache_is_updated(fz_context *ctx, DocInfo *doci,
-                                       fz_location loc) {
-  Page *page = get_page(doci, loc);
-  if (page->cache.selection.id == doci->selection.id)
-    return;
-  fz_point sel_start, sel_end;
-  get_selection_bounds_for_page(ctx, doci, loc, &sel_start, &sel_end);
-  page->cache.selection.id = doci->selection.id;
-  int max_count = 256;
-  int count;
-  do {
-    page->cache.selection.quads.quads =
-        realloc(page->cache.selection.quads.quads, max_count * sizeof(fz_quad));
-    count =
-        fz_highlight_selection(ctx, page->page_text, sel_start, sel_end,
-                               page->cache.selection.quads.quads, max_count);
-    max_count *= 2;
-  } while (count == max_count);
-  page->cache.selection.quads.count = count;
-}
-
-void ensure_search_cache_is_updated(fz_context *ctx, DocInfo *doci, Page *page,
-                                    char *search) {
-  if (page->cache.search.id == doci->search_id)
-    return;
-  page->cache.search.id = doci->search_id;
-  int max_count = 256;
-  int count;
-  do {
-    page->cache.search.quads.quads =
-        realloc(page->cache.search.quads.quads, max_count * sizeof(fz_quad));
-    count = fz_search_stext_page(ctx, page->page_text, search,
-                                 page->cache.search.quads.quads, max_count);
-    max_count *= 2;
-  } while (count == max_count);
-  page->cache.search.quads.count = count;
+// offset of the top of ROW from the start of the document
+double layout_offset(DocInfo *doci, int row) {
+  return layout_heights_before(&doci->layout, row) +
+         row * separator_height(doci);
 }
 
-// doesn't render selection or search results and such, only raw page
-cairo_surface_t *render_page(fz_context *ctx, DocInfo *doci, Page *page) {
-  fz_matrix scale_ctm = get_scale_ctm(doci, page);
-  fz_rect float_bounds = fz_transform_rect(page->page_bounds, scale_ctm);
-  fz_irect bounds = fz_round_rect(float_bounds);
-  cairo_surface_t *surface =
-      cairo_image_surface_create(CAIRO_FORMAT_RGB24, bounds.x1, bounds.y1);
+double layout_total_height(DocInfo *doci) {
+  return layout_offset(doci, doci->layout.row_count);
+}
 
-  unsigned char *image = cairo_image_surface_get_data(surface);
-  fz_pixmap *pixmap = NULL;
-  fz_device *draw_device = NULL;
-  fz_try(ctx) {
-    pixmap = fz_new_pixmap_with_bbox_and_data(ctx, doci->colorspace, bounds,
-                                              NULL, 1, image);
-    fz_clear_pixmap_with_value(ctx, pixmap, 0xFF);
-    draw_device = fz_new_draw_device(ctx, fz_identity, pixmap);
-    fz_run_display_list(ctx, page->display_list, draw_device, scale_ctm,
-                        float_bounds, NULL);
+/*
+ * Return the row OFFSET falls on, and set *REST to the offset within that
+ * row. Offsets past the end fall on the last row.
+ */
+int layout_find(DocInfo *doci, double offset, double *rest) {
+  Layout *layout = &doci->layout;
+  double sep = separator_height(doci);
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= layout->row_count)
+    step *= 2;
+  for (; step > 0; step /= 2) {
+    int next = pos + step;
+    if (next <= layout->row_count &&
+        layout->tree[next] + step * sep <= offset) {
+      pos = next;
+      offset -= layout->tree[next] + step * sep;
+    }
   }
-  fz_catch(ctx) {
-    fprintf(stderr, "Failed allocations: %s\n", fz_caught_message(ctx));
+  if (pos >= layout->row_count) {
+    pos = layout->row_count - 1;
+    offset += layout_offset(doci, layout->row_count) -
+              layout_offset(doci, pos);
   }
-  fz_close_device(ctx, draw_device);
-  fz_drop_device(ctx, draw_device);
-  fz_drop_pixmap(ctx, pixmap);
-  cairo_surface_mark_dirty(surface);
-  return surface;
+  *rest = offset;
+  return pos;
 }
 
-// wraps args to render for passing into g_thread_pool_push
-struct RenderArgs {
-  unsigned int rendered_id;
-  Page *page;
+// a function with a valid signature for g_idle_add; unpins the pages
+static gboolean end_page_frame(void *data) {
+  struct PageCache *page_cache = data;
+  page_cache->frame++;
+  page_cache->frame_idle = 0;
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Keep the page in slot I from being evicted until the GTK thread goes back
+ * to the main loop, so that the pages a frame, or an event handler, holds
+ * stay valid however many others it loads.
+ */
+static void pin_page(DocInfo *doci, int i) {
+  struct PageCache *page_cache = &doci->page_cache;
+  page_cache->pinned[i] = page_cache->frame;
+  if (!page_cache->frame_idle)
+    page_cache->frame_idle = g_idle_add_full(G_PRIORITY_HIGH, end_page_frame,
+                                             page_cache, NULL);
+}
+
+static gboolean is_evictable(DocInfo *doci, int i) {
+  struct PageCache *page_cache = &doci->page_cache;
+  return !page_cache->pages[i]->cache.rendered.is_in_progress &&
+         !page_cache->pages[i]->cache.annots.is_in_progress &&
+         !(page_cache->frame_idle &&
+           page_cache->pinned[i] == page_cache->frame);
+}
+
+// Return the cached Page object at location LOC, or NULL if it isn't cached.
+Page *find_cached_page(DocInfo *doci, fz_location loc) {
+  for (int i = 0; i < doci->page_cache.len; i++) {
+    if (locationcmp(loc, doci->page_cache.locs[i]) == 0) {
+      pin_page(doci, i);
+      return doci->page_cache.pages[i];
+    }
+  }
+  return NULL;
+}
+
+// Set the page cache up with PAGE_CACHE_LEN empty slots.
+static void init_page_cache(struct PageCache *page_cache) {
+  page_cache->len = PAGE_CACHE_LEN;
+  page_cache->pages = malloc(PAGE_CACHE_LEN * sizeof(*page_cache->pages));
+  for (int i = 0; i < PAGE_CACHE_LEN; i++)
+    page_cache->pages[i] = calloc(1, sizeof(Page));
+  // invalidate location keys on the page cache
+  page_cache->locs = malloc(PAGE_CACHE_LEN * sizeof(*page_cache->locs));
+  memset(page_cache->locs, -1, PAGE_CACHE_LEN * sizeof(*page_cache->locs));
+  page_cache->pinned = calloc(PAGE_CACHE_LEN, sizeof(*page_cache->pinned));
+}
+
+static void resize_page_cache(struct PageCache *page_cache, int len) {
+  page_cache->len = len;
+  page_cache->pages =
+      realloc(page_cache->pages, len * sizeof(*page_cache->pages));
+  page_cache->locs = realloc(page_cache->locs, len * sizeof(*page_cache->locs));
+  page_cache->pinned =
+      realloc(page_cache->pinned, len * sizeof(*page_cache->pinned));
+}
+
+// Move the slots from I on by DELTA, within the first LEN.
+static void shift_page_cache_slots(struct PageCache *page_cache, int i,
+                                   int len, int delta) {
+  memmove(&page_cache->pages[i + delta], &page_cache->pages[i],
+          (len - i) * sizeof(*page_cache->pages));
+  memmove(&page_cache->locs[i + delta], &page_cache->locs[i],
+          (len - i) * sizeof(*page_cache->locs));
+  memmove(&page_cache->pinned[i + delta], &page_cache->pinned[i],
+          (len - i) * sizeof(*page_cache->pinned));
+}
+
+/*
+ * Drop the oldest pages while the cache holds more than PAGE_CACHE_LEN and
+ * they can be evicted.
+ */
+static void shrink_page_cache(DocInfo *doci) {
+  struct PageCache *page_cache = &doci->page_cache;
+  while (page_cache->len > PAGE_CACHE_LEN) {
+    int len = page_cache->len;
+    int oldest = (page_cache->first + len - 1) % len;
+    if (!is_evictable(doci, oldest))
+      break;
+    Page *page = page_cache->pages[oldest];
+    drop_page(doci->ctx, page);
+    free(page);
+    shift_page_cache_slots(page_cache, oldest + 1, len, -1);
+    if (oldest < page_cache->first)
+      page_cache->first--;
+    resize_page_cache(page_cache, len - 1);
+  }
+}
+
+/*
+ * Evict the oldest page that's neither pinned nor rendering and return its
+ * slot, now keyed by LOC and pinned. draw_callback pins fewer pages than the
+ * cache holds, but if every other slot is rendering, the cache grows by a
+ * slot instead of waiting for a render on the GTK thread, and shrinks back
+ * once the renders are done.
+ */
+static Page *take_page_cache_slot(DocInfo *doci, fz_location loc) {
+  struct PageCache *page_cache = &doci->page_cache;
+  shrink_page_cache(doci);
+  int len = page_cache->len;
+  int slot = -1;
+  for (int i = 1; i <= len && slot < 0; i++) {
+    int j = (page_cache->first + len - i) % len;
+    if (is_evictable(doci, j))
+      slot = j;
+  }
+  Page *res;
+  if (slot >= 0) {
+    res = page_cache->pages[slot];
+    drop_page(doci->ctx, res);
+  } else {
+    // the new slot goes in front of the newest page, keeping their order
+    slot = page_cache->first;
+    resize_page_cache(page_cache, len + 1);
+    shift_page_cache_slots(page_cache, slot, len, 1);
+    res = page_cache->pages[slot] = calloc(1, sizeof(*res));
+  }
+  page_cache->locs[slot] = loc;
+  page_cache->first = slot;
+  pin_page(doci, slot);
+  return res;
+}
+
+/*
+ * Return a pointer to a Page object at location LOC. The pointer stays valid
+ * until the GTK thread goes back to the main loop, see pin_page.
+ */
+Page *get_page(DocInfo *doci, fz_location loc) {
+  Page *res = find_cached_page(doci, loc);
+  if (res)
+    return res;
+  res = take_page_cache_slot(doci, loc);
+  load_page(doci, loc, res);
+  note_page_loaded(doci, res);
+  return res;
+}
+
+void thread_load(gpointer data, gpointer user_data) {
+  DocInfo *doci = user_data;
+  struct LoadArgs *la = data;
+  DocInstance *inst = g_async_queue_pop(doci->instances.idle);
+  la->page = malloc(sizeof(*la->page));
+  load_page_from(doci, inst->ctx, inst->doc, la->loc, la->page);
+  // fz_page objects belong to the document handle they were loaded from
+  fz_drop_page(inst->ctx, la->page->page);
+  la->page->page = NULL;
+  g_async_queue_push(doci->instances.idle, inst);
+  la->done(la);
+}
+
+/*
+ * Load the page at LA->loc on one of the document instances.
+ * LA->done is called from the loading thread when it's done.
+ */
+void load_page_in_background(DocInfo *doci, struct LoadArgs *la) {
+  la->doci = doci;
+  schedule_instance_job(doci, TIER_LOAD, thread_load, la);
+}
+
+static gboolean is_prefetching(DocInfo *doci, fz_location loc) {
+  for (int i = 0; i < doci->instances.prefetching_count; i++) {
+    if (locationcmp(doci->instances.prefetching[i], loc) == 0)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+// runs on the GTK thread; moves the prefetched page into the page cache
+static gboolean insert_prefetched_page(void *data) {
+  struct LoadArgs *la = data;
+  DocInfo *doci = la->doci;
+  struct DocInstances *instances = &doci->instances;
+  for (int i = 0; i < instances->prefetching_count; i++) {
+    if (locationcmp(instances->prefetching[i], la->loc) == 0) {
+      instances->prefetching[i] =
+          instances->prefetching[--instances->prefetching_count];
+      break;
+    }
+  }
+  if (find_cached_page(doci, la->loc)) {
+    drop_page(doci->ctx, la->page);
+  } else {
+    Page *page = take_page_cache_slot(doci, la->loc);
+    *page = *la->page;
+    note_page_loaded(doci, page);
+    // let draw_callback prerender it
+    gtk_widget_queue_draw(la->widget);
+  }
+  free(la->page);
+  g_object_unref(la->widget);
+  free(la);
+  return FALSE;
+}
+
+static void prefetch_done(struct LoadArgs *la) {
+  gdk_threads_add_idle(insert_prefetched_page, la);
+}
+
+/*
+ * Like get_page, but if the page isn't cached, load it on a background
+ * document instance and return NULL; WIDGET is redrawn once it's loaded.
+ * Without background instances this just calls get_page.
+ */
+Page *get_page_async(DocInfo *doci, GtkWidget *widget, fz_location loc) {
+  if (doci->instances.count == 0)
+    return get_page(doci, loc);
+  Page *res = find_cached_page(doci, loc);
+  if (res || is_prefetching(doci, loc) ||
+      doci->instances.prefetching_count == PAGE_CACHE_LEN)
+    return res;
+  doci->instances.prefetching[doci->instances.prefetching_count++] = loc;
+  struct LoadArgs *la = malloc(sizeof(*la));
+  la->loc = loc;
+  // until insert_prefetched_page, like the widget of a BackgroundJob
+  la->widget = g_object_ref(widget);
+  la->done = prefetch_done;
+  load_page_in_background(doci, la);
+  return NULL;
+}
+
+Page *get_cur_page(DocInfo *doci) { return get_page(doci, doci->location); }
+
+fz_matrix get_scale_ctm(DocInfo *doci, Page *page) {
+  return fz_transform_page(view_bounds(doci, page), 72.0f * doci->zoom,
+                           doci->rotate);
+}
+
+/*
+ * Load the pages of ROW into PAGES, and set X[i] to the offset of the left
+ * edge of PAGES[i] from the left edge of the row, in unzoomed units. Return
+ * the number of pages; the width of the row is returned in *WIDTH unless it's
+ * NULL.
+ */
+static int get_row(DocInfo *doci, int row, Page *pages[MAX_COLUMNS],
+                   float x[MAX_COLUMNS], float *width) {
+  Layout *layout = &doci->layout;
+  int first = row_first_page(layout, row);
+  int count = row_end_page(layout, row) - first;
+  float sep = separator_height(doci);
+  float left = 0;
+  for (int i = 0; i < count; i++) {
+    pages[i] = get_page(doci, location_from_page_number(doci, first + i));
+    if (row == 0 && i == 0)
+      // leave the left side of the first spread empty, as in a book
+      left = layout->first_column * (view_width(doci, pages[0]) + sep);
+    x[i] = left;
+    left += view_width(doci, pages[i]) + sep;
+  }
+  if (width)
+    *width = left - sep;
+  return count;
+}
+
+static int cur_row(DocInfo *doci) {
+  return page_row(&doci->layout, page_number(doci, doci->location));
+}
+
+// offset of the top of the view from the start of the document
+static double view_offset(DocInfo *doci) {
+  return layout_offset(doci, cur_row(doci)) + doci->scroll.y;
+}
+
+/*
+ * Get the position of POINT whithin the boundries of the current or next pages.
+ */
+static void trace_point_to_page(GtkWidget *widget, DocInfo *doci,
+                                fz_point point, fz_point *res,
+                                fz_location *loc) {
+  Page *page = get_cur_page(doci);
+  fz_point unscaled =
+      fz_transform_vector(point, fz_invert_matrix(get_scale_ctm(doci, page)));
+  double top = view_offset(doci);
+  double rest;
+  int row = layout_find(doci, top + unscaled.y, &rest);
+  Page *pages[MAX_COLUMNS];
+  float x[MAX_COLUMNS];
+  int i = get_row(doci, row, pages, x, NULL) - 1;
+  // points between pages belong to the page on their left
+  while (i > 0 && doci->scroll.x + unscaled.x < x[i])
+    i--;
+  *loc = pages[i]->loc;
+  fz_point stopped =
+      fz_make_point(x[i] - doci->scroll.x, layout_offset(doci, row) - top);
+  fz_matrix draw_page_ctm = fz_concat(fz_translate(stopped.x, stopped.y),
+                                      get_scale_ctm(doci, pages[i]));
+  *res = fz_transform_point(point, fz_invert_matrix(draw_page_ctm));
+}
+
+/*
+ * Set scroll.x so the current row of pages is centered.
+ */
+static void center_page(int surface_width, DocInfo *doci) {
+  Page *pages[MAX_COLUMNS];
+  float x[MAX_COLUMNS];
+  float width;
+  get_row(doci, cur_row(doci), pages, x, &width);
+  fz_matrix scale_ctm = get_scale_ctm(doci, pages[0]);
+  fz_point scaled_width =
+      fz_transform_vector(fz_make_point(width, 0), scale_ctm);
+  fz_matrix scale_ctm_inv = fz_invert_matrix(scale_ctm);
+  fz_point centered_page_start = fz_transform_vector(
+      fz_make_point((scaled_width.x - surface_width) / 2, 0), scale_ctm_inv);
+
+  doci->scroll.x = centered_page_start.x;
+}
+
+static void fill_quad(cairo_t *cr, fz_quad quad, fz_matrix ctm) {
+  fz_quad box = fz_transform_quad(quad, ctm);
+  cairo_move_to(cr, box.ul.x, box.ul.y);
+  cairo_line_to(cr, box.ur.x, box.ur.y);
+  cairo_line_to(cr, box.lr.x, box.lr.y);
+  cairo_line_to(cr, box.ll.x, box.ll.y);
+  cairo_line_to(cr, box.ul.x, box.ul.y);
+  cairo_fill(cr);
+}
+
+static void highlight_quads(Quads *quads, cairo_t *cr, fz_matrix ctm) {
+  for (int i = 0; i < quads->count; i++) {
+    double gray = 0.909;
+    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0 - gray);
+    fill_quad(cr, quads->quads[i], ctm);
+  }
+}
+
+/*
+ * Return the text of the page at LOC of DOC, from the text cache or else
+ * loaded anew without going into the page cache, or NULL on failure.
+ */
+static fz_stext_page *load_page_text(DocInfo *doci, fz_context *ctx,
+                                     fz_document *doc, fz_location loc) {
+  char *cache_path = text_cache_path(doci, page_number(doci, loc));
+  fz_rect bounds, content_bounds;
+  fz_stext_page *text = text_cache_read(ctx, cache_path, &bounds,
+                                        &content_bounds);
+  if (text) {
+    g_free(cache_path);
+    return text;
+  }
+  fz_page *page = NULL;
+  fz_display_list *list = NULL;
+  fz_var(page);
+  fz_var(text);
+  fz_var(list);
+  fz_try(ctx) {
+    page = fz_load_chapter_page(ctx, doc, loc.chapter, loc.page);
+    // without annotations, like load_page_from, which shares the cache
+    list = fz_new_display_list_from_page_contents(ctx, page);
+    extract_display_list(ctx, list, cache_path, &text, &content_bounds);
+  }
+  fz_always(ctx) {
+    fz_drop_display_list(ctx, list);
+    fz_drop_page(ctx, page);
+    g_free(cache_path);
+  }
+  fz_catch(ctx) {
+    fprintf(stderr, "error extracting text of page %d,%d: %s\n", loc.chapter,
+            loc.page, fz_caught_message(ctx));
+  }
+  return text;
+}
+
+/*
+ * Set *RES_START and *RES_END to where SEL starts and ends on the page at LOC,
+ * with BOUNDS and TEXT, snapped to the text. Return FALSE if the page has no
+ * part of SEL.
+ */
+static gboolean selection_bounds(fz_context *ctx, struct Selection *sel,
+                                 fz_location loc, fz_rect bounds,
+                                 fz_stext_page *text, fz_point *res_start,
+                                 fz_point *res_end) {
+  if (locationcmp(sel->loc_start, loc) > 0 ||
+      locationcmp(sel->loc_end, loc) < 0) // out of bounds
+    return FALSE;
+  if (locationcmp(sel->loc_start, loc) < 0) {
+    res_start->x = bounds.x0;
+    res_start->y = bounds.y0;
+  } else { // loc == loc_start
+    *res_start = sel->start;
+  }
+  if (locationcmp(loc, sel->loc_end) != 0) {
+    res_end->x = bounds.x1;
+    res_end->y = bounds.y1;
+  } else { // loc == loc_end
+    *res_end = sel->end;
+  }
+  fz_snap_selection(ctx, text, res_start, res_end, sel->mode);
+  return TRUE;
+}
+
+// Return FALSE if the page at LOC has no part of the selection.
+gboolean get_selection_bounds_for_page(fz_context *ctx, DocInfo *doci,
+                                       fz_location loc, fz_point *res_start,
+                                       fz_point *res_end) {
+  Page *page = get_page(doci, loc);
+  if (!selection_bounds(ctx, &doci->selection, loc, page->page_bounds,
+                        page->page_text, res_start, res_end)) {
+    page->cache.selection.quads.count = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * Return the text SEL covers on the page at LOC, with BOUNDS and TEXT, or
+ * NULL if none.
+ */
+static char *copy_page_selection(fz_context *ctx, struct Selection *sel,
+                                 fz_location loc, fz_rect bounds,
+                                 fz_stext_page *text) {
+  fz_point start, end;
+  if (!text ||
+      !selection_bounds(ctx, sel, loc, bounds, text, &start, &end))
+    return NULL;
+  char *copy = NULL, *res = NULL;
+  fz_var(copy);
+  fz_try(ctx) {
+    copy = fz_copy_selection(ctx, text, start, end, 0);
+    res = g_strdup(copy);
+  }
+  fz_always(ctx) { fz_free(ctx, copy); }
+  fz_catch(ctx) {
+    fprintf(stderr, "error copying selection of page %d,%d: %s\n",
+            loc.chapter, loc.page, fz_caught_message(ctx));
+  }
+  return res;
+}
+
+/*
+ * Like copy_page_selection, for a page loaded anew from DOC that never goes
+ * into the page cache.
+ */
+static char *copy_selection_from(DocInfo *doci, fz_context *ctx,
+                                 fz_document *doc, struct Selection *sel,
+                                 fz_location loc) {
+  fz_stext_page *text = load_page_text(doci, ctx, doc, loc);
+  // load_page_text bounds the text like the page
+  char *res = text ? copy_page_selection(ctx, sel, loc, text->mediabox, text)
+                   : NULL;
+  fz_drop_stext_page(ctx, text);
+  return res;
+}
+
+// the pages of a selection being extracted by copy_selection
+struct SelectionCopy {
+  DocInfo *doci;
+  struct Selection sel;
+  fz_location *locs;
+  char **texts; // of each page; filled in from the page cache beforehand
+  gboolean *is_done;
+  int count;
+  int next;      // atomic; the next page a job takes
+  int jobs_left; // atomic
+  // holds a reference for start_selection_copy; NULL while copy_selection
+  // waits for the jobs instead
   GtkWidget *widget;
+  GMutex lock;
+  GCond cond;
+  gboolean is_finished; // protected by lock
 };
-void thread_render(gpointer data, gpointer user_data);
-
-// if page is not available yet, returns NULL and gtk_widget_queue_draw would
-// later be called from another thread to update the rendering.
-cairo_surface_t *get_rendered_page_(DocInfo *doci, GtkWidget *widget,
-                                    Page *page) {
-  struct CachedSurface *prc = &page->cache.rendered;
-  if (prc->id != doci->rendered_id) {
-    prc->id = doci->rendered_id;
-    struct RenderArgs *ra = malloc(sizeof(*ra));
-    ra->page = page;
-    ra->rendered_id = prc->id;
-    ra->widget = widget;
 
-    if (doci->zoom > MAX_APPROXIMATE_ZOOM) {
-      // render in this thread instead of using thread pool
-      thread_render(ra, doci);
+/*
+ * Return the pages of SEL to extract, with those in the page cache copied
+ * from there already, and set *MISSING to how many aren't.
+ */
+static struct SelectionCopy *new_selection_copy(DocInfo *doci,
+                                                struct Selection *sel,
+                                                int *missing) {
+  int count = 0;
+  for (fz_location loc = sel->loc_start; locationcmp(loc, sel->loc_end) <= 0;
+       loc = fz_next_page(doci->ctx, doci->doc, loc)) {
+    count++;
+    if (locationcmp(fz_next_page(doci->ctx, doci->doc, loc), loc) == 0)
+      break;
+  }
+  struct SelectionCopy *sc = calloc(1, sizeof(*sc));
+  sc->doci = doci;
+  sc->sel = *sel;
+  sc->count = count;
+  sc->locs = malloc(MAX(count, 1) * sizeof(*sc->locs));
+  sc->texts = calloc(MAX(count, 1), sizeof(*sc->texts));
+  sc->is_done = calloc(MAX(count, 1), sizeof(*sc->is_done));
+  g_mutex_init(&sc->lock);
+  g_cond_init(&sc->cond);
+  *missing = 0;
+  fz_location loc = sel->loc_start;
+  for (int i = 0; i < count; i++) {
+    sc->locs[i] = loc;
+    Page *page = find_cached_page(doci, loc);
+    if (page) {
+      sc->texts[i] = copy_page_selection(doci->ctx, sel, loc,
+                                         page->page_bounds, page->page_text);
+      sc->is_done[i] = TRUE;
     } else {
-      prc->is_in_progress = 1;
-      g_thread_pool_push(doci->page_cache.render_pool, ra, NULL);
+      (*missing)++;
     }
-    /* TODO save the amount of time it took to render and if short enough call
-     * thread_render(ra, doci); ourselves instead an approximation */
+    loc = fz_next_page(doci->ctx, doci->doc, loc);
   }
-  if (prc->is_in_progress) {
-    return NULL;
+  return sc;
+}
+
+static void free_selection_copy(struct SelectionCopy *sc) {
+  for (int i = 0; i < sc->count; i++)
+    g_free(sc->texts[i]);
+  free(sc->locs);
+  free(sc->texts);
+  free(sc->is_done);
+  g_mutex_clear(&sc->lock);
+  g_cond_clear(&sc->cond);
+  free(sc);
+}
+
+// Return the text of the pages of SC joined, which *RES_LEN is set to the
+// length of.
+static char *join_selection_copy(struct SelectionCopy *sc, size_t *res_len) {
+  size_t len = 0;
+  for (int i = 0; i < sc->count; i++)
+    len += sc->texts[i] ? strlen(sc->texts[i]) : 0;
+  char *res = malloc(len + 1);
+  char *p = res;
+  for (int i = 0; i < sc->count; i++) {
+    if (!sc->texts[i])
+      continue;
+    size_t n = strlen(sc->texts[i]);
+    memcpy(p, sc->texts[i], n);
+    p += n;
   }
-  return prc->surface;
+  *p = '\0';
+  *res_len = len;
+  return res;
+}
+
+static gboolean selection_copied(void *data);
+
+// a job on the shared threads; extracts pages on an instance until none are
+// left, and the last job to finish hands the copy back
+static void thread_copy_selection(gpointer data, gpointer user_data) {
+  struct SelectionCopy *sc = data;
+  DocInfo *doci = user_data;
+  if (!g_atomic_int_get(&doci->is_closing)) {
+    DocInstance *inst = g_async_queue_pop(doci->instances.idle);
+    for (int i; (i = g_atomic_int_add(&sc->next, 1)) < sc->count;)
+      if (!sc->is_done[i])
+        sc->texts[i] = copy_selection_from(doci, inst->ctx, inst->doc,
+                                           &sc->sel, sc->locs[i]);
+    g_async_queue_push(doci->instances.idle, inst);
+  }
+  if (!g_atomic_int_dec_and_test(&sc->jobs_left))
+    return;
+  if (sc->widget) {
+    gdk_threads_add_idle(selection_copied, sc);
+    return;
+  }
+  g_mutex_lock(&sc->lock);
+  sc->is_finished = TRUE;
+  g_cond_signal(&sc->cond);
+  g_mutex_unlock(&sc->lock);
+}
+
+// Queue the jobs extracting the MISSING pages of SC, one per instance at most.
+static void schedule_selection_copy(DocInfo *doci, struct SelectionCopy *sc,
+                                    int missing) {
+  int jobs = MIN(doci->instances.count, missing);
+  sc->jobs_left = jobs;
+  for (int i = 0; i < jobs; i++)
+    schedule_instance_job(doci, TIER_COPY, thread_copy_selection, sc);
 }
+
 /*
- * Draw page.
- * cr: the surface to draw on
- * translation: x,y position to offset the drawing on
- *
- * This is a wrapper around get_rendered_page_ that pre-renders next and
- * previous pages, and uses an approximation for the drawn page if a full-res
- * version is not avaliable yet.
+ * Return the text of SEL, which *RES_LEN is set to the length of. Pages in
+ * the page cache are copied from there; the others are loaded anew, in
+ * parallel on the document instances, and dropped right after, so that
+ * copying a long selection doesn't evict the pages on display. This waits
+ * for them on the GTK thread, which only the clipboard may do, as it has to
+ * hand the text over before returning; see start_selection_copy otherwise.
  */
-void draw_page_pixmap(cairo_t *cr, fz_point translation, DocInfo *doci,
-                      GtkWidget *widget, Page *page) {
-  fz_location loc = {page->page->chapter, page->page->number};
+static char *copy_selection(DocInfo *doci, struct Selection *sel,
+                            size_t *res_len) {
+  int missing;
+  struct SelectionCopy *sc = new_selection_copy(doci, sel, &missing);
+  if (missing > 0 && doci->instances.count > 0) {
+    schedule_selection_copy(doci, sc, missing);
+    g_mutex_lock(&sc->lock);
+    while (!sc->is_finished)
+      g_cond_wait(&sc->cond, &sc->lock);
+    g_mutex_unlock(&sc->lock);
+  } else {
+    for (int i = 0; i < sc->count; i++)
+      if (!sc->is_done[i])
+        sc->texts[i] = copy_selection_from(doci, doci->ctx, doci->doc,
+                                           &sc->sel, sc->locs[i]);
+  }
+  char *res = join_selection_copy(sc, res_len);
+  free_selection_copy(sc);
+  return res;
+}
+
+// runs on the GTK thread; keeps the text of SC for take_copied_selection
+// unless another copy was started since
+static gboolean selection_copied(void *data) {
+  struct SelectionCopy *sc = data;
+  GtkWidget *widget = sc->widget;
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct SelectionText *st = &c->doci.selection_text;
+  if (st->copy == sc) {
+    st->copy = NULL;
+    free(st->text);
+    st->text = join_selection_copy(sc, &st->len);
+    g_signal_emit(widget, signals[SIGNAL_SELECTION_COPIED], 0);
+  }
+  free_selection_copy(sc);
+  g_object_unref(widget);
+  return FALSE;
+}
+
+// extracts the next page on the GTK thread, for documents without instances
+static gboolean copy_next_page(void *data) {
+  struct SelectionCopy *sc = data;
+  DocInfo *doci = sc->doci;
+  while (sc->next < sc->count && sc->is_done[sc->next])
+    sc->next++;
+  if (doci->selection_text.copy != sc || sc->next == sc->count)
+    return selection_copied(sc);
+  int i = sc->next++;
+  sc->texts[i] =
+      copy_selection_from(doci, doci->ctx, doci->doc, &sc->sel, sc->locs[i]);
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Start extracting the text of the selection like copy_selection, but
+ * without waiting for it; selection-copied is emitted once
+ * take_copied_selection has it. A copy that's still running is dropped.
+ * Return FALSE if there's no selection.
+ */
+gboolean start_selection_copy(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  if (!doci->selection.is_active)
+    return FALSE;
+  int missing;
+  struct SelectionCopy *sc =
+      new_selection_copy(doci, &doci->selection, &missing);
+  // until selection_copied, like the widget of a BackgroundJob; the copy is
+  // split into jobs of its own, which a clipboard request may wait for
+  sc->widget = g_object_ref(widget);
+  doci->selection_text.copy = sc;
+  if (missing > 0 && doci->instances.count > 0)
+    schedule_selection_copy(doci, sc, missing);
+  else
+    g_idle_add_full(G_PRIORITY_LOW, copy_next_page, sc, NULL);
+  return TRUE;
+}
+
+/*
+ * Return the text start_selection_copy extracted, which *RES_LEN is set to
+ * the length of, or NULL if there's none. It's your responsibility to free
+ * the returned pointer.
+ */
+char *take_copied_selection(GtkWidget *widget, size_t *res_len) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct SelectionText *st = &c->doci.selection_text;
+  char *text = st->text;
+  *res_len = st->len;
+  st->text = NULL;
+  return text;
+}
+
+// Return the number of pages the selection spans, 0 if there's none.
+int get_selection_page_count(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  if (!doci->selection.is_active)
+    return 0;
+  return page_number(doci, doci->selection.loc_end) -
+         page_number(doci, doci->selection.loc_start) + 1;
+}
+
+// the selection offered to the clipboard by copy_selection_lazily
+struct ClipboardSelection {
+  GtkWidget *widget;
+  struct Selection sel;
+};
+
+static void clipboard_get(GtkClipboard *clipboard, GtkSelectionData *data,
+                          guint info, gpointer user_data) {
+  struct ClipboardSelection *cs = user_data;
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(cs->widget));
+  size_t len;
+  char *text = copy_selection(&c->doci, &cs->sel, &len);
+  gtk_selection_data_set_text(data, text, len);
+  free(text);
+}
+
+static void clipboard_clear(GtkClipboard *clipboard, gpointer user_data) {
+  struct ClipboardSelection *cs = user_data;
+  g_object_unref(cs->widget);
+  free(cs);
+}
+
+/*
+ * Offer the selection to the clipboard without copying its text, which is
+ * only extracted when it's pasted. The clipboard keeps the document open
+ * until something else is copied. Return FALSE if there's no selection.
+ */
+gboolean copy_selection_lazily(GtkWidget *widget) {
+  static const GtkTargetEntry targets[] = {
+      {"UTF8_STRING", 0, 0},
+      {"text/plain;charset=utf-8", 0, 0},
+      {"STRING", 0, 0},
+      {"TEXT", 0, 0},
+  };
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  if (!c->doci.selection.is_active)
+    return FALSE;
+  struct ClipboardSelection *cs = malloc(sizeof(*cs));
+  cs->widget = g_object_ref(widget);
+  cs->sel = c->doci.selection;
+  GtkClipboard *clipboard =
+      gtk_widget_get_clipboard(widget, GDK_SELECTION_CLIPBOARD);
+  if (!gtk_clipboard_set_with_data(clipboard, targets, G_N_ELEMENTS(targets),
+                                   clipboard_get, clipboard_clear, cs)) {
+    clipboard_clear(clipboard, cs);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void ensure_selection_cache_is_updated(fz_context *ctx, DocInfo *doci,
+                                       fz_location loc) {
+  Page *page = get_page(doci, loc);
+  if (page->cache.selection.id == doci->selection.id)
+    return;
+  page->cache.selection.id = doci->selection.id;
+  fz_point sel_start, sel_end;
+  if (!get_selection_bounds_for_page(ctx, doci, loc, &sel_start, &sel_end))
+    return;
+  Quads *quads = &page->cache.selection.quads;
+  // sized once for the whole page, so it never needs to grow
+  if (!quads->quads && page->char_count > 0)
+    quads->quads = malloc(page->char_count * sizeof(fz_quad));
+  quads->count = 0;
+  if (quads->quads)
+    quads->count = fz_highlight_selection(ctx, page->page_text, sel_start,
+                                          sel_end, quads->quads,
+                                          page->char_count);
+}
+
+// Take HITS over as the matches of page N in the search of the document.
+static void store_page_hits(DocInfo *doci, int n, Quads hits) {
+  struct DocSearch *ds = &doci->doc_search;
+  ds->hits[n] = hits;
+  ds->pages_done++;
+  ds->match_count += hits.count;
+}
+
+/*
+ * Return TRUE if the page wasn't searched by the search of the whole document
+ * yet, in which case its matches are added to it.
+ */
+gboolean ensure_search_cache_is_updated(DocInfo *doci, Page *page,
+                                        SearchNeedle *search) {
+  if (page->cache.search.id == doci->search_id)
+    return FALSE;
+  page->cache.search.id = doci->search_id;
+  Quads *quads = &page->cache.search.quads;
+  // reuse what the search of the whole document found
+  Quads *hits = doci->doc_search.hits;
+  int n = page_number(doci, page->loc);
+  if (hits && hits[n].count >= 0) {
+    quads->count = hits[n].count;
+    if (quads->count) {
+      quads->quads = realloc(quads->quads, quads->count * sizeof(fz_quad));
+      memcpy(quads->quads, hits[n].quads, quads->count * sizeof(fz_quad));
+    }
+    return FALSE;
+  }
+  // the text is kept normalized for the next needles with the same flags
+  int flags = search_text_flags(search);
+  if (page->page_text &&
+      (!page->search_text || page->search_text->flags != flags)) {
+    search_text_free(page->search_text);
+    page->search_text = search_text_new(page->page_text, flags);
+  }
+  quads->count = page->search_text
+                     ? search_text_find(page->search_text, search,
+                                        &quads->quads)
+                     : 0;
+  if (!hits)
+    return FALSE;
+  // so that the background search drops its result for the page
+  Quads copy = {NULL, quads->count};
+  if (copy.count) {
+    copy.quads = malloc(copy.count * sizeof(fz_quad));
+    memcpy(copy.quads, quads->quads, copy.count * sizeof(fz_quad));
+  }
+  store_page_hits(doci, n, copy);
+  return TRUE;
+}
+
+// a blank surface the size of PAGE at the current zoom, for render_page_into
+cairo_surface_t *new_page_surface(DocInfo *doci, Page *page) {
+  fz_matrix scale_ctm = get_scale_ctm(doci, page);
+  fz_irect bounds =
+      fz_round_rect(fz_transform_rect(view_bounds(doci, page), scale_ctm));
+  return cairo_image_surface_create(CAIRO_FORMAT_RGB24, bounds.x1, bounds.y1);
+}
+
+// what draw_display_list does with the pixels of the surface first
+enum Backdrop {
+  BACKDROP_WHITE,
+  BACKDROP_TRANSPARENT, // for CAIRO_FORMAT_ARGB32 surfaces
+  BACKDROP_KEEP,        // draw over what's there
+};
+
+/*
+ * Draw LIST transformed by CTM onto SURFACE, which must be large enough for
+ * the transformed page BOUNDS.
+ */
+static void draw_display_list(fz_context *ctx, DocInfo *doci,
+                              fz_display_list *list, fz_rect page_bounds,
+                              fz_matrix ctm, cairo_surface_t *surface,
+                              enum Backdrop backdrop, fz_cookie *cookie) {
+  fz_rect float_bounds = fz_transform_rect(page_bounds, ctm);
+  fz_irect bounds = fz_round_rect(float_bounds);
+
+  unsigned char *image = cairo_image_surface_get_data(surface);
+  fz_pixmap *pixmap = NULL;
+  fz_device *draw_device = NULL;
+  fz_try(ctx) {
+    pixmap = fz_new_pixmap_with_bbox_and_data(ctx, doci->colorspace, bounds,
+                                              NULL, 1, image);
+    if (backdrop == BACKDROP_WHITE)
+      fz_clear_pixmap_with_value(ctx, pixmap, 0xFF);
+    else if (backdrop == BACKDROP_TRANSPARENT)
+      fz_clear_pixmap(ctx, pixmap);
+    draw_device = fz_new_draw_device(ctx, fz_identity, pixmap);
+    fz_run_display_list(ctx, list, draw_device, ctm, float_bounds, cookie);
+  }
+  fz_catch(ctx) {
+    fprintf(stderr, "Failed allocations: %s\n", fz_caught_message(ctx));
+  }
+  fz_close_device(ctx, draw_device);
+  fz_drop_device(ctx, draw_device);
+  fz_drop_pixmap(ctx, pixmap);
+  cairo_surface_mark_dirty(surface);
+}
+
+/*
+ * Render PAGE onto SURFACE, which was created by new_page_surface. COOKIE may
+ * be NULL; otherwise the progress of the rendering is reported through it.
+ * Doesn't render selection or search results and such, only raw page.
+ */
+void render_page_into(fz_context *ctx, DocInfo *doci, Page *page,
+                      cairo_surface_t *surface, fz_cookie *cookie) {
+  draw_display_list(ctx, doci, page->display_list, view_bounds(doci, page),
+                    get_scale_ctm(doci, page), surface, BACKDROP_WHITE, cookie);
+}
+
+// doesn't render selection or search results and such, only raw page
+cairo_surface_t *render_page(fz_context *ctx, DocInfo *doci, Page *page) {
+  cairo_surface_t *surface = new_page_surface(doci, page);
+  render_page_into(ctx, doci, page, surface, NULL);
+  return surface;
+}
+
+// Return the number of edits of the annotations of page N so far.
+static unsigned int annot_version(DocInfo *doci, int n) {
+  return doci->annot_versions ? doci->annot_versions[n] : 0;
+}
+
+/*
+ * Build the annot_list of PAGE again from the main handle of the document,
+ * the one annotations are edited on. What changed on the annots surface was
+ * marked by invalidate_annots.
+ */
+static void update_annot_list(DocInfo *doci, Page *page) {
+  fz_context *ctx = doci->ctx;
+  fz_page *fzpage = NULL;
+  fz_display_list *list = NULL;
+  fz_var(fzpage);
+  fz_var(list);
+  fz_try(ctx) {
+    fzpage = fz_load_chapter_page(ctx, doci->doc, page->loc.chapter,
+                                  page->loc.page);
+    list = new_annot_list(ctx, fzpage, page->page_bounds);
+  }
+  fz_always(ctx) { fz_drop_page(ctx, fzpage); }
+  fz_catch(ctx) {
+    fprintf(stderr, "error loading annotations of page %d,%d: %s\n",
+            page->loc.chapter, page->loc.page, fz_caught_message(ctx));
+  }
+  fz_drop_display_list(ctx, page->annot_list);
+  page->annot_list = list;
+  page->annot_version = annot_version(doci, page_number(doci, page->loc));
+}
+
+// Draw AREA of the annotations of PAGE again onto its annots surface.
+static void draw_annots_area(DocInfo *doci, Page *page, fz_rect area) {
+  fz_matrix ctm = get_scale_ctm(doci, page);
+  area = fz_intersect_rect(area, view_bounds(doci, page));
+  fz_irect box = fz_round_rect(fz_transform_rect(area, ctm));
+  if (fz_is_empty_irect(box))
+    return;
+  // the patch replaces what's there, which may be an annotation since removed
+  cairo_surface_t *patch = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, box.x1 - box.x0, box.y1 - box.y0);
+  draw_display_list(doci->ctx, doci, page->annot_list, area, ctm, patch,
+                    BACKDROP_TRANSPARENT, NULL);
+  cairo_t *cr = cairo_create(page->cache.annots.surface);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cr, patch, box.x0, box.y0);
+  cairo_rectangle(cr, box.x0, box.y0, box.x1 - box.x0, box.y1 - box.y0);
+  cairo_fill(cr);
+  cairo_destroy(cr);
+  cairo_surface_destroy(patch);
+}
+
+// Bring the annot_list of PAGE, which may have been loaded before an edit or
+// by a DocInstance, up to date with the main handle of the document.
+static void refresh_annot_list(DocInfo *doci, Page *page) {
+  if (page->annot_version != annot_version(doci, page_number(doci, page->loc)))
+    update_annot_list(doci, page);
+}
+
+// the bytes of an incremental update, as if appended to a file of base bytes
+struct Increment {
+  GByteArray *data;
+  int64_t base;
+};
+
+static void increment_write(fz_context *ctx, void *state, const void *data,
+                            size_t n) {
+  struct Increment *inc = state;
+  g_byte_array_append(inc->data, data, n);
+}
+
+// the xref of the update takes the offsets of its objects from here
+static int64_t increment_tell(fz_context *ctx, void *state) {
+  struct Increment *inc = state;
+  return inc->base + inc->data->len;
+}
+
+/*
+ * Return the incremental update that saves every edit of the document since
+ * it was opened, written for appending to its file of BASE bytes, or NULL
+ * with ERROR set. Only the objects the edits changed are written, so this is
+ * quick enough for the GTK thread, which owns the main handle of the
+ * document; the update is the snapshot the saving thread writes out.
+ */
+static GByteArray *write_increment(DocInfo *doci, goffset base,
+                                   GError **error) {
+  fz_context *ctx = doci->ctx;
+  if (!pdf_can_be_saved_incrementally(ctx, doci->pdf)) {
+    g_set_error_literal(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                        "the document was repaired and can't be appended to");
+    return NULL;
+  }
+  struct Increment inc = {g_byte_array_new(), base};
+  fz_output *out = NULL;
+  fz_var(out);
+  fz_try(ctx) {
+    out = fz_new_output(ctx, 0, &inc, increment_write, NULL, NULL);
+    out->tell = increment_tell;
+    pdf_write_options opts = pdf_default_write_options;
+    opts.do_incremental = 1;
+    pdf_write_document(ctx, doci->pdf, out, &opts);
+    fz_close_output(ctx, out);
+  }
+  fz_always(ctx) { fz_drop_output(ctx, out); }
+  fz_catch(ctx) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                "cannot write the edits: %s", fz_caught_message(ctx));
+    g_byte_array_free(inc.data, TRUE);
+    return NULL;
+  }
+  return inc.data;
+}
+
+// wraps args to save the document for passing into submit_background_job
+struct SaveArgs {
+  BackgroundJob job;
+  GByteArray *increment;
+  goffset base;       // the bytes of the document file it's appended to
+  JournalFile file;   // the document file, replaced by the save
+  unsigned int edits; // saved by increment
+  GError *error;      // NULL unless the save failed
+};
+
+// bytes written so far, for save-progress
+struct SaveProgress {
+  gsize done;
+  gsize total;
+  GtkWidget *widget;
+};
+
+static gboolean emit_save_progress(void *data) {
+  struct SaveProgress *sp = data;
+  g_signal_emit(sp->widget, signals[SIGNAL_SAVE_PROGRESS], 0, (int)sp->done,
+                (int)sp->total);
+  g_object_unref(sp->widget);
+  free(sp);
+  return FALSE;
+}
+
+static void report_save_progress(gsize done, gsize total, void *data) {
+  struct SaveArgs *sa = data;
+  struct SaveProgress *sp = malloc(sizeof(*sp));
+  sp->done = done;
+  sp->total = total;
+  sp->widget = g_object_ref(sa->job.widget);
+  gdk_threads_add_idle(emit_save_progress, sp);
+}
+
+// runs on the GTK thread, after the progress the save reported
+static gboolean save_done(void *data) {
+  struct SaveArgs *sa = data;
+  GtkWidget *widget = sa->job.widget;
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct Save *s = &c->doci.save;
+  s->is_saving = FALSE;
+  s->file = sa->file;
+  if (sa->error) {
+    g_signal_emit(widget, signals[SIGNAL_SAVE_FAILED], 0, sa->error->message);
+    g_error_free(sa->error);
+  } else {
+    s->saved_edits = sa->edits;
+    int total = sa->base + sa->increment->len;
+    g_signal_emit(widget, signals[SIGNAL_SAVE_PROGRESS], 0, total, total);
+  }
+  if (s->is_pending) {
+    s->is_pending = FALSE;
+    save_document(widget);
+  }
+  g_byte_array_free(sa->increment, TRUE);
+  free(sa);
+  return FALSE;
+}
+
+/*
+ * Write the document file anew with the update after its first bytes,
+ * through a journal renamed over it, so that a crash at any point leaves
+ * either the old file or the new one, and the handles reading the old one
+ * never see it change. Every update has all the edits since the document was
+ * opened, so it replaces the one the last save wrote instead of going after
+ * it, and the file doesn't grow with each save.
+ */
+static void thread_save(gpointer data, gpointer user_data) {
+  struct SaveArgs *sa = data;
+  DocInfo *doci = user_data;
+  journal_save(doci->filename, &sa->file, sa->base, sa->increment->data,
+               sa->increment->len, report_save_progress, sa, &sa->error);
+}
+
+/*
+ * Append the edits of the document to its file as an incremental update, in
+ * the background, emitting save-progress as it's written and save-failed
+ * if it can't be. Edits made while a save runs are saved once it's done.
+ * Return FALSE if the document isn't a PDF or has no unsaved edits.
+ */
+gboolean save_document(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct Save *s = &doci->save;
+  if (!doci->pdf || s->edits == s->saved_edits)
+    return FALSE;
+  if (s->autosave_timer) {
+    g_source_remove(s->autosave_timer);
+    s->autosave_timer = 0;
+  }
+  if (s->is_saving) {
+    s->is_pending = TRUE;
+    return TRUE;
+  }
+  GError *error = NULL;
+  GByteArray *increment = write_increment(doci, s->file_size, &error);
+  if (!increment) {
+    g_signal_emit(widget, signals[SIGNAL_SAVE_FAILED], 0, error->message);
+    g_error_free(error);
+    return TRUE;
+  }
+  struct SaveArgs *sa = malloc(sizeof(*sa));
+  sa->increment = increment;
+  sa->base = s->file_size;
+  sa->file = s->file;
+  sa->edits = s->edits;
+  sa->error = NULL;
+  s->is_saving = TRUE;
+  g_signal_emit(widget, signals[SIGNAL_SAVE_PROGRESS], 0, 0,
+                (int)(sa->base + increment->len));
+  submit_background_job(&sa->job, widget, TIER_SAVE, thread_save, save_done);
+  return TRUE;
+}
+
+gboolean has_unsaved_edits(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  return c->doci.save.edits != c->doci.save.saved_edits;
+}
+
+static gboolean autosave(void *data) {
+  GtkWidget *widget = data;
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  c->doci.save.autosave_timer = 0;
+  save_document(widget);
+  return FALSE;
+}
+
+// Save the edits once none were made for the autosave delay, if there's one.
+static void schedule_autosave(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct Save *s = &c->doci.save;
+  if (s->autosave_timer)
+    g_source_remove(s->autosave_timer);
+  s->autosave_timer = 0;
+  if (s->autosave_delay_ms > 0 && s->edits != s->saved_edits)
+    s->autosave_timer = g_timeout_add(s->autosave_delay_ms, autosave, widget);
+}
+
+// Save edits by themselves DELAY_MS after the last one, or never if it's 0.
+void set_autosave_delay(GtkWidget *widget, int delay_ms) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  c->doci.save.autosave_delay_ms = MAX(delay_ms, 0);
+  schedule_autosave(widget);
+}
+
+/*
+ * Mark AREA of the annotations of the page at LOC as edited, so that it's
+ * drawn again from the annotations on the main handle of the document, and
+ * nothing else of the page is rendered again. AREA must cover the edited
+ * annotations both before and after the edit.
+ */
+static void invalidate_annots(DocInfo *doci, fz_location loc, fz_rect area) {
+  int n = page_number(doci, loc);
+  if (!doci->annot_versions)
+    doci->annot_versions =
+        calloc(doci->layout.page_count, sizeof(*doci->annot_versions));
+  doci->annot_versions[n]++;
+  doci->save.edits++;
+  // the thumbnails are made again from there on, see queue_next_thumbnail
+  doci->thumbnails.first_stale = MIN(doci->thumbnails.first_stale, n);
+  Page *page = find_cached_page(doci, loc);
+  if (page)
+    page->cache.annots.dirty = fz_union_rect(page->cache.annots.dirty, area);
+}
+
+// Add a highlight annotation of SEL to the page at LOC. Throws on errors.
+static void highlight_page_selection(DocInfo *doci, struct Selection *sel,
+                                     fz_location loc) {
+  static const float yellow[] = {1.0f, 1.0f, 0.0f};
+  fz_context *ctx = doci->ctx;
+  Page *page = find_cached_page(doci, loc);
+  fz_stext_page *text =
+      page ? page->page_text : load_page_text(doci, ctx, doci->doc, loc);
+  if (!text)
+    return;
+  fz_point start, end;
+  fz_quad *quads = NULL;
+  int count = 0;
+  // load_page_text bounds the text like the page
+  if (selection_bounds(ctx, sel, loc, page ? page->page_bounds : text->mediabox,
+                       text, &start, &end)) {
+    int max_count = count_chars(text);
+    quads = malloc(MAX(max_count, 1) * sizeof(*quads));
+    count = fz_highlight_selection(ctx, text, start, end, quads, max_count);
+  }
+  if (!page)
+    fz_drop_stext_page(ctx, text);
+  fz_page *fzpage = NULL;
+  fz_var(fzpage);
+  fz_try(ctx) {
+    if (count > 0) {
+      fzpage = fz_load_chapter_page(ctx, doci->doc, loc.chapter, loc.page);
+      pdf_annot *annot = pdf_create_annot(
+          ctx, pdf_page_from_fz_page(ctx, fzpage), PDF_ANNOT_HIGHLIGHT);
+      pdf_drop_annot(ctx, doci->selected_annot);
+      doci->selected_annot = annot;
+      pdf_set_annot_color(ctx, annot, 3, yellow);
+      pdf_set_annot_quad_points(ctx, annot, count, quads);
+      pdf_update_annot(ctx, annot);
+      invalidate_annots(doci, loc, pdf_bound_annot(ctx, annot));
+    }
+  }
+  fz_always(ctx) {
+    fz_drop_page(ctx, fzpage);
+    free(quads);
+  }
+  fz_catch(ctx) { fz_rethrow(ctx); }
+}
+
+/*
+ * Add a highlight annotation of the selection to each of its pages, select
+ * the last one and clear the selection. Only the annotations of the pages are
+ * drawn again. Return FALSE if there's no selection, or if the document isn't
+ * a PDF.
+ */
+gboolean highlight_selection(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct Selection *sel = &doci->selection;
+  if (!doci->pdf || !sel->is_active)
+    return FALSE;
+  fz_context *ctx = doci->ctx;
+  gboolean ok = TRUE;
+  fz_try(ctx) {
+    for (fz_location loc = sel->loc_start;
+         locationcmp(loc, sel->loc_end) <= 0;) {
+      highlight_page_selection(doci, sel, loc);
+      fz_location next = fz_next_page(ctx, doci->doc, loc);
+      if (locationcmp(next, loc) == 0)
+        break;
+      loc = next;
+    }
+  }
+  fz_catch(ctx) {
+    fprintf(stderr, "cannot highlight the selection: %s\n",
+            fz_caught_message(ctx));
+    ok = FALSE;
+  }
+  unset_selection(widget);
+  schedule_autosave(widget);
+  return ok;
+}
+
+/*
+ * A device that only decodes the images it's run over, leaving the decoded
+ * pixmaps in the fz_store for the draw device to find later.
+ */
+struct PredecodeDevice {
+  fz_device super;
+  DocInfo *doci;
+  size_t budget; // bytes we may still decode
+  fz_cookie *cookie;
+  gboolean is_deferred; // aborted to yield to rendering, to be run again
+};
+
+static void predecode_image(fz_context *ctx, fz_device *dev, fz_image *image,
+                            fz_matrix ctm) {
+  struct PredecodeDevice *pd = (struct PredecodeDevice *)dev;
+  if (pd->doci->predecode_share <= 0) { // disabled or closing
+    pd->cookie->abort = 1;
+    return;
+  }
+  // yield to the visible renders; they may be queued behind this very job on
+  // the shared threads, so it gives its thread up instead of waiting
+  if (g_atomic_int_get(&pd->doci->page_cache.renders_in_progress) > 0) {
+    pd->is_deferred = TRUE;
+    pd->cookie->abort = 1;
+    return;
+  }
+  // ask for the same subsampling level the draw device would
+  int w = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
+  int h = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
+  fz_pixmap *pixmap = fz_get_pixmap_from_image(ctx, image, NULL, &ctm, &w, &h);
+  size_t size = (size_t)fz_pixmap_width(ctx, pixmap) *
+                fz_pixmap_height(ctx, pixmap) *
+                fz_pixmap_components(ctx, pixmap);
+  fz_drop_pixmap(ctx, pixmap);
+  if (size >= pd->budget) {
+    pd->budget = 0;
+    pd->cookie->abort = 1;
+  } else {
+    pd->budget -= size;
+  }
+}
+
+static void predecode_fill_image(fz_context *ctx, fz_device *dev,
+                                 fz_image *image, fz_matrix ctm, float alpha,
+                                 fz_color_params color_params) {
+  predecode_image(ctx, dev, image, ctm);
+}
+
+static void predecode_fill_image_mask(fz_context *ctx, fz_device *dev,
+                                      fz_image *image, fz_matrix ctm,
+                                      fz_colorspace *colorspace,
+                                      const float *color, float alpha,
+                                      fz_color_params color_params) {
+  predecode_image(ctx, dev, image, ctm);
+}
+
+static void predecode_clip_image_mask(fz_context *ctx, fz_device *dev,
+                                      fz_image *image, fz_matrix ctm,
+                                      fz_rect scissor) {
+  predecode_image(ctx, dev, image, ctm);
+}
+
+// wraps args to predecode for passing into submit_background_job
+struct PredecodeArgs {
+  BackgroundJob job;
+  fz_display_list *display_list; // a reference owned by the args
+  fz_matrix ctm;
+  gboolean is_deferred; // if it yielded to rendering before it was done
+};
+
+// a function with a valid signature for g_timeout_add; queues a predecode
+// that yielded to rendering again
+static gboolean requeue_predecode(void *data) {
+  queue_background_job(data);
+  return FALSE;
+}
+
+// runs on the GTK thread; retries a predecode that yielded after a while
+static gboolean predecode_done(void *data) {
+  struct PredecodeArgs *pa = data;
+  PaperViewPrivate *c =
+      paper_view_get_instance_private(PAPER_VIEW(pa->job.widget));
+  DocInfo *doci = &c->doci;
+  // the images decoded so far are found in the store when it runs again
+  if (pa->is_deferred && doci->predecode_share > 0 &&
+      !g_atomic_int_get(&doci->is_closing)) {
+    g_timeout_add(PREDECODE_BACKOFF_MS, requeue_predecode, pa);
+    return TRUE;
+  }
+  fz_drop_display_list(doci->ctx, pa->display_list);
+  free(pa);
+  return FALSE;
+}
+
+void thread_predecode(gpointer data, gpointer user_data) {
+  DocInfo *doci = user_data;
+  struct PredecodeArgs *pa = data;
+  fz_context *ctx = fz_clone_context(doci->ctx);
+  fz_cookie cookie = {0};
+  struct PredecodeDevice *dev = NULL;
+  gboolean is_deferred = FALSE;
+  fz_try(ctx) {
+    if (doci->predecode_share > 0) {
+      dev = fz_new_derived_device(ctx, struct PredecodeDevice);
+      dev->super.fill_image = predecode_fill_image;
+      dev->super.fill_image_mask = predecode_fill_image_mask;
+      dev->super.clip_image_mask = predecode_clip_image_mask;
+      dev->doci = doci;
+      dev->budget =
+          doci->predecode_share * STORE_SIZE / (2 * PREDECODE_DISTANCE);
+      dev->cookie = &cookie;
+      fz_run_display_list(ctx, pa->display_list, &dev->super, pa->ctm,
+                          fz_infinite_rect, &cookie);
+      is_deferred = dev->is_deferred;
+    }
+  }
+  fz_always(ctx) {
+    if (dev) {
+      fz_close_device(ctx, &dev->super);
+      fz_drop_device(ctx, &dev->super);
+    }
+  }
+  fz_catch(ctx) {
+    fprintf(stderr, "error predecoding images: %s\n", fz_caught_message(ctx));
+  }
+  pa->is_deferred = is_deferred;
+  fz_drop_context(ctx);
+}
+
+// Queue the images of page N for decoding, unless they're already decoded.
+static void predecode_page(DocInfo *doci, GtkWidget *widget, int n) {
+  Page *page = get_page_async(doci, widget, location_from_page_number(doci, n));
+  if (!page || !page->display_list ||
+      page->cache.predecoded_id == doci->rendered_id ||
+      page->cache.rendered.id == doci->rendered_id)
+    return;
+  page->cache.predecoded_id = doci->rendered_id;
+  struct PredecodeArgs *pa = malloc(sizeof(*pa));
+  pa->display_list = fz_keep_display_list(doci->ctx, page->display_list);
+  pa->ctm = get_scale_ctm(doci, page);
+  submit_background_job(&pa->job, widget, TIER_PREDECODE, thread_predecode,
+                        predecode_done);
+}
+
+/*
+ * Queue the images of the rows just past the prerendered neighbors of rows
+ * FIRST_ROW to LAST_ROW for decoding, so that rendering them later only has
+ * to rasterize.
+ */
+static void predecode_rows_around(DocInfo *doci, GtkWidget *widget,
+                                  int first_row, int last_row) {
+  if (doci->predecode_share <= 0)
+    return;
+  Layout *layout = &doci->layout;
+  for (int i = 2; i < PREDECODE_DISTANCE + 2; i++) {
+    int rows[] = {last_row + i, first_row - i};
+    for (size_t j = 0; j < G_N_ELEMENTS(rows); j++) {
+      if (rows[j] < 0 || rows[j] >= layout->row_count)
+        continue;
+      for (int n = row_first_page(layout, rows[j]);
+           n < row_end_page(layout, rows[j]); n++)
+        predecode_page(doci, widget, n);
+    }
+  }
+}
+
+// Set DOCI->cache_key from the identity of the document file.
+static void compute_cache_key(DocInfo *doci) {
+  char *path = realpath(doci->filename, NULL);
+  struct stat st = {0};
+  stat(doci->filename, &st);
+  char *id = g_strdup_printf("%s:%lld:%lld", path ? path : doci->filename,
+                             (long long)st.st_size, (long long)st.st_mtime);
+  char *key = g_compute_checksum_for_string(G_CHECKSUM_SHA1, id, -1);
+  g_strlcpy(doci->cache_key, key, sizeof(doci->cache_key));
+  g_free(key);
+  g_free(id);
+  free(path);
+}
+
+static void thread_trim_text_cache(gpointer data, gpointer user_data) {
+  char *root = g_build_filename(g_get_user_cache_dir(), "paper", NULL);
+  text_cache_trim(root, TEXT_CACHE_MAX_SIZE);
+  g_free(root);
+}
+
+/*
+ * Thumbnails of every page for the overview, filled one page at a time in
+ * document order. Each is first looked up as a PNG in the document's cache
+ * directory by a job of the lowest tier. Otherwise its page is loaded on a
+ * document instance, or on the main handle without instances, and rendered
+ * by another job of that tier, so that it yields to the visible pages and
+ * never touches the page cache. Pages whose annotations were edited are made
+ * again, and only unedited ones go to the disk.
+ */
+struct ThumbnailArgs {
+  BackgroundJob job;
+  int n;
+  unsigned int version; // of the annotations of the page, see annot_version
+  cairo_surface_t *surface; // the result, NULL on failure
+  gboolean is_rendered;     // FALSE while only the disk was tried
+  Page *page; // loaded for rendering, without its fz_page; NULL before
+};
+
+static gboolean thumbnail_done(void *data);
+
+static char *thumbnail_path(DocInfo *doci, int n) {
+  char name[32];
+  snprintf(name, sizeof(name), "thumbnail-%d.png", n);
+  return doc_cache_path(doci, name);
+}
+
+static void thread_load_thumbnail(gpointer data, gpointer user_data) {
+  DocInfo *doci = user_data;
+  struct ThumbnailArgs *ta = data;
+  if (ta->version == 0) {
+    char *path = thumbnail_path(doci, ta->n);
+    ta->surface = cairo_image_surface_create_from_png(path);
+    if (cairo_surface_status(ta->surface) != CAIRO_STATUS_SUCCESS) {
+      cairo_surface_destroy(ta->surface);
+      ta->surface = NULL;
+    } else {
+      text_cache_touch(path);
+    }
+    g_free(path);
+  }
+}
+
+/*
+ * Write SURFACE to PATH as a PNG. It's written to a temporary file first and
+ * renamed into place, so that thread_load_thumbnail never reads it
+ * half-written.
+ */
+static void write_thumbnail(cairo_surface_t *surface, const char *path) {
+  char *tmp = g_strconcat(path, ".XXXXXX", NULL);
+  int fd = g_mkstemp(tmp);
+  if (fd >= 0) {
+    close(fd);
+    if (cairo_surface_write_to_png(surface, tmp) != CAIRO_STATUS_SUCCESS ||
+        rename(tmp, path) != 0)
+      unlink(tmp);
+  }
+  g_free(tmp);
+}
+
+static void thread_render_thumbnail(gpointer data, gpointer user_data) {
+  DocInfo *doci = user_data;
+  struct ThumbnailArgs *ta = data;
+  Page *page = ta->page;
+  fz_context *ctx = fz_clone_context(doci->ctx);
+  ta->is_rendered = TRUE;
+  if (!g_atomic_int_get(&doci->is_closing) && page->display_list &&
+      page->page_bounds.x1 > 0) {
+    float scale = THUMBNAIL_WIDTH / page->page_bounds.x1;
+    fz_matrix ctm = fz_scale(scale, scale);
+    fz_irect bounds = fz_round_rect(fz_transform_rect(page->page_bounds, ctm));
+    ta->surface =
+        cairo_image_surface_create(CAIRO_FORMAT_RGB24, bounds.x1, bounds.y1);
+    draw_display_list(ctx, doci, page->display_list, page->page_bounds, ctm,
+                      ta->surface, BACKDROP_WHITE, NULL);
+    if (page->annot_list)
+      draw_display_list(ctx, doci, page->annot_list, page->page_bounds, ctm,
+                        ta->surface, BACKDROP_KEEP, NULL);
+    if (ta->version == 0) {
+      char *path = thumbnail_path(doci, ta->n);
+      write_thumbnail(ta->surface, path);
+      g_free(path);
+    }
+  }
+  drop_page(ctx, page);
+  free(page);
+  ta->page = NULL;
+  fz_drop_context(ctx);
+}
+
+// loads the page of the thumbnail on one of the document instances
+static void thread_load_thumbnail_page(gpointer data, gpointer user_data) {
+  DocInfo *doci = user_data;
+  struct ThumbnailArgs *ta = data;
+  DocInstance *inst = g_async_queue_pop(doci->instances.idle);
+  ta->page = malloc(sizeof(*ta->page));
+  load_page_from(doci, inst->ctx, inst->doc,
+                 location_from_page_number(doci, ta->n), ta->page);
+  // the render only needs the display lists, which aren't tied to a handle
+  fz_drop_page(inst->ctx, ta->page->page);
+  ta->page->page = NULL;
+  g_async_queue_push(doci->instances.idle, inst);
+}
+
+// a function with a valid signature for g_idle_add_full; loads the page of
+// the thumbnail on the main handle when there are no document instances
+static gboolean load_thumbnail_page(void *data) {
+  struct ThumbnailArgs *ta = data;
+  PaperViewPrivate *c =
+      paper_view_get_instance_private(PAPER_VIEW(ta->job.widget));
+  DocInfo *doci = &c->doci;
+  ta->page = malloc(sizeof(*ta->page));
+  load_page_from(doci, doci->ctx, doci->doc,
+                 location_from_page_number(doci, ta->n), ta->page);
+  fz_drop_page(doci->ctx, ta->page->page);
+  ta->page->page = NULL;
+  return finish_background_job(ta);
+}
+
+/*
+ * Queue the making of the next thumbnail that's missing or shows annotations
+ * edited since, going back to the first edited page if there is one.
+ */
+static void queue_next_thumbnail(DocInfo *doci, GtkWidget *widget) {
+  struct Thumbnails *thumbnails = &doci->thumbnails;
+  if (thumbnails->first_stale < thumbnails->next) {
+    thumbnails->next = thumbnails->first_stale;
+    thumbnails->first_stale = G_MAXINT;
+  }
+  while (thumbnails->next < doci->layout.page_count &&
+         thumbnails->surfaces[thumbnails->next] &&
+         thumbnails->versions[thumbnails->next] ==
+             annot_version(doci, thumbnails->next))
+    thumbnails->next++;
+  thumbnails->is_busy = FALSE;
+  if (thumbnails->next >= doci->layout.page_count ||
+      g_atomic_int_get(&doci->is_closing))
+    return;
+  thumbnails->is_busy = TRUE;
+  struct ThumbnailArgs *ta = malloc(sizeof(*ta));
+  ta->n = thumbnails->next;
+  ta->version = annot_version(doci, ta->n);
+  ta->surface = NULL;
+  ta->is_rendered = FALSE;
+  ta->page = NULL;
+  submit_background_job(&ta->job, widget, TIER_THUMBNAIL,
+                        thread_load_thumbnail, thumbnail_done);
+}
+
+/*
+ * Runs on the GTK thread, which owns the main handle that edited annotations
+ * are taken from. Loads the page of the thumbnail if it wasn't on disk, then
+ * renders it; otherwise stores it and queues the next one.
+ */
+static gboolean thumbnail_done(void *data) {
+  struct ThumbnailArgs *ta = data;
+  GtkWidget *widget = ta->job.widget;
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  if (!ta->surface && !ta->is_rendered &&
+      !g_atomic_int_get(&doci->is_closing)) {
+    if (ta->page) {
+      refresh_annot_list(doci, ta->page);
+      ta->version = ta->page->annot_version;
+      ta->job.run = thread_render_thumbnail;
+      ta->job.uses_instances = FALSE;
+      queue_background_job(&ta->job);
+    } else if (doci->instances.count == 0) {
+      g_idle_add_full(G_PRIORITY_LOW, load_thumbnail_page, ta, NULL);
+    } else {
+      ta->job.run = thread_load_thumbnail_page;
+      ta->job.uses_instances = TRUE;
+      queue_background_job(&ta->job);
+    }
+    return TRUE;
+  }
+  if (ta->page) {
+    drop_page(doci->ctx, ta->page);
+    free(ta->page);
+  }
+  struct Thumbnails *thumbnails = &doci->thumbnails;
+  // a failed refresh keeps the thumbnail from before the edit
+  if (ta->surface || !thumbnails->surfaces[ta->n]) {
+    cairo_surface_destroy(thumbnails->surfaces[ta->n]);
+    thumbnails->surfaces[ta->n] = ta->surface;
+  }
+  thumbnails->versions[ta->n] = ta->version;
+  thumbnails->next = ta->n + 1;
+  queue_next_thumbnail(doci, widget);
+  free(ta);
+  return FALSE;
+}
+
+/*
+ * Return the thumbnail of page N, or NULL if it isn't ready yet. The first
+ * call starts generating the thumbnails of all pages in the background, and
+ * later ones those of the pages edited since.
+ */
+cairo_surface_t *get_thumbnail(GtkWidget *widget, int n) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct Thumbnails *thumbnails = &doci->thumbnails;
+  if (!thumbnails->surfaces) {
+    thumbnails->surfaces =
+        calloc(doci->layout.page_count, sizeof(*thumbnails->surfaces));
+    thumbnails->versions =
+        calloc(doci->layout.page_count, sizeof(*thumbnails->versions));
+    thumbnails->first_stale = G_MAXINT;
+  }
+  if (!thumbnails->is_busy)
+    queue_next_thumbnail(doci, widget);
+  if (n < 0 || n >= doci->layout.page_count)
+    return NULL;
+  return thumbnails->surfaces[n];
+}
+
+// Return the number of pages whose thumbnails are done.
+int get_thumbnails_done(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  return c->doci.thumbnails.next;
+}
+
+static void drop_thumbnails(DocInfo *doci) {
+  if (!doci->thumbnails.surfaces)
+    return;
+  for (int i = 0; i < doci->layout.page_count; i++)
+    cairo_surface_destroy(doci->thumbnails.surfaces[i]);
+  free(doci->thumbnails.surfaces);
+  free(doci->thumbnails.versions);
+}
+
+// wraps args to render for passing into submit_background_job
+struct RenderArgs {
+  BackgroundJob job;
+  unsigned int rendered_id;
+  Page *page;
+  // the surface to render into, already published as the page's
+  // rendered.partial; NULL to have thread_render create one
+  cairo_surface_t *surface;
+  gboolean is_shown; // if the result replaced what the page showed
+};
+void thread_render(gpointer data, gpointer user_data);
+static gboolean render_done(void *data);
+
+/*
+ * How far the render drawing onto a partial surface got. Each render has its
+ * own, attached to its surface, so that a render that's still running when
+ * the next one is queued never writes to the progress of the next.
+ */
+struct RenderProgress {
+  fz_cookie cookie;
+  gint64 started; // monotonic time the render thread started at, 0 before
+};
+
+static cairo_user_data_key_t render_progress_key;
+
+static struct RenderProgress *get_render_progress(cairo_surface_t *surface) {
+  return cairo_surface_get_user_data(surface, &render_progress_key);
+}
+
+/*
+ * Return TRUE if PRC has been rendering for long enough, and got far enough,
+ * that showing its partial surface is better than the approximation.
+ */
+static gboolean should_show_partial(struct CachedSurface *prc) {
+  if (!prc->is_in_progress || !prc->partial)
+    return FALSE;
+  struct RenderProgress *progress = get_render_progress(prc->partial);
+  return progress->cookie.progress > 0 &&
+         g_get_monotonic_time() - progress->started >= PROGRESSIVE_DELAY_US;
+}
+
+// a function with a valid signature for g_timeout_add; keeps redrawing the
+// widget while pages are rendering for long enough to be shown partially
+static gboolean progressive_redraw(void *data) {
+  GtkWidget *widget = data;
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct PageCache *page_cache = &c->doci.page_cache;
+  if (g_atomic_int_get(&page_cache->renders_in_progress) == 0) {
+    page_cache->progressive_timer = 0;
+    return G_SOURCE_REMOVE;
+  }
+  for (int i = 0; i < page_cache->len; i++) {
+    if (should_show_partial(&page_cache->pages[i]->cache.rendered)) {
+      gtk_widget_queue_draw(widget);
+      break;
+    }
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+// if page is not available yet, returns NULL and gtk_widget_queue_draw would
+// later be called from another thread to update the rendering.
+cairo_surface_t *get_rendered_page_(DocInfo *doci, GtkWidget *widget,
+                                    Page *page) {
+  struct CachedSurface *prc = &page->cache.rendered;
+  if (prc->id != doci->rendered_id) {
+    prc->id = doci->rendered_id;
+    struct RenderArgs *ra = malloc(sizeof(*ra));
+    ra->page = page;
+    ra->rendered_id = prc->id;
+    ra->surface = NULL;
+    ra->is_shown = FALSE;
+
+    g_atomic_int_inc(&doci->page_cache.renders_in_progress);
+    // slides are never larger than the view, so they can be rendered in the
+    // background at any zoom
+    if (doci->zoom > MAX_APPROXIMATE_ZOOM && !doci->presentation.is_active) {
+      // render in this thread instead of using thread pool
+      run_background_job(&ra->job, widget, thread_render, render_done);
+    } else {
+      prc->is_in_progress = 1;
+      // the render thread draws straight onto this surface, so that
+      // draw_page_pixmap can show what's done so far of slow pages
+      ra->surface = new_page_surface(doci, page);
+      cairo_surface_set_user_data(ra->surface, &render_progress_key,
+                                  calloc(1, sizeof(struct RenderProgress)),
+                                  free);
+      cairo_surface_destroy(prc->partial);
+      prc->partial = cairo_surface_reference(ra->surface);
+      submit_background_job(&ra->job, widget, TIER_RENDER, thread_render,
+                            render_done);
+      if (!doci->page_cache.progressive_timer)
+        doci->page_cache.progressive_timer = g_timeout_add(
+            PROGRESSIVE_REDRAW_INTERVAL_MS, progressive_redraw, widget);
+    }
+    /* TODO save the amount of time it took to render and if short enough call
+     * thread_render(ra, doci); ourselves instead an approximation */
+  }
+  if (prc->is_in_progress) {
+    return NULL;
+  }
+  if (prc->partial) {
+    cairo_surface_destroy(prc->partial);
+    prc->partial = NULL;
+  }
+  return prc->surface;
+}
+/*
+ * Start rendering the pages of ROW as one batch, loading the ones that aren't
+ * cached in the background; they're rendered on the redraw after they load.
+ */
+static void prerender_row(DocInfo *doci, GtkWidget *widget, int row) {
+  Layout *layout = &doci->layout;
+  if (row < 0 || row >= layout->row_count)
+    return;
+  begin_job_batch(doci);
+  for (int n = row_first_page(layout, row); n < row_end_page(layout, row);
+       n++) {
+    Page *page =
+        get_page_async(doci, widget, location_from_page_number(doci, n));
+    if (page)
+      get_rendered_page_(doci, widget, page);
+  }
+  end_job_batch(doci);
+}
+
+static void draw_annots(cairo_t *cr, fz_point translation, DocInfo *doci,
+                        GtkWidget *widget, Page *page);
+
+/*
+ * Paint SURFACE, a rendering of PAGE at ZOOM and ROTATE, onto CR at
+ * TRANSLATION, scaled and rotated to the current zoom and rotation.
+ */
+static void paint_approximation(cairo_t *cr, fz_point translation,
+                                DocInfo *doci, Page *page,
+                                cairo_surface_t *surface, float zoom,
+                                float rotate) {
+  double z = doci->zoom / zoom;
+  double r = doci->rotate - rotate;
+  cairo_save(cr);
+  cairo_scale(cr, z, z);
+  cairo_rotate(cr, r);
+  fz_point inv_trans = fz_transform_vector(
+      translation, fz_invert_matrix(get_scale_ctm(doci, page)));
+  cairo_set_source_surface(cr, surface, inv_trans.x, inv_trans.y);
+  cairo_paint(cr);
+  cairo_restore(cr);
+}
+
+/*
+ * Draw page.
+ * cr: the surface to draw on
+ * translation: x,y position to offset the drawing on
+ *
+ * This is a wrapper around get_rendered_page_ that uses an approximation for
+ * the drawn page if a full-res version is not avaliable yet.
+ */
+void draw_page_pixmap(cairo_t *cr, fz_point translation, DocInfo *doci,
+                      GtkWidget *widget, Page *page) {
+  cairo_surface_t *surface = get_rendered_page_(doci, widget, page);
+
+  struct CachedSurface *prc = &page->cache.rendered;
+  if (surface) {
+    cairo_set_source_surface(cr, surface, translation.x, translation.y);
+    cairo_paint(cr);
+  } else if (should_show_partial(prc)) {
+    // still being drawn onto by a render thread
+    cairo_surface_mark_dirty(prc->partial);
+    cairo_set_source_surface(cr, prc->partial, translation.x, translation.y);
+    cairo_paint(cr);
+  } else if (prc->surface) {
+    // approximate new pixmap by scaling and rotating the old one
+    paint_approximation(cr, translation, doci, page, prc->surface, prc->zoom,
+                        prc->rotate);
+  } else {
+    return;
+  }
+  draw_annots(cr, translation, doci, widget, page);
+}
+
+// runs on the GTK thread; shows the page if the render replaced it
+static gboolean render_done(void *data) {
+  struct RenderArgs *ra = data;
+  if (ra->is_shown)
+    gtk_widget_queue_draw(ra->job.widget);
+  free(ra);
+  return FALSE;
+}
+
+void thread_render(gpointer data, gpointer user_data) {
+  DocInfo *doci = user_data;
+  struct RenderArgs *ra = data;
+  Page *page = ra->page;
+  if (g_atomic_int_get(&doci->is_closing)) {
+    cairo_surface_destroy(ra->surface);
+    g_atomic_int_add(&doci->page_cache.renders_in_progress, -1);
+    return;
+  }
+  // mupdf requires one ctx per thread
+  // however, in glib's threadpool we can't associate one for each thread
+  // so a ctx is created on each rendering
+  fz_context *ctx = fz_clone_context(doci->ctx);
+  cairo_surface_t *finished = ra->surface;
+  if (finished) {
+    // the job may have waited in the queue for a while
+    struct RenderProgress *progress = get_render_progress(finished);
+    progress->started = g_get_monotonic_time();
+    render_page_into(ctx, doci, page, finished, &progress->cookie);
+  } else {
+    finished = render_page(ctx, doci, page);
+  }
+  fz_drop_context(ctx);
+  g_atomic_int_add(&doci->page_cache.renders_in_progress, -1);
+  if (ra->rendered_id != page->cache.rendered.id) {
+    // trust that another thread takes care of it and die in peace
+    cairo_surface_destroy(finished);
+    return;
+  }
+  page->cache.rendered.zoom = doci->zoom;
+  page->cache.rendered.rotate = doci->rotate;
+  cairo_surface_destroy(page->cache.rendered.surface);
+  page->cache.rendered.surface = finished;
+  page->cache.rendered.is_in_progress = 0;
+  ra->is_shown = TRUE;
+}
+
+// wraps args to render the annotations of a page, see get_rendered_annots
+struct AnnotArgs {
+  BackgroundJob job;
+  unsigned int rendered_id;
+  Page *page;
+  // kept, since an edit meanwhile replaces the annot_list of the page
+  fz_display_list *annot_list;
+  fz_rect bounds; // of the page, as shown
+  fz_matrix ctm;
+  float zoom;
+  float rotate;
+  cairo_surface_t *surface;
+  gboolean is_shown; // like RenderArgs.is_shown
+};
+
+// runs on the GTK thread; like render_done
+static gboolean annots_done(void *data) {
+  struct AnnotArgs *aa = data;
+  if (aa->is_shown)
+    gtk_widget_queue_draw(aa->job.widget);
+  free(aa);
+  return FALSE;
+}
+
+void thread_render_annots(gpointer data, gpointer user_data) {
+  DocInfo *doci = user_data;
+  struct AnnotArgs *aa = data;
+  struct CachedAnnots *ca = &aa->page->cache.annots;
+  fz_context *ctx = fz_clone_context(doci->ctx);
+  gboolean is_closing = g_atomic_int_get(&doci->is_closing);
+  if (!is_closing)
+    draw_display_list(ctx, doci, aa->annot_list, aa->bounds, aa->ctm,
+                      aa->surface, BACKDROP_TRANSPARENT, NULL);
+  fz_drop_display_list(ctx, aa->annot_list);
+  fz_drop_context(ctx);
+  if (is_closing || aa->rendered_id != ca->id) {
+    // like thread_render, leave it to the render queued since
+    cairo_surface_destroy(aa->surface);
+  } else {
+    cairo_surface_destroy(ca->surface);
+    ca->surface = aa->surface;
+    ca->zoom = aa->zoom;
+    ca->rotate = aa->rotate;
+    ca->is_in_progress = 0;
+    aa->is_shown = TRUE;
+  }
+}
+
+/*
+ * Return the annotations of PAGE rendered at the current zoom, to be drawn
+ * over its content, or NULL if it has none or they're still rendering. Like
+ * the content, they're rendered by the render threads whenever the zoom
+ * changes; after an edit only the area it touched is drawn again, right here,
+ * which is quick.
+ */
+static cairo_surface_t *get_rendered_annots(DocInfo *doci, GtkWidget *widget,
+                                            Page *page) {
+  struct CachedAnnots *ca = &page->cache.annots;
+  refresh_annot_list(doci, page);
+  if (!page->annot_list) {
+    cairo_surface_destroy(ca->surface);
+    ca->surface = NULL;
+    ca->dirty = fz_empty_rect;
+    return NULL;
+  }
+  if (ca->id != doci->rendered_id || (!ca->surface && !ca->is_in_progress)) {
+    ca->id = doci->rendered_id;
+    // the render draws all of them as they are now
+    ca->dirty = fz_empty_rect;
+    struct AnnotArgs *aa = malloc(sizeof(*aa));
+    aa->rendered_id = ca->id;
+    aa->page = page;
+    aa->annot_list = fz_keep_display_list(doci->ctx, page->annot_list);
+    aa->bounds = view_bounds(doci, page);
+    aa->ctm = get_scale_ctm(doci, page);
+    aa->zoom = doci->zoom;
+    aa->rotate = doci->rotate;
+    fz_irect size = fz_round_rect(fz_transform_rect(aa->bounds, aa->ctm));
+    aa->surface =
+        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size.x1, size.y1);
+    aa->is_shown = FALSE;
+    // like get_rendered_page_
+    if (doci->zoom > MAX_APPROXIMATE_ZOOM && !doci->presentation.is_active) {
+      run_background_job(&aa->job, widget, thread_render_annots, annots_done);
+    } else {
+      ca->is_in_progress = 1;
+      submit_background_job(&aa->job, widget, TIER_RENDER,
+                            thread_render_annots, annots_done);
+    }
+  }
+  if (ca->is_in_progress)
+    return NULL;
+  if (!fz_is_empty_rect(ca->dirty)) {
+    draw_annots_area(doci, page, ca->dirty);
+    ca->dirty = fz_empty_rect;
+  }
+  return ca->surface;
+}
+
+// Draw the annotations of PAGE onto CR at TRANSLATION, approximating them
+// from the ones at the previous zoom while they're rendering.
+static void draw_annots(cairo_t *cr, fz_point translation, DocInfo *doci,
+                        GtkWidget *widget, Page *page) {
+  struct CachedAnnots *ca = &page->cache.annots;
+  cairo_surface_t *annots = get_rendered_annots(doci, widget, page);
+  if (annots) {
+    cairo_set_source_surface(cr, annots, translation.x, translation.y);
+    cairo_paint(cr);
+  } else if (ca->surface) {
+    paint_approximation(cr, translation, doci, page, ca->surface, ca->zoom,
+                        ca->rotate);
+  }
+}
+
+/*
+ * Whether the view should switch to the destination of goto_page now, either
+ * because it's rendered or because it has been waited on long enough.
+ */
+static gboolean should_finish_jump(DocInfo *doci) {
+  struct Jump *jump = &doci->jump;
+  if (locationcmp(doci->location, jump->from) != 0 ||
+      doci->scroll.y != jump->from_scroll_y) {
+    // scrolled away in the meantime; forget about the jump
+    jump->is_pending = FALSE;
+    return FALSE;
+  }
+  Page *page = find_cached_page(doci, jump->to);
+  if (!page || g_get_monotonic_time() >= jump->deadline)
+    return TRUE;
+  struct CachedSurface *prc = &page->cache.rendered;
+  return prc->id == doci->rendered_id && !prc->is_in_progress;
+}
+
+// Return the location of the first page of the row page N is on.
+static fz_location row_start(DocInfo *doci, int n) {
+  return location_from_page_number(
+      doci, row_first_page(&doci->layout, page_row(&doci->layout, n)));
+}
+
+static void finish_jump(DocInfo *doci) {
+  doci->location = row_start(doci, page_number(doci, doci->jump.to));
+  doci->scroll.y = 0;
+  doci->jump.is_pending = FALSE;
+}
+
+enum { SLIDE_PREV, SLIDE_CUR, SLIDE_NEXT };
+
+static void fit_slide(GtkWidget *widget, DocInfo *doci);
+
+/*
+ * Start rendering the slides that aren't rendered at the current zoom yet,
+ * the current one first and then the one in the direction of the last flip,
+ * and keep each one's surface once it's done.
+ */
+static void render_slides(DocInfo *doci, GtkWidget *widget) {
+  struct Presentation *p = &doci->presentation;
+  int ahead = p->direction > 0 ? SLIDE_NEXT : SLIDE_PREV;
+  int order[] = {SLIDE_CUR, ahead, SLIDE_PREV + SLIDE_NEXT - ahead};
+  for (size_t i = 0; i < G_N_ELEMENTS(order); i++) {
+    struct Slide *slide = &p->slides[order[i]];
+    if (slide->n < 0 || slide->n >= doci->layout.page_count ||
+        (slide->surface && slide->rendered_id == doci->rendered_id))
+      continue;
+    Page *page =
+        get_page_async(doci, widget, location_from_page_number(doci, slide->n));
+    cairo_surface_t *surface =
+        page ? get_rendered_page_(doci, widget, page) : NULL;
+    if (!surface)
+      continue; // pinned on the redraw after it's rendered
+    cairo_surface_destroy(slide->surface);
+    slide->surface = cairo_surface_reference(surface);
+    slide->rendered_id = doci->rendered_id;
+  }
+  // and get the slide after the next one ready to be rendered
+  int n = p->slides[SLIDE_CUR].n + 2 * p->direction;
+  if (doci->predecode_share > 0 && n >= 0 && n < doci->layout.page_count)
+    predecode_page(doci, widget, n);
+}
+
+static void draw_presentation(GtkWidget *widget, cairo_t *cr) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct Presentation *p = &doci->presentation;
+  cairo_set_source_rgb(cr, 0, 0, 0);
+  cairo_paint(cr);
+  // links and scrolling move the location without flipping, which would
+  // leave the slides of the page before pinned
+  int n = page_number(doci, doci->location);
+  if (n != p->slides[SLIDE_CUR].n)
+    flip_slides(widget, n - p->slides[SLIDE_CUR].n);
+  if (gtk_widget_get_allocated_width(widget) != p->width ||
+      gtk_widget_get_allocated_height(widget) != p->height)
+    fit_slide(widget, doci);
+  render_slides(doci, widget);
+  Page *page = get_cur_page(doci);
+  fz_point at = fz_transform_vector(
+      fz_make_point(-doci->scroll.x, -doci->scroll.y), get_scale_ctm(doci, page));
+  at = fz_make_point(nearbyintf(at.x), nearbyintf(at.y));
+  struct Slide *slide = &p->slides[SLIDE_CUR];
+  if (slide->surface && slide->rendered_id == doci->rendered_id) {
+    cairo_set_source_surface(cr, slide->surface, at.x, at.y);
+    cairo_paint(cr);
+    draw_annots(cr, at, doci, widget, page);
+  } else {
+    draw_page_pixmap(cr, at, doci, widget, page);
+  }
+}
+
+/*
+ * Return where the page at X in the current row is drawn, with the top left
+ * of the row at STOPPED in the view. Rounded to ints to avoid blurriness.
+ */
+static fz_point page_origin(DocInfo *doci, fz_point stopped, float x) {
+  return fz_make_point(nearbyintf(stopped.x + x * doci->zoom),
+                       nearbyintf(stopped.y));
+}
+
+// Draw the jump labels of the page at LOC, drawn with CTM, that are still
+// being typed.
+static void draw_jump_labels(cairo_t *cr, DocInfo *doci, fz_location loc,
+                             fz_matrix ctm) {
+  struct JumpLabels *jl = &doci->jump_labels;
+  size_t typed = strlen(jl->prefix);
+  cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL,
+                         CAIRO_FONT_WEIGHT_BOLD);
+  cairo_set_font_size(cr, JUMP_LABEL_FONT_SIZE);
+  for (int i = 0; i < jl->count; i++) {
+    JumpTarget *t = &jl->targets[i];
+    if (locationcmp(t->loc, loc) != 0 ||
+        strncmp(t->label, jl->prefix, typed) != 0)
+      continue;
+    fz_rect box = fz_transform_rect(t->box, ctm);
+    cairo_text_extents_t extents;
+    cairo_text_extents(cr, t->label, &extents);
+    cairo_set_source_rgba(cr, 1.0, 0.85, 0.2, 0.95);
+    cairo_rectangle(cr, box.x0, box.y0, extents.x_advance + 4,
+                    JUMP_LABEL_FONT_SIZE + 3);
+    cairo_fill(cr);
+    // the part typed so far is grayed out
+    cairo_move_to(cr, box.x0 + 2, box.y0 + JUMP_LABEL_FONT_SIZE);
+    cairo_set_source_rgb(cr, 0.5, 0.5, 0.5);
+    cairo_show_text(cr, jl->prefix);
+    cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+    cairo_show_text(cr, t->label + typed);
+  }
+}
+
+static void report_search_progress(GtkWidget *widget);
+
+gboolean draw_callback(GtkWidget *widget, cairo_t *cr) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  fz_context *ctx = c->doci.ctx;
+
+  if (c->doci.presentation.is_active) {
+    draw_presentation(widget, cr);
+    return FALSE;
+  }
+
+  int height = gtk_widget_get_allocated_height(widget);
+
+  // background
+  double gray = 0.941;
+  cairo_set_source_rgb(cr, gray, gray, gray);
+  cairo_paint(cr); // light gray
+
+  if (c->doci.jump.is_pending && should_finish_jump(&c->doci))
+    finish_jump(&c->doci);
+
+  DocInfo *doci = &c->doci;
+  int row = cur_row(doci);
+  int first_row = row;
+  fz_matrix scale_ctm = get_scale_ctm(doci, get_cur_page(doci));
+  fz_point stopped = fz_make_point(-doci->scroll.x, -doci->scroll.y);
+  stopped = fz_transform_vector(stopped, scale_ctm);
+  gboolean has_new_matches = FALSE;
+  int drawn = 0;
+
+  // every page drawn stays pinned in the page cache until the frame is over,
+  // so zoomed far out the rows that don't fit in it are left out
+  for (; stopped.y < height && row < doci->layout.row_count &&
+         drawn + row_end_page(&doci->layout, row) -
+                 row_first_page(&doci->layout, row) <=
+             MAX_FRAME_PAGES;
+       row++) {
+    Page *pages[MAX_COLUMNS];
+    float x[MAX_COLUMNS];
+    int count = get_row(doci, row, pages, x, NULL);
+    drawn += count;
+    // queue the renders of the whole row before drawing any of it
+    begin_job_batch(doci);
+    for (int i = 0; i < count; i++)
+      get_rendered_page_(doci, widget, pages[i]);
+    end_job_batch(doci);
+    for (int i = 0; i < count; i++) {
+      Page *page = pages[i];
+      fz_location loc = page->loc;
+      fz_point at = page_origin(doci, stopped, x[i]);
+      // draw actual page
+      draw_page_pixmap(cr, at, doci, widget, page);
+      fz_matrix draw_page_ctm = fz_concat(get_scale_ctm(doci, page),
+                                          fz_translate(at.x, at.y));
+      // highlight text selection
+      if ((doci->selection.is_active || doci->selection.is_in_progress) &&
+          locationcmp(loc, doci->selection.loc_end) <= 0) {
+        ensure_selection_cache_is_updated(ctx, doci, loc);
+        highlight_quads(&page->cache.selection.quads, cr, draw_page_ctm);
+      }
+      // highlight search results
+      if (doci->search) {
+        has_new_matches |=
+            ensure_search_cache_is_updated(doci, page, doci->search);
+        highlight_quads(&page->cache.search.quads, cr, draw_page_ctm);
+        // and the one goto_match went to
+        struct DocSearch *ds = &doci->doc_search;
+        if (ds->cur_page == page_number(doci, loc)) {
+          cairo_set_source_rgba(cr, 1.0, 0.5, 0.0, 0.4);
+          fill_quad(cr, ds->hits[ds->cur_page].quads[ds->cur_match],
+                    draw_page_ctm);
+        }
+      }
+      // highlight selected link
+      if (page->cache.highlighted_link) {
+        double light_gray = 0.92;
+        cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1 - light_gray);
+        fz_rect box = fz_transform_rect(page->cache.highlighted_link->rect,
+                                        draw_page_ctm);
+        cairo_rectangle(cr, box.x0, box.y0, box.x1 - box.x0, box.y1 - box.y0);
+        cairo_fill(cr);
+      }
+      // mark where the last forward search went
+      if (doci->synctex.has_mark &&
+          locationcmp(loc, doci->synctex.mark_loc) == 0) {
+        cairo_set_source_rgba(cr, 1.0, 0.8, 0.0, 0.35);
+        fz_rect box = fz_transform_rect(doci->synctex.mark, draw_page_ctm);
+        cairo_rectangle(cr, box.x0 - 2, box.y0, box.x1 - box.x0 + 4,
+                        box.y1 - box.y0);
+        cairo_fill(cr);
+      }
+      if (doci->jump_labels.count > 0)
+        draw_jump_labels(cr, doci, loc, draw_page_ctm);
+    }
+    stopped.y += doci->layout.row_heights[row] * doci->zoom;
+    stopped.y += PAGE_SEPARATOR_HEIGHT;
+  }
+  if (has_new_matches)
+    report_search_progress(widget);
+
+  // try not to OOM on large zoom
+  if (doci->zoom < MAX_APPROXIMATE_ZOOM) {
+    prerender_row(doci, widget, row);
+    prerender_row(doci, widget, first_row - 1);
+    predecode_rows_around(doci, widget, first_row, row - 1);
+  }
+  return FALSE;
+}
+
+static void synctex_inverse(GtkWidget *widget, fz_point point);
+
+static gboolean button_press_event(GtkWidget *widget, GdkEventButton *event) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct Selection *selection = &c->doci.selection;
+  switch (event->button) {
+  case GDK_BUTTON_PRIMARY:
+    if (c->doci.synctex.has_mark) {
+      c->doci.synctex.has_mark = FALSE;
+      gtk_widget_queue_draw(widget);
+    }
+    if (event->state & GDK_CONTROL_MASK) {
+      synctex_inverse(widget, fz_make_point(event->x, event->y));
+      break;
+    }
+    selection->is_in_progress = TRUE;
+    fz_point orig_point;
+    trace_point_to_page(widget, &c->doci, fz_make_point(event->x, event->y),
+                        &orig_point, &selection->loc_start);
+    selection->loc_end = selection->loc_start;
+    selection->start = orig_point;
+    selection->end = orig_point;
+    if (event->type == GDK_BUTTON_PRESS) {
+      selection->mode = FZ_SELECT_CHARS;
+    } else if (event->type == GDK_2BUTTON_PRESS ||
+               event->type == GDK_3BUTTON_PRESS) {
+      switch (event->type) {
+      case GDK_2BUTTON_PRESS:
+        selection->mode = FZ_SELECT_WORDS;
+        break;
+      case GDK_3BUTTON_PRESS:
+        selection->mode = FZ_SELECT_LINES;
+        break;
+      default:
+        fprintf(stderr, "Unhandled button press type\n");
+      }
+      fz_snap_selection(c->doci.ctx,
+                        get_page(&c->doci, selection->loc_start)->page_text,
+                        &selection->start, &selection->end, selection->mode);
+      selection->id++;
+      gtk_widget_queue_draw(widget);
+    }
+    break;
+  case GDK_BUTTON_MIDDLE:;
+    int width = gtk_widget_get_allocated_width(widget);
+    center_page(width, &c->doci);
+    gtk_widget_queue_draw(widget);
+    // TODO smooth scrolling like evince has
+    break;
+  }
+  return FALSE;
+}
+
+// TODO actually run this on realize
+static gboolean configure_event(GtkWidget *widget, GdkEventConfigure *event) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  GdkDisplay *display = gtk_widget_get_display(widget);
+  c->default_cursor = gdk_cursor_new_from_name(display, "default");
+  c->click_cursor = gdk_cursor_new_from_name(display, "pointer");
+  return FALSE;
+}
+
+static void drop_link_target(gpointer data) {
+  LinkTarget *target = data;
+  cairo_surface_destroy(target->preview);
+  free(target);
+}
+
+/*
+ * Return where the link URI leads. Links are only resolved the first time
+ * they're asked about, since resolving named destinations can walk the whole
+ * name tree of the document.
+ */
+static LinkTarget *resolve_link(DocInfo *doci, const char *uri) {
+  LinkTarget *target = g_hash_table_lookup(doci->link_targets, uri);
+  if (target)
+    return target;
+  target = calloc(1, sizeof(*target));
+  target->loc = fz_resolve_link(doci->ctx, doci->doc, uri, &target->point.x,
+                                &target->point.y);
+  g_hash_table_insert(doci->link_targets, g_strdup(uri), target);
+  return target;
+}
+
+// wraps args to render a link preview for passing into submit_background_job
+struct PreviewArgs {
+  BackgroundJob job;
+  fz_display_list *display_list;
+  fz_display_list *annot_list; // NULL if the page has no annotations
+  fz_rect region; // of the page to show
+  fz_matrix ctm;  // maps region onto surface
+  unsigned int annot_version; // of annot_list
+  cairo_surface_t *surface;
+  LinkTarget *target;
+};
+
+// runs on the GTK thread; shows the finished preview if the tooltip is up
+static gboolean link_preview_done(void *data) {
+  struct PreviewArgs *pa = data;
+  cairo_surface_destroy(pa->target->preview);
+  pa->target->preview = pa->surface;
+  pa->target->preview_version = pa->annot_version;
+  pa->target->is_preview_in_progress = FALSE;
+  if (pa->surface)
+    gtk_widget_trigger_tooltip_query(pa->job.widget);
+  free(pa);
+  return FALSE;
+}
+
+void thread_render_link_preview(gpointer data, gpointer user_data) {
+  DocInfo *doci = user_data;
+  struct PreviewArgs *pa = data;
+  fz_context *ctx = fz_clone_context(doci->ctx);
+  if (g_atomic_int_get(&doci->is_closing)) {
+    cairo_surface_destroy(pa->surface);
+    pa->surface = NULL;
+  } else {
+    draw_display_list(ctx, doci, pa->display_list, pa->region, pa->ctm,
+                      pa->surface, BACKDROP_WHITE, NULL);
+    if (pa->annot_list)
+      draw_display_list(ctx, doci, pa->annot_list, pa->region, pa->ctm,
+                        pa->surface, BACKDROP_KEEP, NULL);
+  }
+  fz_drop_display_list(ctx, pa->display_list);
+  fz_drop_display_list(ctx, pa->annot_list);
+  fz_drop_context(ctx);
+}
+
+/*
+ * Render the strip of PAGE, the destination of TARGET, that starts at the
+ * destination point, for showing in link tooltips, unless it's rendered
+ * already with the current annotations of PAGE.
+ */
+static void queue_link_preview(DocInfo *doci, GtkWidget *widget, Page *page,
+                               LinkTarget *target) {
+  if (target->is_preview_in_progress || !page->display_list)
+    return;
+  refresh_annot_list(doci, page);
+  if (target->preview && target->preview_version == page->annot_version)
+    return;
+  fz_rect bounds = page->page_bounds;
+  float scale = LINK_PREVIEW_WIDTH / (bounds.x1 - bounds.x0);
+  float height = LINK_PREVIEW_HEIGHT / scale;
+  // a little context above the destination, which is often the baseline of
+  // the line it points to
+  float y = fz_clamp(target->point.y - height / 4, bounds.y0,
+                     fz_max(bounds.y0, bounds.y1 - height));
+  struct PreviewArgs *pa = malloc(sizeof(*pa));
+  pa->display_list = fz_keep_display_list(doci->ctx, page->display_list);
+  pa->annot_list = fz_keep_display_list(doci->ctx, page->annot_list);
+  pa->annot_version = page->annot_version;
+  pa->region = bounds;
+  pa->region.y0 = y;
+  pa->region.y1 = fz_min(y + height, bounds.y1);
+  pa->ctm = fz_concat(fz_translate(-bounds.x0, -y), fz_scale(scale, scale));
+  fz_irect size = fz_round_rect(fz_transform_rect(pa->region, pa->ctm));
+  pa->surface =
+      cairo_image_surface_create(CAIRO_FORMAT_RGB24, size.x1, size.y1);
+  pa->target = target;
+  target->is_preview_in_progress = TRUE;
+  submit_background_job(&pa->job, widget, TIER_RENDER,
+                        thread_render_link_preview, link_preview_done);
+}
+
+/*
+ * A function with a valid signature for g_timeout_add; once the pointer has
+ * stayed on a link for a while, loads and renders its destination so that
+ * following it is instant, and prepares its tooltip preview. Runs again until
+ * the destination page is loaded.
+ */
+static gboolean prefetch_link_target(void *data) {
+  GtkWidget *widget = data;
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  Page *page = find_cached_page(doci, c->hover.loc);
+  fz_link *link = page ? page->cache.highlighted_link : NULL;
+  LinkTarget *target = NULL;
+  if (link && !fz_is_external_link(doci->ctx, link->uri))
+    target = resolve_link(doci, link->uri);
+  if (!target || target->loc.chapter == -1 || target->loc.page == -1) {
+    c->hover.prefetch_timer = 0;
+    return G_SOURCE_REMOVE;
+  }
+  Page *dst;
+  // like draw_callback, don't render ahead at large zooms
+  if (doci->zoom < MAX_APPROXIMATE_ZOOM) {
+    int n = page_number(doci, target->loc);
+    prerender_row(doci, widget, page_row(&doci->layout, n));
+    dst = find_cached_page(doci, target->loc);
+  } else {
+    dst = get_page_async(doci, widget, target->loc);
+  }
+  if (!dst)
+    return G_SOURCE_CONTINUE; // loading in the background
+  queue_link_preview(doci, widget, dst, target);
+  c->hover.prefetch_timer = 0;
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Update cache.highlighted_link on the page below mouse_point.
+ * Return TRUE if the link was updated.
+ * Also set the gdk mouse cursor in the correct shape.
+ */
+static gboolean update_highlighted_link(GtkWidget *widget,
+                                        fz_point mouse_point) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct Hover *hover = &c->hover;
+  fz_location old_loc = hover->loc;
+  trace_point_to_page(widget, &c->doci, mouse_point, &hover->page_point,
+                      &hover->loc);
+  Page *page = get_page(&c->doci, hover->loc);
+  gboolean changed = FALSE;
+  if (locationcmp(old_loc, hover->loc) != 0) {
+    // the pointer left the page whose link was highlighted
+    Page *old = find_cached_page(&c->doci, old_loc);
+    if (old && old->cache.highlighted_link) {
+      old->cache.highlighted_link = NULL;
+      changed = TRUE;
+    }
+  }
+  fz_link *found = find_link_at(page, hover->page_point);
+  if (found != page->cache.highlighted_link) {
+    page->cache.highlighted_link = found;
+    gdk_window_set_cursor(gtk_widget_get_window(widget),
+                          found ? c->click_cursor : c->default_cursor);
+    if (hover->prefetch_timer)
+      g_source_remove(hover->prefetch_timer);
+    hover->prefetch_timer =
+        found ? g_timeout_add(LINK_PREFETCH_DELAY_MS, prefetch_link_target,
+                              widget)
+              : 0;
+    changed = TRUE;
+  }
+  return changed;
+}
+
+static gboolean query_tooltip(GtkWidget *widget, int x, int y,
+                              gboolean keyboard_mode, GtkTooltip *tooltip) {
+  if (keyboard_mode)
+    return FALSE;
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  fz_context *ctx = c->doci.ctx;
+  // motion_notify_event normally traced the pointer already
+  struct Hover *hover = &c->hover;
+  if (hover->tick_id || hover->point.x != x || hover->point.y != y) {
+    hover->point = fz_make_point(x, y);
+    update_highlighted_link(widget, hover->point);
+  }
+  fz_link *link = get_page(&c->doci, hover->loc)->cache.highlighted_link;
+  if (!link)
+    return FALSE;
+
+  gchar text[PATH_MAX + 4]; // 4 for unicode link symbol
+  /* fprintf(stderr, "%s\n", link->uri); */
+  if (fz_is_external_link(ctx, link->uri)) {
+    snprintf(text, sizeof(text), "↪%s", link->uri);
+  } else {
+    LinkTarget *target = resolve_link(&c->doci, link->uri);
+    fz_location loc = target->loc;
+    if (target->preview) {
+      cairo_surface_t *preview = target->preview;
+      GdkPixbuf *icon = gdk_pixbuf_get_from_surface(
+          preview, 0, 0, cairo_image_surface_get_width(preview),
+          cairo_image_surface_get_height(preview));
+      if (icon) {
+        gtk_tooltip_set_icon(tooltip, icon);
+        g_object_unref(icon);
+      }
+    }
+    // start pages and chapters from 1
+    loc.chapter += 1;
+    loc.page += 1;
+    // TODO display the label of the page instead the absolute number. I'm not
+    // sure its possible in mupdf though.
+    if (c->doci.chapter_count > 1)
+      if (c->doci.location.chapter == loc.chapter)
+        snprintf(text, sizeof(text), "↪Page %d in current chapter", loc.page);
+      else
+        snprintf(text, sizeof(text), "↪Chapter %d, page %d", loc.chapter,
+                 loc.page);
+    else
+      snprintf(text, sizeof(text), "↪Page %d", loc.page);
+  }
+  gtk_tooltip_set_text(tooltip, text);
+  return TRUE;
+}
+
+/*
+ * Show the page at DST with POINT on it at the top left of the view, or
+ * centered horizontally if the row is narrower than the view.
+ */
+static void scroll_to_point(GtkWidget *widget, fz_location dst,
+                            fz_point point) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  int n = page_number(doci, dst);
+  doci->location = row_start(doci, n);
+  Page *pages[MAX_COLUMNS];
+  float x[MAX_COLUMNS];
+  float row_width;
+  get_row(doci, cur_row(doci), pages, x, &row_width);
+  fz_rect shown = view_bounds(doci, get_page(doci, dst));
+  doci->scroll = fz_make_point(point.x - shown.x0, point.y - shown.y0);
+  doci->scroll.x += x[n - page_number(doci, doci->location)];
+  int width = gtk_widget_get_allocated_width(widget);
+  fz_matrix scale_ctm = get_scale_ctm(doci, pages[0]);
+  if (width > fz_transform_vector(fz_make_point(row_width, 0), scale_ctm).x)
+    center_page(width, doci);
+}
+
+static void follow_link(GtkWidget *widget, const char *uri) {
+  // TODO follow non-internal links
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  LinkTarget *target = resolve_link(&c->doci, uri);
+  if (target->loc.chapter == -1 || target->loc.page == -1) // invalid link
+    // TODO emit some signal
+    return;
+  scroll_to_point(widget, target->loc, target->point);
+  // set back cursor. update_highlighted_link won't reset it since from
+  // its perspective the selected link did not change on the
+  // newly-followed page
+  gdk_window_set_cursor(gtk_widget_get_window(widget), c->default_cursor);
+}
+
+static gboolean handle_motion(GtkWidget *widget, GdkFrameClock *clock,
+                              gpointer data);
+
+static gboolean button_release_event(GtkWidget *widget, GdkEventButton *event) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  // the pointer moved before it was released, so a drag that hasn't reached
+  // the selection yet isn't a click, and mustn't extend it afterwards
+  if (c->hover.tick_id) {
+    gtk_widget_remove_tick_callback(widget, c->hover.tick_id);
+    handle_motion(widget, NULL, NULL);
+  }
+  switch (event->button) {
+  case GDK_BUTTON_PRIMARY:
+    if (event->state & GDK_CONTROL_MASK) // handled by synctex_inverse
+      break;
+    if (doci->selection.is_in_progress) {
+      doci->selection.is_in_progress = FALSE;
+    }
+    if (memcmp(&doci->selection.start, &doci->selection.end,
+               sizeof(fz_point)) != 0) {
+      doci->selection.is_active = TRUE;
+    } else {
+      if (doci->selection.is_active) {
+        doci->selection.is_active = FALSE;
+        gtk_widget_queue_draw(widget);
+      }
+
+      fz_point mouse_point = {event->x, event->y};
+      fz_point mouse_page_point;
+      fz_location mouse_page_loc;
+      trace_point_to_page(widget, &c->doci, mouse_point, &mouse_page_point,
+                          &mouse_page_loc);
+      Page *page = get_page(&c->doci, mouse_page_loc);
+      fz_link *link = page->cache.highlighted_link;
+      if (link != NULL) {
+        // clicked link
+        follow_link(widget, link->uri);
+        gtk_widget_queue_draw(widget);
+      }
+    }
+    break;
+  }
+  return FALSE;
+}
+
+static void add_jump_target(DocInfo *doci, int *capacity, int kind,
+                            Page *page, fz_rect box, fz_matrix ctm,
+                            const char *uri) {
+  struct JumpLabels *jl = &doci->jump_labels;
+  if (jl->count == *capacity) {
+    *capacity = MAX(256, *capacity * 2);
+    jl->targets = realloc(jl->targets, *capacity * sizeof(*jl->targets));
+  }
+  JumpTarget *t = &jl->targets[jl->count++];
+  t->kind = kind;
+  t->loc = page->loc;
+  t->n = page_number(doci, page->loc);
+  t->box = box;
+  t->screen = fz_transform_rect(box, ctm);
+  t->uri = g_strdup(uri);
+  t->label[0] = '\0';
+}
+
+static gboolean is_center_inside(fz_rect box, fz_rect area) {
+  return fz_is_point_inside_rect(
+      fz_make_point((box.x0 + box.x1) / 2, (box.y0 + box.y1) / 2), area);
+}
+
+/*
+ * Add the links and words of KINDS of PAGE, drawn with CTM, whose centers
+ * are in VIEW. Words are looked up in the cells of the word grid VIEW covers.
+ */
+static void add_page_jump_targets(DocInfo *doci, int *capacity, int kinds,
+                                  Page *page, fz_matrix ctm, fz_rect view) {
+  fz_rect b = page->page_bounds;
+  fz_rect area =
+      fz_intersect_rect(fz_transform_rect(view, fz_invert_matrix(ctm)), b);
+  if (fz_is_empty_rect(area))
+    return;
+  for (fz_link *link = page->links; (kinds & JUMP_LINKS) && link;
+       link = link->next)
+    if (!fz_is_external_link(doci->ctx, link->uri) &&
+        is_center_inside(link->rect, area))
+      add_jump_target(doci, capacity, JUMP_LINKS, page, link->rect, ctm,
+                      link->uri);
+  WordGrid *grid = &page->word_grid;
+  if (!(kinds & JUMP_WORDS) || !grid->cell_starts)
+    return;
+  int x0, x1, y0, y1;
+  link_grid_span(area.x0, area.x1, b.x0, b.x1, &x0, &x1);
+  link_grid_span(area.y0, area.y1, b.y0, b.y1, &y0, &y1);
+  for (int y = y0; y <= y1; y++) {
+    for (int x = x0; x <= x1; x++) {
+      int cell = y * LINK_GRID_SIZE + x;
+      for (int i = grid->cell_starts[cell]; i < grid->cell_starts[cell + 1];
+           i++)
+        if (is_center_inside(grid->boxes[i], area))
+          add_jump_target(doci, capacity, JUMP_WORDS, page, grid->boxes[i],
+                          ctm, NULL);
+    }
+  }
+}
+
+// Label the jump targets with strings of KEYS, all of the same length.
+static void label_jump_targets(struct JumpLabels *jl, const char *keys) {
+  int k = strlen(keys);
+  int len = 1;
+  for (long span = k; span < jl->count; span *= k)
+    len++;
+  for (int i = 0; i < jl->count; i++) {
+    char *label = jl->targets[i].label;
+    label[len] = '\0';
+    for (int j = len - 1, n = i; j >= 0; j--, n /= k)
+      label[j] = keys[n % k];
+  }
+}
+
+void hide_jump_labels(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct JumpLabels *jl = &c->doci.jump_labels;
+  for (int i = 0; i < jl->count; i++)
+    g_free(jl->targets[i].uri);
+  free(jl->targets);
+  jl->targets = NULL;
+  jl->count = 0;
+  jl->prefix[0] = '\0';
+  gtk_widget_queue_draw(widget);
+}
+
+/*
+ * Label every link and word of KINDS, a mask of JumpKinds, whose center is in
+ * view with strings of the characters of KEYS, and draw the labels over them
+ * until hide_jump_labels. Set *TARGETS to them, in page order, and return how
+ * many there are; those that don't fit in labels of JUMP_LABEL_MAX - 1 keys
+ * are left out. The words come from the word grid built with each page, so
+ * this doesn't walk the text.
+ */
+int show_jump_labels(GtkWidget *widget, int kinds, const char *keys,
+                     const JumpTarget **targets) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct JumpLabels *jl = &doci->jump_labels;
+  hide_jump_labels(widget);
+  *targets = NULL;
+  int k = strlen(keys);
+  if (k < 2 || !doci->doc || doci->presentation.is_active)
+    return 0;
+  int width = gtk_widget_get_allocated_width(widget);
+  int height = gtk_widget_get_allocated_height(widget);
+  fz_rect view = fz_make_rect(0, 0, width, height);
+  // the same walk over the rows in view as draw_callback's
+  int row = cur_row(doci);
+  fz_matrix scale_ctm = get_scale_ctm(doci, get_cur_page(doci));
+  fz_point stopped = fz_make_point(-doci->scroll.x, -doci->scroll.y);
+  stopped = fz_transform_vector(stopped, scale_ctm);
+  int capacity = 0;
+  for (; stopped.y < height && row < doci->layout.row_count; row++) {
+    Page *pages[MAX_COLUMNS];
+    float x[MAX_COLUMNS];
+    int count = get_row(doci, row, pages, x, NULL);
+    for (int i = 0; i < count; i++) {
+      fz_point at = page_origin(doci, stopped, x[i]);
+      fz_matrix ctm =
+          fz_concat(get_scale_ctm(doci, pages[i]), fz_translate(at.x, at.y));
+      add_page_jump_targets(doci, &capacity, kinds, pages[i], ctm, view);
+    }
+    stopped.y += doci->layout.row_heights[row] * doci->zoom;
+    stopped.y += PAGE_SEPARATOR_HEIGHT;
+  }
+  long max_count = 1;
+  for (int i = 1; i < JUMP_LABEL_MAX && max_count < jl->count; i++)
+    max_count *= k;
+  while (jl->count > max_count)
+    g_free(jl->targets[--jl->count].uri);
+  label_jump_targets(jl, keys);
+  *targets = jl->targets;
+  return jl->count;
+}
+
+// Draw only the jump labels starting with PREFIX, and return how many do.
+int narrow_jump_labels(GtkWidget *widget, const char *prefix) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct JumpLabels *jl = &c->doci.jump_labels;
+  g_strlcpy(jl->prefix, prefix, sizeof(jl->prefix));
+  size_t typed = strlen(jl->prefix);
+  int count = 0;
+  for (int i = 0; i < jl->count; i++)
+    count += strncmp(jl->targets[i].label, jl->prefix, typed) == 0;
+  gtk_widget_queue_draw(widget);
+  return count;
+}
+
+/*
+ * Hide the jump labels and go to target I of show_jump_labels: follow it if
+ * it's a link, or select it if it's a word. Return FALSE if there's no such
+ * target.
+ */
+gboolean jump_to_target(GtkWidget *widget, int i) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct JumpLabels *jl = &doci->jump_labels;
+  if (i < 0 || i >= jl->count)
+    return FALSE;
+  JumpTarget t = jl->targets[i];
+  t.uri = g_strdup(t.uri);
+  hide_jump_labels(widget);
+  if (t.kind == JUMP_LINKS) {
+    follow_link(widget, t.uri);
+  } else {
+    // like a double click on the word
+    struct Selection *selection = &doci->selection;
+    fz_point center =
+        fz_make_point((t.box.x0 + t.box.x1) / 2, (t.box.y0 + t.box.y1) / 2);
+    selection->is_in_progress = FALSE;
+    selection->loc_start = selection->loc_end = t.loc;
+    selection->start = selection->end = center;
+    selection->mode = FZ_SELECT_WORDS;
+    fz_snap_selection(doci->ctx, get_page(doci, t.loc)->page_text,
+                      &selection->start, &selection->end, selection->mode);
+    selection->is_active = memcmp(&selection->start, &selection->end,
+                                  sizeof(fz_point)) != 0;
+    selection->id++;
+  }
+  g_free(t.uri);
+  return TRUE;
+}
+
+/*
+ * Move the end of the selection in progress to POINT on the page at LOC.
+ * Only the pages between the old and the new end can change, so the selection
+ * cached for the others stays valid under the new selection id.
+ */
+static void move_selection_end(DocInfo *doci, fz_location loc, fz_point point) {
+  struct Selection *selection = &doci->selection;
+  fz_location lo = selection->loc_end;
+  fz_location hi = loc;
+  if (locationcmp(lo, hi) > 0) {
+    lo = loc;
+    hi = selection->loc_end;
+  }
+  unsigned int old_id = selection->id++;
+  selection->loc_end = loc;
+  selection->end = point;
+  struct PageCache *cache = &doci->page_cache;
+  for (int i = 0; i < cache->len; i++) {
+    CachedQuads *cached = &cache->pages[i]->cache.selection;
+    if (cached->id == old_id && (locationcmp(cache->locs[i], lo) < 0 ||
+                                 locationcmp(cache->locs[i], hi) > 0))
+      cached->id = selection->id;
+  }
+}
+
+// a function with a valid signature for gtk_widget_add_tick_callback;
+// handles the last pointer motion since the previous frame
+static gboolean handle_motion(GtkWidget *widget, GdkFrameClock *clock,
+                              gpointer data) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct Hover *hover = &c->hover;
+  hover->tick_id = 0;
+  if (hover->is_selecting) {
+    fz_point end_point;
+    fz_location end_loc;
+    trace_point_to_page(widget, &c->doci, hover->point, &end_point, &end_loc);
+    move_selection_end(&c->doci, end_loc, end_point);
+    gtk_widget_queue_draw(widget);
+  } else if (update_highlighted_link(widget, hover->point)) {
+    // hovering over link
+    gtk_widget_queue_draw(widget);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Pointers can report motion many times per frame, so only remember where it
+ * went, and hit-test it once before the next frame is drawn.
+ */
+static gboolean motion_notify_event(GtkWidget *widget, GdkEventMotion *event) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct Hover *hover = &c->hover;
+  hover->point = fz_make_point(event->x, event->y);
+  hover->is_selecting = (event->state & GDK_BUTTON1_MASK) != 0;
+  if (!hover->tick_id)
+    hover->tick_id = gtk_widget_add_tick_callback(widget, handle_motion, NULL,
+                                                  NULL);
+  return FALSE;
+}
+
+/*
+ * Set location and scroll.y so that the top of the view is OFFSET from the
+ * start of the document, clamped to the document.
+ */
+static void set_view_offset(DocInfo *doci, double offset) {
+  Layout *layout = &doci->layout;
+  Page *pages[MAX_COLUMNS];
+  float x[MAX_COLUMNS];
+  int row;
+  double rest;
+  while (1) {
+    row = layout_find(doci, fz_max(offset, 0), &rest);
+    // the height of ROW may change when its pages are loaded, but not its
+    // offset
+    int count = get_row(doci, row, pages, x, NULL);
+    // a page that failed to load never gets its real height, so looking
+    // again would find the same row forever
+    gboolean has_failed = FALSE;
+    for (int i = 0; i < count; i++)
+      has_failed |= !pages[i]->display_list;
+    if (has_failed || row == layout->row_count - 1 ||
+        rest < layout->row_heights[row] + separator_height(doci))
+      break;
+  }
+  doci->location = pages[0]->loc;
+  // at the end of the document, stop at the end of the last row
+  doci->scroll.y = fz_min(rest, layout->row_heights[row]);
+}
+
+/*
+ * Move to next/previous pages if scroll.y is past the page bound
+ */
+static void scroll_pages(DocInfo *doci) {
+  set_view_offset(doci, view_offset(doci));
+}
+
+static void scroll(DocInfo *doci, fz_point delta) {
+  doci->scroll.x += delta.x;
+  doci->scroll.y += delta.y;
+  scroll_pages(doci);
+}
+
+static void change_zoom(DocInfo *doci, float new_zoom) {
+  if (new_zoom > MAX_ZOOM) {
+    new_zoom = MAX_ZOOM;
+  }
+  if (doci->zoom == new_zoom)
+    return;
+  doci->zoom = new_zoom;
+  doci->rendered_id++;
+}
+/*
+ * Change zoom to NEW_ZOOM and set scroll.x, scroll.y so that POINT (a
+ * point in the bounds of WIDGET) stays on the same pixel as it did before
+ * adjusting the zoom.
+ */
+static void zoom_around_point(GtkWidget *widget, DocInfo *doci, float new_zoom,
+                              fz_point point) {
+  fz_point original_point_in_page;
+  fz_location original_loc;
+  trace_point_to_page(widget, doci, point, &original_point_in_page,
+                      &original_loc);
+  change_zoom(doci, new_zoom);
+  fz_matrix new_scale_ctm = get_scale_ctm(doci, get_page(doci, original_loc));
+  fz_matrix new_scale_ctm_inv = fz_invert_matrix(new_scale_ctm);
+  fz_point new_point =
+      fz_transform_point(original_point_in_page, new_scale_ctm);
+  fz_point scaled_diff =
+      fz_make_point(new_point.x - point.x, new_point.y - point.y);
+  fz_point unscaled_diff =
+      fz_transform_vector(scaled_diff, new_scale_ctm_inv);
+  // unscaled_diff is relative to the top left of the original page
+  int n = page_number(doci, original_loc);
+  int row = page_row(&doci->layout, n);
+  Page *pages[MAX_COLUMNS];
+  float x[MAX_COLUMNS];
+  get_row(doci, row, pages, x, NULL);
+  doci->scroll.x = x[n - row_first_page(&doci->layout, row)] + unscaled_diff.x;
+  set_view_offset(doci, layout_offset(doci, row) + unscaled_diff.y);
+}
+
+void zoom_relatively_around_point(GtkWidget *widget, float mult,
+                                  fz_point point) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  zoom_around_point(widget, &c->doci, c->doci.zoom * mult, point);
+}
+
+/*
+ * Scroll relative to widget width/height.
+ * Having mult.y = 0.1 means scroll down 10% of the widget height.
+ */
+void scroll_relatively(GtkWidget *widget, fz_point mult) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  int w = gtk_widget_get_allocated_width(widget);
+  int h = gtk_widget_get_allocated_height(widget);
+  Page *page = get_cur_page(&c->doci);
+  // don't include rotation
+  float rotate = c->doci.rotate;
+  c->doci.rotate = 0;
+  fz_matrix scale_ctm = get_scale_ctm(&c->doci, page);
+  c->doci.rotate = rotate;
+  fz_matrix scale_ctm_inv = fz_invert_matrix(scale_ctm);
+  fz_point scrolled =
+      fz_transform_vector(fz_make_point(mult.x * w, mult.y * h), scale_ctm_inv);
+  scroll(&c->doci, scrolled);
+  // we could call update_highlighted_link here, but I actually like it when
+  // sole scrolling doesn't highlight things or creates tooltips
+}
+
+void scroll_to_page_start(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  c->doci.scroll.y = 0;
+}
+
+void scroll_to_page_end(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  int h = gtk_widget_get_allocated_height(widget);
+  Page *pages[MAX_COLUMNS];
+  float x[MAX_COLUMNS];
+  int row = cur_row(&c->doci);
+  get_row(&c->doci, row, pages, x, NULL);
+  fz_matrix scale_ctm = get_scale_ctm(&c->doci, pages[0]);
+  float row_height = c->doci.layout.row_heights[row];
+  float scroll_scaled =
+      fz_transform_vector(fz_make_point(0, row_height), scale_ctm).y - h;
+  c->doci.scroll.y = fz_transform_vector(fz_make_point(0, scroll_scaled),
+                                        fz_invert_matrix(scale_ctm))
+                         .y;
+  scroll_pages(&c->doci);
+}
+
+// Scroll I rows of pages down, or up for negative I.
+void scroll_whole_pages(GtkWidget *widget, int i) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  Layout *layout = &c->doci.layout;
+  int future = page_number(&c->doci, c->doci.location) + i * layout->columns;
+  if (future >= layout->page_count) {
+    c->doci.location = row_start(&c->doci, layout->page_count - 1);
+    scroll_to_page_end(widget);
+  } else if (future < 0) {
+    // beginning of document, scroll to page start
+    c->doci.location = fz_make_location(0, 0);
+    c->doci.scroll.y = 0;
+  } else {
+    c->doci.location = row_start(&c->doci, future);
+  }
+}
+
+// a function with a valid signature for g_timeout_add
+static gboolean jump_deadline(void *data) {
+  gtk_widget_queue_draw(data);
+  g_object_unref(data);
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Jump to the start of page N, counting from 0. The view switches once the
+ * page is rendered, or after GOTO_MAX_WAIT_MS, so that it doesn't flash an
+ * empty page first.
+ */
+void goto_page(GtkWidget *widget, int n) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  n = fz_clampi(n, 0, doci->layout.page_count - 1);
+  struct Jump *jump = &doci->jump;
+  jump->to = location_from_page_number(doci, n);
+  jump->from = doci->location;
+  jump->from_scroll_y = doci->scroll.y;
+  jump->deadline = g_get_monotonic_time() + GOTO_MAX_WAIT_MS * 1000;
+  jump->is_pending = TRUE;
+  get_rendered_page_(doci, widget, get_page(doci, jump->to));
+  if (should_finish_jump(doci)) {
+    finish_jump(doci);
+  } else {
+    g_timeout_add(GOTO_MAX_WAIT_MS, jump_deadline, g_object_ref(widget));
+  }
+  gtk_widget_queue_draw(widget);
+}
+
+// Return the number of the current page, counting from 0.
+int get_current_page(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  return page_number(&c->doci, c->doci.location);
+}
+
+int get_page_count(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  return c->doci.layout.page_count;
+}
+
+void goto_first_page(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  c->doci.location = fz_make_location(0, 0);
+  c->doci.scroll.y = 0;
+}
+
+void goto_last_page(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  c->doci.location = row_start(&c->doci, c->doci.layout.page_count - 1);
+  scroll_to_page_end(widget);
+}
+
+/*
+ * Return how far down the document the top of the view is, from 0 at the
+ * start of the first page to 1 at the end of the last one.
+ */
+double get_position(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  return view_offset(&c->doci) / layout_total_height(&c->doci);
+}
+
+// Scroll to POSITION, as returned by get_position.
+void set_position(GtkWidget *widget, double position) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  set_view_offset(&c->doci, position * layout_total_height(&c->doci));
+  gtk_widget_queue_draw(widget);
+}
+
+/*
+ * Lay out pages in rows of COLUMNS pages. With BOOK, the first page is alone
+ * on the right of the first row, so that the rows are spreads of facing pages
+ * for two columns.
+ */
+void set_columns(GtkWidget *widget, int columns, gboolean book) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  Layout *layout = &doci->layout;
+  columns = fz_clampi(columns, 1, MAX_COLUMNS);
+  int first_column = book && columns > 1 ? columns - 1 : 0;
+  if (columns == layout->columns && first_column == layout->first_column)
+    return;
+  int n = page_number(doci, doci->location);
+  layout->columns = columns;
+  layout->first_column = first_column;
+  layout_build_rows(layout);
+  // stay on the row of the page at the top
+  doci->location = row_start(doci, n);
+  doci->scroll.x = 0;
+  center(widget);
+  gtk_widget_queue_draw(widget);
+}
+
+/*
+ * Zoom so that the current slide fits the view, and center it. Its position
+ * is kept in scroll, so that pointer events find the pages under them as
+ * usual; scroll.y is negative to leave room above slides shorter than the
+ * view.
+ */
+static void fit_slide(GtkWidget *widget, DocInfo *doci) {
+  struct Presentation *p = &doci->presentation;
+  p->width = gtk_widget_get_allocated_width(widget);
+  p->height = gtk_widget_get_allocated_height(widget);
+  Page *page = get_cur_page(doci);
+  float w = view_width(doci, page), h = view_height(doci, page);
+  change_zoom(doci, fz_min(p->width / w, p->height / h));
+  center_page(p->width, doci);
+  doci->scroll.y = -(p->height / doci->zoom - h) / 2;
+}
+
+static void unpin_slides(struct Presentation *p) {
+  for (size_t i = 0; i < G_N_ELEMENTS(p->slides); i++) {
+    cairo_surface_destroy(p->slides[i].surface);
+    p->slides[i].surface = NULL;
+  }
+}
+
+/*
+ * Show one page at a time, fitted to the view, with the previous and next
+ * pages rendered ahead so that flip_slides only has to swap surfaces. The
+ * caller is expected to make the view full-screen. Leaving keeps the current
+ * page, and restores the zoom and columns from before.
+ */
+void set_presentation(GtkWidget *widget, gboolean active) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct Presentation *p = &doci->presentation;
+  if (p->is_active == active)
+    return;
+  if (active) {
+    p->zoom = doci->zoom;
+    p->columns = doci->layout.columns;
+    p->first_column = doci->layout.first_column;
+    set_columns(widget, 1, FALSE);
+    int n = page_number(doci, doci->location);
+    for (int i = SLIDE_PREV; i <= SLIDE_NEXT; i++)
+      p->slides[i] = (struct Slide){n + i - SLIDE_CUR, NULL, 0};
+    p->direction = 1;
+    p->missed = 0;
+    p->is_active = TRUE;
+    fit_slide(widget, doci);
+  } else {
+    p->is_active = FALSE;
+    unpin_slides(p);
+    change_zoom(doci, p->zoom);
+    set_columns(widget, p->columns, p->first_column != 0);
+    doci->scroll.y = 0;
+    center(widget);
+  }
+  gtk_widget_queue_draw(widget);
+}
+
+/*
+ * Go DELTA slides forward, or back for negative DELTA. Going to a neighbor
+ * only moves the pinned surfaces along, so the new slide shows on the next
+ * frame unless it hadn't finished rendering, which counts as a missed slide.
+ */
+void flip_slides(GtkWidget *widget, int delta) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct Presentation *p = &doci->presentation;
+  struct Slide *slides = p->slides;
+  int cur = slides[SLIDE_CUR].n;
+  int n = fz_clampi(cur + delta, 0, doci->layout.page_count - 1);
+  if (!p->is_active || n == cur)
+    return;
+  p->direction = n > cur ? 1 : -1;
+  if (n == cur + 1) {
+    cairo_surface_destroy(slides[SLIDE_PREV].surface);
+    slides[SLIDE_PREV] = slides[SLIDE_CUR];
+    slides[SLIDE_CUR] = slides[SLIDE_NEXT];
+    slides[SLIDE_NEXT] = (struct Slide){n + 1, NULL, 0};
+  } else if (n == cur - 1) {
+    cairo_surface_destroy(slides[SLIDE_NEXT].surface);
+    slides[SLIDE_NEXT] = slides[SLIDE_CUR];
+    slides[SLIDE_CUR] = slides[SLIDE_PREV];
+    slides[SLIDE_PREV] = (struct Slide){n - 1, NULL, 0};
+  } else {
+    unpin_slides(p);
+    for (int i = SLIDE_PREV; i <= SLIDE_NEXT; i++)
+      slides[i].n = n + i - SLIDE_CUR;
+  }
+  doci->location = location_from_page_number(doci, n);
+  // slides of another size are fitted at another zoom, and re-rendered
+  fit_slide(widget, doci);
+  if (!slides[SLIDE_CUR].surface ||
+      slides[SLIDE_CUR].rendered_id != doci->rendered_id)
+    p->missed++;
+  gtk_widget_queue_draw(widget);
+}
+
+// Return the number of flips whose slide wasn't rendered in time.
+unsigned int get_missed_slides(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  return c->doci.presentation.missed;
+}
+
+void zoom_to_window_center(GtkWidget *widget, float multiplier) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  int w = gtk_widget_get_allocated_width(widget);
+  int h = gtk_widget_get_allocated_height(widget);
+  float old = c->doci.zoom;
+  /* zoom_around_point(widget, &c->doci, old * multiplier, fz_make_point(20,
+   * 20)); */
+  zoom_around_point(widget, &c->doci, old * multiplier,
+                    fz_make_point(w / 2.0f, h / 2.0f));
+}
+
+void center(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  int w = gtk_widget_get_allocated_width(widget);
+  center_page(w, &c->doci);
+}
+
+void fit_width(GtkWidget *widget) {
+  int w = gtk_widget_get_allocated_width(widget);
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  c->doci.scroll.x = 0;
+  // fit the whole row; separators keep their width in pixels
+  Page *pages[MAX_COLUMNS];
+  float x[MAX_COLUMNS];
+  float row_width;
+  int count = get_row(&c->doci, cur_row(&c->doci), pages, x, &row_width);
+  float gaps = (count - 1) * separator_height(&c->doci);
+  change_zoom(&c->doci, (w - (count - 1) * PAGE_SEPARATOR_HEIGHT) /
+                            (row_width - gaps));
+  gtk_widget_queue_draw(widget);
+}
+
+void fit_height(GtkWidget *widget) {
+  int h = gtk_widget_get_allocated_height(widget);
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  c->doci.scroll.y = 0;
+  int row = cur_row(&c->doci);
+  Page *pages[MAX_COLUMNS];
+  float x[MAX_COLUMNS];
+  get_row(&c->doci, row, pages, x, NULL);
+  change_zoom(&c->doci, (float)h / c->doci.layout.row_heights[row]);
+  center(widget);
+  gtk_widget_queue_draw(widget);
+}
+
+/*
+ * Zoom so that the content of the current row fills the width of the window,
+ * leaving its margins out of view.
+ */
+void fit_content_width(GtkWidget *widget) {
+  int w = gtk_widget_get_allocated_width(widget);
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  Page *pages[MAX_COLUMNS];
+  float x[MAX_COLUMNS];
+  int row = cur_row(doci);
+  int count = get_row(doci, row, pages, x, NULL);
+  Page *first = pages[0], *last = pages[count - 1];
+  // margins of the first and last page of the row that are left out
+  float left = content_bounds(first).x0 - view_bounds(doci, first).x0;
+  float right = view_bounds(doci, last).x1 - content_bounds(last).x1;
+  float gaps = (count - 1) * separator_height(doci);
+  float pages_width = x[count - 1] + view_width(doci, last) - gaps;
+  change_zoom(doci, (w - (count - 1) * PAGE_SEPARATOR_HEIGHT) /
+                        (pages_width - left - right));
+  // separators have a fixed width in pixels, so the offsets changed
+  get_row(doci, row, pages, x, NULL);
+  doci->scroll.x = x[0] + left;
+  gtk_widget_queue_draw(widget);
+}
+
+/*
+ * Show only the content of pages, leaving their margins out of the layout
+ * and of the renders, or show the whole pages again.
+ */
+void set_trim_margins(GtkWidget *widget, gboolean trim) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  if (doci->trim_margins == trim)
+    return;
+  doci->trim_margins = trim;
+  doci->rendered_id++;
+  layout_reset(doci, view_height(doci, get_cur_page(doci)));
+  doci->scroll.y = 0;
+  center(widget);
+  gtk_widget_queue_draw(widget);
+}
+
+// wraps args to read a SyncTeX file for passing into submit_background_job
+struct SyncTeXArgs {
+  BackgroundJob job;
+  char *path;
+  time_t mtime;
+  SyncTeX *index;
+};
 
-  // try not to OOM on large zoom
-  if (doci->zoom < MAX_APPROXIMATE_ZOOM) {
-    Page *next = get_page(doci, fz_next_page(doci->ctx, doci->doc, loc));
-    get_rendered_page_(doci, widget, next);
-    Page *prev = get_page(doci, fz_previous_page(doci->ctx, doci->doc, loc));
-    get_rendered_page_(doci, widget, prev);
+// runs on the GTK thread; replaces the index, and runs the waiting search
+static gboolean synctex_loaded(void *data) {
+  struct SyncTeXArgs *sa = data;
+  GtkWidget *widget = sa->job.widget;
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct SyncTeXState *st = &c->doci.synctex;
+  synctex_free(st->index);
+  st->index = sa->index;
+  st->mtime = sa->mtime;
+  st->is_loading = FALSE;
+  char *file = st->pending_file;
+  st->pending_file = NULL;
+  // it waits again if the file changed once more meanwhile
+  if (file) {
+    enum SyncTeXView view = synctex_forward(widget, file, st->pending_line);
+    if (view != SYNCTEX_VIEW_PENDING)
+      g_signal_emit(widget, signals[SIGNAL_SYNCTEX_VIEWED], 0,
+                    view == SYNCTEX_VIEW_SHOWN);
+    g_free(file);
   }
+  g_free(sa->path);
+  free(sa);
+  return FALSE;
+}
 
-  cairo_surface_t *surface = get_rendered_page_(doci, widget, page);
+static void thread_load_synctex(gpointer data, gpointer user_data) {
+  struct SyncTeXArgs *sa = data;
+  sa->index = synctex_load(sa->path);
+}
 
-  struct CachedSurface *prc = &page->cache.rendered;
-  if (surface) {
-    cairo_set_source_surface(cr, surface, translation.x, translation.y);
-    cairo_paint(cr);
-  } else if (prc->surface) {
-    // approximate new pixmap by scaling and rotating the old one
-    double z = doci->zoom / prc->zoom;
-    fprintf(stderr, "z: %.2f\n", z);
-    double r = doci->rotate - prc->rotate;
-    cairo_save(cr);
-    cairo_scale(cr, z, z);
-    cairo_rotate(cr, r);
-    fz_point inv_trans = fz_transform_point(
-        translation, fz_invert_matrix(get_scale_ctm(doci, page)));
-    cairo_set_source_surface(cr, prc->surface, inv_trans.x, inv_trans.y);
-    cairo_paint(cr);
-    cairo_restore(cr);
+/*
+ * Start reading the SyncTeX file of the document in the background, unless
+ * it hasn't changed since it was last read. Return TRUE if it's being read.
+ */
+static gboolean reload_synctex(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct SyncTeXState *st = &c->doci.synctex;
+  if (st->is_loading)
+    return TRUE;
+  char *path = synctex_path(c->doci.filename);
+  struct stat sb;
+  if (!path || stat(path, &sb) != 0 || sb.st_mtime == st->mtime) {
+    g_free(path);
+    return FALSE;
   }
+  struct SyncTeXArgs *sa = malloc(sizeof(*sa));
+  sa->path = path;
+  sa->mtime = sb.st_mtime;
+  st->is_loading = TRUE;
+  submit_background_job(&sa->job, widget, TIER_SYNCTEX, thread_load_synctex,
+                        synctex_loaded);
+  return TRUE;
 }
 
-// a function with a valid signature for gdk_threads_add_idle
-gboolean widget_queue_draw(void *data) {
-  GtkWidget *widget = data;
-  gtk_widget_queue_draw(widget);
-  return FALSE;
+// Like scroll_to_point, but show POINT a third of the way down the view.
+static void reveal_point(GtkWidget *widget, fz_location dst, fz_point point) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  scroll_to_point(widget, dst, point);
+  doci->scroll.y -= gtk_widget_get_allocated_height(widget) / 3.0 / doci->zoom;
+  scroll_pages(doci);
 }
 
-void thread_render(gpointer data, gpointer user_data) {
-  DocInfo *doci = user_data;
-  struct RenderArgs *ra = data;
-  Page *page = ra->page;
-  // mupdf requires one ctx per thread
-  // however, in glib's threadpool we can't associate one for each thread
-  // so a ctx is created on each rendering
-  fz_context *ctx = fz_clone_context(doci->ctx);
-  cairo_surface_t *finished = render_page(ctx, doci, ra->page);
-  fz_drop_context(ctx);
-  if (ra->rendered_id != page->cache.rendered.id) {
-    return; // trust that another thread takes care of it and die in peace
+/*
+ * Scroll to where LINE of the TeX input FILE went, and mark it until the next
+ * click. If the SyncTeX file changed since it was read, this happens once it's
+ * read again, which synctex-viewed reports.
+ */
+enum SyncTeXView synctex_forward(GtkWidget *widget, const char *file,
+                                 int line) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct SyncTeXState *st = &doci->synctex;
+  if (reload_synctex(widget)) {
+    g_free(st->pending_file);
+    st->pending_file = g_strdup(file);
+    st->pending_line = line;
+    return SYNCTEX_VIEW_PENDING;
   }
-  page->cache.rendered.zoom = doci->zoom;
-  page->cache.rendered.rotate = doci->rotate;
-  cairo_surface_destroy(page->cache.rendered.surface);
-  page->cache.rendered.surface = finished;
-  page->cache.rendered.is_in_progress = 0;
-  free(ra);
-  gdk_threads_add_idle(widget_queue_draw, ra->widget);
+  int n;
+  fz_rect rect;
+  if (!st->index || !synctex_view(st->index, file, line, &n, &rect) ||
+      n >= doci->layout.page_count)
+    return SYNCTEX_VIEW_NONE;
+  fz_location loc = location_from_page_number(doci, n);
+  // SyncTeX measures from the top left of the page
+  fz_rect bounds = get_page(doci, loc)->page_bounds;
+  rect = fz_transform_rect(rect, fz_translate(bounds.x0, bounds.y0));
+  if (rect.y0 == rect.y1)
+    rect.y0 -= SYNCTEX_MARK_HEIGHT;
+  st->has_mark = TRUE;
+  st->mark_loc = loc;
+  st->mark = rect;
+  reveal_point(widget, loc, fz_make_point(rect.x0, rect.y0));
+  gtk_widget_queue_draw(widget);
+  return SYNCTEX_VIEW_SHOWN;
 }
 
-gboolean draw_callback(GtkWidget *widget, cairo_t *cr) {
+// Emit synctex-edit with the line of the TeX input POINT came from.
+static void synctex_inverse(GtkWidget *widget, fz_point point) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  fz_context *ctx = c->doci.ctx;
+  DocInfo *doci = &c->doci;
+  struct SyncTeXState *st = &doci->synctex;
+  // a stale index is better than none until the new one is read
+  reload_synctex(widget);
+  if (!st->index)
+    return;
+  fz_point page_point;
+  fz_location loc;
+  trace_point_to_page(widget, doci, point, &page_point, &loc);
+  fz_rect bounds = get_page(doci, loc)->page_bounds;
+  page_point.x -= bounds.x0;
+  page_point.y -= bounds.y0;
+  const SyncRecord *r =
+      synctex_edit(st->index, page_number(doci, loc), page_point);
+  if (!r || r->file < 0 || r->file >= st->index->file_count ||
+      !st->index->files[r->file])
+    return;
+  g_signal_emit(widget, signals[SIGNAL_SYNCTEX_EDIT], 0,
+                st->index->files[r->file], r->line);
+}
 
-  int height = gtk_widget_get_allocated_height(widget);
+void unset_selection(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct Selection *selection = &c->doci.selection;
+  if (!selection->is_active && !selection->is_in_progress)
+    return;
+  selection->is_active = 0;
+  selection->is_in_progress = 0;
+  selection->id++;
+  gtk_widget_queue_draw(widget);
+}
 
-  // background
-  double gray = 0.941;
-  cairo_set_source_rgb(cr, gray, gray, gray);
-  cairo_paint(cr); // light gray
+/*
+ * Every page is searched in the background as soon as the needle is set, so
+ * that matches can be counted and gone to anywhere in the document. Pages are
+ * loaded on the document instances, without display lists and without
+ * touching the page cache, nearest pages first; the matches are collected in
+ * DocSearch.hits on the GTK thread. Changing the needle cancels the run: the
+ * jobs already queued find it cancelled and return without loading anything.
+ */
+struct SearchRun {
+  SearchNeedle *needle;
+  int is_cancelled; // atomic
+  int pending;      // jobs not done yet; only touched on the GTK thread
+};
 
-  fz_location loc = c->doci.location;
-  Page *page = get_page(&c->doci, loc);
-  fz_matrix scale_ctm = get_scale_ctm(&c->doci, page);
-  fz_point stopped = fz_make_point(-c->doci.scroll.x, -c->doci.scroll.y);
-  stopped = fz_transform_point(stopped, scale_ctm);
-
-  while (stopped.y < height) {
-    // round to ints to avoid blurriness
-    stopped.x = nearbyintf(stopped.x);
-    stopped.y = nearbyintf(stopped.y);
-    // draw actual page
-    draw_page_pixmap(cr, stopped, &c->doci, widget, page);
-    fz_matrix draw_page_ctm =
-        fz_concat(scale_ctm, fz_translate(stopped.x, stopped.y));
-    // highlight text selection
-    if ((c->doci.selection.is_active || c->doci.selection.is_in_progress) &&
-        locationcmp(loc, c->doci.selection.loc_end) <= 0) {
-      ensure_selection_cache_is_updated(ctx, &c->doci, loc);
-      highlight_quads(&page->cache.selection.quads, cr, draw_page_ctm);
-    }
-    // highlight search results
-    if (c->doci.search[0]) {
-      ensure_search_cache_is_updated(ctx, &c->doci, page, c->doci.search);
-      highlight_quads(&page->cache.search.quads, cr, draw_page_ctm);
-    }
-    // highlight selected link
-    if (page->cache.highlighted_link) {
-      double light_gray = 0.92;
-      cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1 - light_gray);
-      fz_rect box =
-          fz_transform_rect(page->cache.highlighted_link->rect, draw_page_ctm);
-      cairo_rectangle(cr, box.x0, box.y0, box.x1 - box.x0, box.y1 - box.y0);
-      cairo_fill(cr);
-    }
+// wraps args to search a page for passing into g_thread_pool_push
+struct SearchArgs {
+  BackgroundJob job;
+  struct SearchRun *run;
+  int n;
+  fz_location loc;
+  Quads hits;
+};
 
-    stopped.y += fz_transform_rect(page->page_bounds, scale_ctm).y1;
-    stopped.y += PAGE_SEPARATOR_HEIGHT;
-    fz_location next = fz_next_page(ctx, c->doci.doc, loc);
-    if (next.chapter == loc.chapter && next.page == loc.page) {
-      // end of document
-      break;
-    }
-    loc = next;
-    page = get_page(&c->doci, loc);
+// Set HITS to the matches of NEEDLE on the page at LOC of DOC, loaded anew.
+static void search_page_from(DocInfo *doci, fz_context *ctx,
+                             fz_document *doc, fz_location loc,
+                             SearchNeedle *needle, Quads *hits) {
+  fz_stext_page *page = load_page_text(doci, ctx, doc, loc);
+  SearchText *text =
+      page ? search_text_new(page, search_text_flags(needle)) : NULL;
+  fz_drop_stext_page(ctx, page);
+  hits->count = text ? search_text_find(text, needle, &hits->quads) : 0;
+  search_text_free(text);
+  // kept for the whole search, so don't hold on to the spare room
+  if (hits->count == 0) {
+    free(hits->quads);
+    hits->quads = NULL;
+  } else {
+    hits->quads = realloc(hits->quads, hits->count * sizeof(fz_quad));
   }
-  return FALSE;
 }
 
-static gboolean button_press_event(GtkWidget *widget, GdkEventButton *event) {
+// Emit counted-matches, at most every SEARCH_REPORT_INTERVAL_US until the
+// last page is searched.
+static void report_search_progress(GtkWidget *widget) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  struct Selection *selection = &c->doci.selection;
-  switch (event->button) {
-  case GDK_BUTTON_PRIMARY:
-    selection->is_in_progress = TRUE;
-    fz_point orig_point;
-    trace_point_to_page(widget, &c->doci, fz_make_point(event->x, event->y),
-                        &orig_point, &selection->loc_start);
-    selection->loc_end = selection->loc_start;
-    selection->start = orig_point;
-    selection->end = orig_point;
-    if (event->type == GDK_BUTTON_PRESS) {
-      selection->mode = FZ_SELECT_CHARS;
-    } else if (event->type == GDK_2BUTTON_PRESS ||
-               event->type == GDK_3BUTTON_PRESS) {
-      switch (event->type) {
-      case GDK_2BUTTON_PRESS:
-        selection->mode = FZ_SELECT_WORDS;
-        break;
-      case GDK_3BUTTON_PRESS:
-        selection->mode = FZ_SELECT_LINES;
-        break;
-      default:
-        fprintf(stderr, "Unhandled button press type\n");
-      }
-      fz_snap_selection(c->doci.ctx,
-                        get_page(&c->doci, selection->loc_start)->page_text,
-                        &selection->start, &selection->end, selection->mode);
-      selection->id++;
-      gtk_widget_queue_draw(widget);
-    }
-    break;
-  case GDK_BUTTON_MIDDLE:;
-    int width = gtk_widget_get_allocated_width(widget);
-    center_page(width, &c->doci);
+  DocInfo *doci = &c->doci;
+  struct DocSearch *ds = &doci->doc_search;
+  gint64 now = g_get_monotonic_time();
+  if (ds->pages_done > 0 && ds->pages_done < doci->layout.page_count &&
+      now - ds->reported < SEARCH_REPORT_INTERVAL_US)
+    return;
+  ds->reported = now;
+  g_signal_emit(widget, signals[SIGNAL_COUNTED_MATCHES], 0, ds->match_count,
+                ds->pages_done, doci->layout.page_count);
+}
+
+static void add_page_hits(GtkWidget *widget, int n, Quads hits) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  store_page_hits(&c->doci, n, hits);
+  if (hits.count > 0)
     gtk_widget_queue_draw(widget);
-    // TODO smooth scrolling like evince has
-    break;
-  }
-  return FALSE;
+  report_search_progress(widget);
 }
 
-// TODO actually run this on realize
-static gboolean configure_event(GtkWidget *widget, GdkEventConfigure *event) {
+static void free_search_run(struct SearchRun *run) {
+  search_needle_unref(run->needle);
+  free(run);
+}
+
+// runs on the GTK thread; keeps the matches if the search is still current
+static gboolean search_page_done(void *data) {
+  struct SearchArgs *sa = data;
+  GtkWidget *widget = sa->job.widget;
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  GdkDisplay *display = gtk_widget_get_display(widget);
-  c->default_cursor = gdk_cursor_new_from_name(display, "default");
-  c->click_cursor = gdk_cursor_new_from_name(display, "pointer");
+  struct DocSearch *ds = &c->doci.doc_search;
+  struct SearchRun *run = sa->run;
+  // unless the page was drawn, and searched, in the meantime
+  if (run == ds->run && ds->hits[sa->n].count < 0)
+    add_page_hits(widget, sa->n, sa->hits);
+  else
+    free(sa->hits.quads);
+  if (--run->pending == 0 && run != ds->run)
+    free_search_run(run);
+  free(sa);
   return FALSE;
 }
 
-/*
- * Update cache.highlighted_link on the page below mouse_point.
- * Return TRUE if the link was updated.
- * Also set the gdk mouse cursor in the correct shape.
- */
-static gboolean update_highlighted_link(GtkWidget *widget,
-                                        fz_point mouse_point) {
+void thread_search_page(gpointer data, gpointer user_data) {
+  DocInfo *doci = user_data;
+  struct SearchArgs *sa = data;
+  if (!g_atomic_int_get(&sa->run->is_cancelled) &&
+      !g_atomic_int_get(&doci->is_closing)) {
+    DocInstance *inst = g_async_queue_pop(doci->instances.idle);
+    search_page_from(doci, inst->ctx, inst->doc, sa->loc, sa->run->needle,
+                     &sa->hits);
+    g_async_queue_push(doci->instances.idle, inst);
+  }
+}
+
+// searches the next page on the GTK thread, for documents without instances
+static gboolean search_next_page(void *data) {
+  GtkWidget *widget = data;
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  GdkCursor *cursor = c->default_cursor;
-  fz_point mouse_page_point;
-  fz_location mouse_page_loc;
-  trace_point_to_page(widget, &c->doci, mouse_point, &mouse_page_point,
-                      &mouse_page_loc);
-  Page *page = get_page(&c->doci, mouse_page_loc);
-  fz_matrix ctm = get_scale_ctm(&c->doci, page);
-  // skip altogether if point stayed in the same link area as before
-  if (page->cache.highlighted_link &&
-      fz_is_point_inside_rect(
-          mouse_page_point,
-          fz_transform_rect(page->cache.highlighted_link->rect, ctm)))
+  DocInfo *doci = &c->doci;
+  struct DocSearch *ds = &doci->doc_search;
+  if (ds->pages_done == doci->layout.page_count) {
+    // the last ones were searched when they were drawn
+    ds->idle_id = 0;
     return FALSE;
-  fz_link *found = NULL;
-  for (fz_link *link = page->links; link != NULL; link = link->next) {
-    if (fz_is_point_inside_rect(mouse_page_point,
-                                fz_transform_rect(link->rect, ctm))) {
-      found = link;
-      cursor = c->click_cursor;
-      break;
-    }
   }
-  if (found != page->cache.highlighted_link) {
-    page->cache.highlighted_link = found;
-    gdk_window_set_cursor(gtk_widget_get_window(widget), cursor);
+  int n;
+  do // skip the pages that were ruled out or drawn
+    n = (ds->first + ds->next++) % doci->layout.page_count;
+  while (ds->hits[n].count >= 0);
+  Quads hits = {NULL, 0};
+  search_page_from(doci, doci->ctx, doci->doc,
+                   location_from_page_number(doci, n), ds->run->needle, &hits);
+  add_page_hits(widget, n, hits);
+  if (ds->pages_done < doci->layout.page_count)
     return TRUE;
-  }
+  ds->idle_id = 0;
   return FALSE;
 }
 
-static gboolean query_tooltip(GtkWidget *widget, int x, int y,
-                              gboolean keyboard_mode, GtkTooltip *tooltip) {
-  if (keyboard_mode)
-    return FALSE;
-  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  fz_context *ctx = c->doci.ctx;
-  fz_point mouse_point = {x, y};
-  fz_point mouse_page_point;
-  fz_location mouse_page_loc;
-  trace_point_to_page(widget, &c->doci, mouse_point, &mouse_page_point,
-                      &mouse_page_loc);
-  fz_link *link = get_page(&c->doci, mouse_page_loc)->cache.highlighted_link;
-  if (!link)
-    return FALSE;
+static void free_hits(Quads *hits, int count) {
+  if (!hits)
+    return;
+  for (int i = 0; i < count; i++)
+    free(hits[i].quads);
+  free(hits);
+}
 
-  gchar text[PATH_MAX + 4]; // 4 for unicode link symbol
-  /* fprintf(stderr, "%s\n", link->uri); */
-  if (fz_is_external_link(ctx, link->uri)) {
-    snprintf(text, sizeof(text), "↪%s", link->uri);
-  } else {
-    float _x, _y;
-    fz_location loc = fz_resolve_link(ctx, c->doci.doc, link->uri, &_x, &_y);
-    // start pages and chapters from 1
-    loc.chapter += 1;
-    loc.page += 1;
-    // TODO display the label of the page instead the absolute number. I'm not
-    // sure its possible in mupdf though.
-    if (c->doci.chapter_count > 1)
-      if (c->doci.location.chapter == loc.chapter)
-        snprintf(text, sizeof(text), "↪Page %d in current chapter", loc.page);
-      else
-        snprintf(text, sizeof(text), "↪Chapter %d, page %d", loc.chapter,
-                 loc.page);
-    else
-      snprintf(text, sizeof(text), "↪Page %d", loc.page);
+// Stop searching the document and forget the matches found.
+static void cancel_doc_search(DocInfo *doci) {
+  struct DocSearch *ds = &doci->doc_search;
+  if (ds->idle_id) {
+    g_source_remove(ds->idle_id);
+    ds->idle_id = 0;
   }
-  gtk_tooltip_set_text(tooltip, text);
-  return TRUE;
+  if (ds->run) {
+    g_atomic_int_set(&ds->run->is_cancelled, 1);
+    if (ds->run->pending == 0)
+      free_search_run(ds->run);
+    ds->run = NULL;
+  }
+  free_hits(ds->hits, doci->layout.page_count);
+  ds->hits = NULL;
+  ds->pages_done = 0;
+  ds->match_count = 0;
+  ds->cur_page = -1;
 }
 
-static void follow_link(GtkWidget *widget, fz_link *link) {
-  // TODO follow non-internal links
+/*
+ * Start searching every page for DOCI->search, from the current one on. When
+ * the needle extends the one searched for last, as it does while it's typed,
+ * the pages the last one had no matches on are skipped.
+ */
+static void start_doc_search(GtkWidget *widget) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
   DocInfo *doci = &c->doci;
-  fz_context *ctx = doci->ctx;
-  fz_point dst_scroll;
-  fz_location dst =
-      fz_resolve_link(ctx, doci->doc, link->uri, &dst_scroll.x, &dst_scroll.y);
-  if (dst.chapter == -1 || dst.page == -1) // invalid link
-    // TODO emit some signal
+  struct DocSearch *ds = &doci->doc_search;
+  Quads *last = NULL;
+  if (ds->run && search_needle_extends(doci->search, ds->run->needle)) {
+    last = ds->hits;
+    ds->hits = NULL;
+  }
+  cancel_doc_search(doci);
+  int count = doci->layout.page_count;
+  struct SearchRun *run = malloc(sizeof(*run));
+  run->needle = search_needle_ref(doci->search);
+  run->is_cancelled = 0;
+  run->pending = 0;
+  ds->run = run;
+  ds->hits = malloc(count * sizeof(*ds->hits));
+  for (int i = 0; i < count; i++)
+    ds->hits[i] = (Quads){NULL, -1};
+  ds->first = page_number(doci, doci->location);
+  ds->next = 0;
+  ds->reported = 0;
+  // nor do the pages without the words of the needle, unless it's a regex
+  gboolean *candidates = malloc(count * sizeof(*candidates));
+  if (!doci->word_index.index || (run->needle->flags & SEARCH_REGEX) ||
+      !word_index_candidates(doci->word_index.index, run->needle->source,
+                             candidates))
+    for (int i = 0; i < count; i++)
+      candidates[i] = TRUE;
+  for (int i = 0; i < count; i++) {
+    if (!candidates[i] || (last && last[i].count == 0)) {
+      candidates[i] = FALSE;
+      ds->hits[i].count = 0;
+      ds->pages_done++;
+    }
+  }
+  free_hits(last, count);
+  report_search_progress(widget);
+  if (ds->pages_done == count) {
+    free(candidates);
     return;
-  doci->location = dst;
-  doci->scroll = dst_scroll;
-  int width = gtk_widget_get_allocated_width(widget);
-  Page *page = get_cur_page(doci);
-  fz_matrix scale_ctm = get_scale_ctm(doci, page);
-  if (width > fz_transform_rect(page->page_bounds, scale_ctm).x1)
-    center_page(width, &c->doci);
-  // set back cursor. update_highlighted_link won't reset it since from
-  // its perspective the selected link did not change on the
-  // newly-followed page
-  gdk_window_set_cursor(gtk_widget_get_window(widget), c->default_cursor);
+  }
+  if (doci->instances.count == 0) {
+    ds->idle_id =
+        g_idle_add_full(G_PRIORITY_LOW, search_next_page, widget, NULL);
+    free(candidates);
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    if (!candidates[(ds->first + i) % count])
+      continue;
+    struct SearchArgs *sa = malloc(sizeof(*sa));
+    sa->run = run;
+    sa->n = (ds->first + i) % count;
+    sa->loc = location_from_page_number(doci, sa->n);
+    sa->hits = (Quads){NULL, 0};
+    run->pending++;
+    submit_background_instance_job(&sa->job, widget, TIER_SEARCH,
+                                   thread_search_page, search_page_done);
+  }
+  free(candidates);
 }
 
-static gboolean button_release_event(GtkWidget *widget, GdkEventButton *event) {
-  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  DocInfo *doci = &c->doci;
-  switch (event->button) {
-  case GDK_BUTTON_PRIMARY:
-    if (doci->selection.is_in_progress) {
-      doci->selection.is_in_progress = FALSE;
-    }
-    if (memcmp(&doci->selection.start, &doci->selection.end,
-               sizeof(fz_point)) != 0) {
-      doci->selection.is_active = TRUE;
-    } else {
-      if (doci->selection.is_active) {
-        doci->selection.is_active = FALSE;
-        gtk_widget_queue_draw(widget);
-      }
+// wraps args to build the word index for passing into submit_background_job
+struct WordIndexArgs {
+  BackgroundJob job;
+  char *path;
+  // a handle of our own, so that page loads and searches aren't held up;
+  // NULL before the first job
+  fz_context *ctx;
+  fz_document *doc;
+  WordIndexBuilder *builder; // NULL once the last job is done
+  int next; // the next page to add
+  WordIndex *index; // the result, NULL on failure
+};
 
-      fz_point mouse_point = {event->x, event->y};
-      fz_point mouse_page_point;
-      fz_location mouse_page_loc;
-      trace_point_to_page(widget, &c->doci, mouse_point, &mouse_page_point,
-                          &mouse_page_loc);
-      Page *page = get_page(&c->doci, mouse_page_loc);
-      fz_link *link = page->cache.highlighted_link;
-      if (link != NULL) {
-        // clicked link
-        follow_link(widget, link);
-        gtk_widget_queue_draw(widget);
-      }
-    }
-    break;
+/*
+ * Runs on the GTK thread; queues the next pages of the word index, or hands
+ * the index over to the next searches once it's done.
+ */
+static gboolean word_index_built(void *data) {
+  struct WordIndexArgs *wa = data;
+  if (wa->builder) {
+    queue_background_job(&wa->job);
+    return TRUE;
   }
+  PaperViewPrivate *c =
+      paper_view_get_instance_private(PAPER_VIEW(wa->job.widget));
+  struct WordIndexState *ws = &c->doci.word_index;
+  ws->index = wa->index;
+  ws->is_building = FALSE;
+  g_free(wa->path);
+  free(wa);
   return FALSE;
 }
 
-static gboolean motion_notify_event(GtkWidget *widget, GdkEventMotion *event) {
-  if (event->state & GDK_BUTTON1_MASK) { // user is selecting
-    PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-    fz_point point = {event->x, event->y};
-    fz_point end_point;
-    trace_point_to_page(widget, &c->doci, point, &end_point,
-                        &c->doci.selection.loc_end);
-    c->doci.selection.end = end_point;
-    c->doci.selection.id++;
-    gtk_widget_queue_draw(widget);
-  } else if (update_highlighted_link(widget,
-                                     fz_make_point(event->x, event->y))) {
-    // hovering over link
-    gtk_widget_queue_draw(widget);
+/*
+ * Add the next WORD_INDEX_PAGES_PER_JOB pages to the word index, and queue
+ * the job again for the rest, so that the shared threads go back to the
+ * visible pages in between. The index is written after the last page.
+ */
+void thread_build_word_index(gpointer data, gpointer user_data) {
+  struct WordIndexArgs *wa = data;
+  DocInfo *doci = user_data;
+  int count = doci->layout.page_count;
+  if (!wa->ctx) {
+    wa->ctx = fz_clone_context(doci->ctx);
+    fz_try(wa->ctx) { wa->doc = fz_open_document(wa->ctx, doci->filename); }
+    fz_catch(wa->ctx) {
+      fprintf(stderr, "cannot open document for indexing: %s\n",
+              fz_caught_message(wa->ctx));
+    }
+    wa->builder = word_index_builder_new(count);
+  }
+  fz_context *ctx = wa->ctx;
+  int end = MIN(count, wa->next + WORD_INDEX_PAGES_PER_JOB);
+  gboolean is_closing = g_atomic_int_get(&doci->is_closing);
+  for (; wa->doc && wa->next < end && !is_closing; wa->next++) {
+    int n = wa->next;
+    fz_stext_page *page = load_page_text(doci, ctx, wa->doc,
+                                         location_from_page_number(doci, n));
+    SearchText *text = page ? search_text_new(page, 0) : NULL;
+    fz_drop_stext_page(ctx, page);
+    word_index_add_page(wa->builder, n, text);
+    search_text_free(text);
+    g_atomic_int_set(&doci->word_index.pages_done, n + 1);
+  }
+  if (wa->doc && wa->next < count && !is_closing)
+    return;
+  wa->index = NULL;
+  if (wa->next == count && word_index_write(wa->builder, wa->path))
+    wa->index = word_index_open(wa->path, count);
+  word_index_builder_free(wa->builder);
+  wa->builder = NULL;
+  fz_drop_document(ctx, wa->doc);
+  fz_drop_context(ctx);
+}
+
+/*
+ * Map the word index of the document from its cache directory, or build it
+ * from the text of every page in the background if there's none yet.
+ * Searches started once it's ready only look at the pages it points to.
+ */
+void build_word_index(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct WordIndexState *ws = &doci->word_index;
+  if (ws->index || ws->is_building)
+    return;
+  char *path = doc_cache_path(doci, "words.idx");
+  ws->index = word_index_open(path, doci->layout.page_count);
+  if (ws->index) {
+    text_cache_touch(path);
+    g_free(path);
+    return;
+  }
+  struct WordIndexArgs *wa = calloc(1, sizeof(*wa));
+  wa->path = path;
+  ws->is_building = TRUE;
+  g_atomic_int_set(&ws->pages_done, 0);
+  submit_background_job(&wa->job, widget, TIER_INDEX, thread_build_word_index,
+                        word_index_built);
+}
+
+/*
+ * Set *PAGES_DONE to the number of pages the word index covers so far, and
+ * *SIZE to the size of its file once it's ready, 0 before. Return FALSE if
+ * there's no index and none is being built.
+ */
+gboolean get_word_index_status(GtkWidget *widget, int *pages_done,
+                               size_t *size) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  struct WordIndexState *ws = &c->doci.word_index;
+  *pages_done = ws->index ? c->doci.layout.page_count
+                          : g_atomic_int_get(&ws->pages_done);
+  *size = ws->index ? ws->index->size : 0;
+  return ws->index || ws->is_building;
+}
+
+void unset_search(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  if (!c->doci.search)
+    return;
+  search_needle_unref(c->doci.search);
+  c->doci.search = NULL;
+  c->doci.search_id++;
+  cancel_doc_search(&c->doci);
+  gtk_widget_queue_draw(widget);
+}
+
+/*
+ * Search for NEEDLE, compared to the text as the SearchFlags FLAGS say.
+ * Return FALSE with ERROR set, leaving the search as it was, if NEEDLE isn't
+ * a valid regex.
+ */
+gboolean set_search(GtkWidget *widget, const char *needle, int flags,
+                    GError **error) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  SearchNeedle *search = c->doci.search;
+  if (search && search->flags == flags && strcmp(needle, search->source) == 0)
+    return TRUE;
+  if (needle[0] == '\0') {
+    unset_search(widget);
+    return TRUE;
   }
-  return FALSE;
+  search = search_needle_new(needle, flags, error);
+  if (!search)
+    return FALSE;
+  search_needle_unref(c->doci.search);
+  c->doci.search = search;
+  c->doci.search_id++;
+  start_doc_search(widget);
+  gtk_widget_queue_draw(widget);
+  return TRUE;
 }
 
 /*
- * Move to next/previous pages if scroll.y is past the page bound
+ * Go to the DELTA'th next match of the search, or the previous ones for a
+ * negative DELTA, wrapping around the document. The first call counts from
+ * the top of the view. Return the number of the match among those found so
+ * far, counting from 1 in document order, or 0 if none were found yet.
  */
-static void scroll_pages(DocInfo *doci) {
-  // move to next pages if scroll.y is past page border
-  fz_context *ctx = doci->ctx;
-  while (doci->scroll.y >=
-         get_cur_page(doci)->page_bounds.y1 + PAGE_SEPARATOR_HEIGHT) {
-    fz_location next = fz_next_page(ctx, doci->doc, doci->location);
-    Page *page = get_cur_page(doci);
-    if (locationcmp(next, doci->location) == 0) {
-      // end of document
-      doci->scroll.y = page->page_bounds.y1;
-      break;
-    }
-    doci->scroll.y -= page->page_bounds.y1 + PAGE_SEPARATOR_HEIGHT;
-    doci->location = next;
-  }
-  // move to previous pages if scroll.y is negative
-  while (doci->scroll.y < 0) {
-    fz_location next = fz_previous_page(ctx, doci->doc, doci->location);
-    if (locationcmp(next, doci->location) == 0) {
-      // Beginning of document
-      doci->scroll.y = 0;
-      break;
+int goto_match(GtkWidget *widget, int delta) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  DocInfo *doci = &c->doci;
+  struct DocSearch *ds = &doci->doc_search;
+  if (!ds->hits || ds->match_count == 0 || delta == 0)
+    return 0;
+  int count = doci->layout.page_count;
+  int n = ds->cur_page;
+  int m = ds->cur_match;
+  int step = delta > 0 ? 1 : -1;
+  if (n < 0) {
+    // right before the first match of the top page, or after the last
+    n = page_number(doci, doci->location);
+    m = step > 0 ? -1 : MAX(ds->hits[n].count, 0);
+  }
+  for (int left = abs(delta); left > 0; left--) {
+    // pages not searched yet count as empty
+    for (m += step; m < 0 || m >= MAX(ds->hits[n].count, 0);) {
+      n = (n + step + count) % count;
+      m = step > 0 ? 0 : ds->hits[n].count - 1;
     }
-    doci->location = next;
-    doci->scroll.y +=
-        get_cur_page(doci)->page_bounds.y1 + PAGE_SEPARATOR_HEIGHT;
   }
+  ds->cur_page = n;
+  ds->cur_match = m;
+  fz_quad quad = ds->hits[n].quads[m];
+  reveal_point(widget, location_from_page_number(doci, n), quad.ul);
+  gtk_widget_queue_draw(widget);
+  int number = m + 1;
+  for (int i = 0; i < n; i++)
+    number += MAX(ds->hits[i].count, 0);
+  return number;
 }
 
-static void scroll(DocInfo *doci, fz_point delta) {
-  doci->scroll.x += delta.x;
-  doci->scroll.y += delta.y;
-  scroll_pages(doci);
+/*
+ * The text of the document is handed out page by page, in order, to whoever
+ * listens to text-exported. Pages are extracted on the document instances,
+ * only a few ahead of the first page not collected yet, so that few texts
+ * wait for the pages before them, and collected as soon as every page before
+ * them is. text-exported only says that there's text to take; the listener
+ * pulls it with take_exported_text, and isn't told again until it has, so
+ * that it's never sent more than it reads. Each page ends with a form feed,
+ * like pdftotext's.
+ */
+struct ExportRun {
+  int is_cancelled; // atomic
+  int pending;      // jobs not done yet; only touched on the GTK thread
+};
+
+// wraps args to extract the text of a page for passing into g_thread_pool_push
+struct ExportArgs {
+  BackgroundJob job;
+  struct ExportRun *run;
+  int n;
+  fz_location loc;
+  char *text;
+};
+
+// Return the text of the page at LOC of DOC, loaded anew.
+static char *extract_page_text(DocInfo *doci, fz_context *ctx,
+                               fz_document *doc, fz_location loc) {
+  fz_stext_page *page = load_page_text(doci, ctx, doc, loc);
+  fz_buffer *buf = NULL;
+  char *text = NULL;
+  fz_var(buf);
+  fz_try(ctx) {
+    if (page) {
+      buf = fz_new_buffer_from_stext_page(ctx, page);
+      text = g_strconcat(fz_string_from_buffer(ctx, buf), "\f", NULL);
+    }
+  }
+  fz_always(ctx) {
+    fz_drop_buffer(ctx, buf);
+    fz_drop_stext_page(ctx, page);
+  }
+  fz_catch(ctx) {
+    fprintf(stderr, "error exporting text of page %d,%d: %s\n", loc.chapter,
+            loc.page, fz_caught_message(ctx));
+  }
+  return text ? text : g_strdup("\f");
 }
 
-static void change_zoom(DocInfo *doci, float new_zoom) {
-  if (new_zoom > MAX_ZOOM) {
-    new_zoom = MAX_ZOOM;
+// Stop exporting the text and drop the pages not collected yet.
+static void cancel_text_export(DocInfo *doci) {
+  struct TextExport *te = &doci->text_export;
+  if (te->idle_id) {
+    g_source_remove(te->idle_id);
+    te->idle_id = 0;
   }
-  if (doci->zoom == new_zoom)
-    return;
-  doci->zoom = new_zoom;
-  doci->rendered_id++;
+  if (te->run) {
+    g_atomic_int_set(&te->run->is_cancelled, 1);
+    if (te->run->pending == 0)
+      free(te->run);
+    te->run = NULL;
+  }
+  for (int i = te->collected; te->texts && i < te->queued; i++)
+    g_free(te->texts[i]);
+  free(te->texts);
+  te->texts = NULL;
 }
-/*
- * Change zoom to NEW_ZOOM and set scroll.x, scroll.y so that POINT (a
- * point in the bounds of WIDGET) stays on the same pixel as it did before
- * adjusting the zoom.
- */
-static void zoom_around_point(GtkWidget *widget, DocInfo *doci, float new_zoom,
-                              fz_point point) {
-  fz_context *ctx = doci->ctx;
-  fz_point original_point_in_page;
-  fz_location original_loc;
-  trace_point_to_page(widget, doci, point, &original_point_in_page,
-                      &original_loc);
-  for (fz_location loc = original_loc; locationcmp(loc, doci->location) > 0;
-       loc = fz_previous_page(ctx, doci->doc, loc)) {
-    original_point_in_page.y +=
-        get_page(doci, loc)->page_bounds.y1 + PAGE_SEPARATOR_HEIGHT;
+
+// Drop the text collected but not taken yet.
+static void drop_exported_text(DocInfo *doci) {
+  struct TextExport *te = &doci->text_export;
+  if (te->ready) {
+    g_string_free(te->ready, TRUE);
+    te->ready = NULL;
   }
-  change_zoom(doci, new_zoom);
-  fz_matrix new_scale_ctm = get_scale_ctm(doci, get_page(doci, original_loc));
-  fz_matrix new_scale_ctm_inv = fz_invert_matrix(new_scale_ctm);
-  fz_point new_point =
-      fz_transform_point(original_point_in_page, new_scale_ctm);
-  fz_point scaled_diff =
-      fz_make_point(new_point.x - point.x, new_point.y - point.y);
-  fz_point unscaled_diff = fz_transform_point(scaled_diff, new_scale_ctm_inv);
-  doci->scroll = unscaled_diff;
-  scroll_pages(doci);
 }
 
-void zoom_relatively_around_point(GtkWidget *widget, float mult,
-                                  fz_point point) {
+void stop_text_export(GtkWidget *widget) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  zoom_around_point(widget, &c->doci, c->doci.zoom * mult, point);
+  cancel_text_export(&c->doci);
+  drop_exported_text(&c->doci);
 }
 
 /*
- * Scroll relative to widget width/height.
- * Having mult.y = 0.1 means scroll down 10% of the widget height.
+ * Return the text collected since the last call, and set PAGES_DONE and
+ * PAGES to how far the export is, or return NULL if there's none. The text,
+ * LEN bytes long, is freed with g_free.
  */
-void scroll_relatively(GtkWidget *widget, fz_point mult) {
+char *take_exported_text(GtkWidget *widget, size_t *len, int *pages_done,
+                         int *pages) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  int w = gtk_widget_get_allocated_width(widget);
-  int h = gtk_widget_get_allocated_height(widget);
-  Page *page = get_cur_page(&c->doci);
-  // don't include rotation
-  float rotate = c->doci.rotate;
-  c->doci.rotate = 0;
-  fz_matrix scale_ctm = get_scale_ctm(&c->doci, page);
-  c->doci.rotate = rotate;
-  fz_matrix scale_ctm_inv = fz_invert_matrix(scale_ctm);
-  fz_point scrolled =
-      fz_transform_point(fz_make_point(mult.x * w, mult.y * h), scale_ctm_inv);
-  scroll(&c->doci, scrolled);
-  // we could call update_highlighted_link here, but I actually like it when
-  // sole scrolling doesn't highlight things or creates tooltips
+  DocInfo *doci = &c->doci;
+  struct TextExport *te = &doci->text_export;
+  if (!te->ready)
+    return NULL;
+  *len = te->ready->len;
+  *pages_done = te->collected;
+  *pages = doci->layout.page_count;
+  char *text = g_string_free(te->ready, FALSE);
+  te->ready = NULL;
+  return text;
 }
 
-void scroll_to_page_start(GtkWidget *widget) {
+// Add TEXT to the text to take, telling text-exported if there was none.
+static void add_exported_text(GtkWidget *widget, const char *text) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  c->doci.scroll.y = 0;
+  DocInfo *doci = &c->doci;
+  struct TextExport *te = &doci->text_export;
+  if (te->ready) {
+    g_string_append(te->ready, text);
+    return;
+  }
+  te->ready = g_string_new(text);
+  g_signal_emit(widget, signals[SIGNAL_TEXT_EXPORTED], 0, te->collected,
+                doci->layout.page_count);
 }
 
-void scroll_to_page_end(GtkWidget *widget) {
+/*
+ * Collect the pages extracted from the first one not collected yet on, and
+ * end the export after the last page.
+ */
+static void collect_exported_text(GtkWidget *widget) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  int h = gtk_widget_get_allocated_height(widget);
-  Page *page = get_cur_page(&c->doci);
-  fz_matrix scale_ctm = get_scale_ctm(&c->doci, page);
-  fz_rect scaled_bounds = fz_transform_rect(page->page_bounds, scale_ctm);
-  float scroll_scaled = scaled_bounds.y1 - h;
-  c->doci.scroll.y = fz_transform_point(fz_make_point(0, scroll_scaled),
-                                        fz_invert_matrix(scale_ctm))
-                         .y;
-  scroll_pages(&c->doci);
+  DocInfo *doci = &c->doci;
+  struct TextExport *te = &doci->text_export;
+  int count = doci->layout.page_count;
+  while (te->collected < count && te->texts[te->collected]) {
+    char *text = te->texts[te->collected];
+    te->texts[te->collected++] = NULL;
+    add_exported_text(widget, text);
+    g_free(text);
+  }
+  if (te->collected == count)
+    cancel_text_export(doci);
 }
 
-void scroll_whole_pages(GtkWidget *widget, int i) {
+static void thread_export_page(gpointer data, gpointer user_data);
+static gboolean export_page_done(void *data);
+
+// Queue the pages up to EXPORT_PAGES_PER_INSTANCE per instance ahead.
+static void queue_export_pages(GtkWidget *widget) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  fz_location future;
-  if (i > 0) {
-    for (; i > 0; i--) {
-      future = fz_next_page(c->doci.ctx, c->doci.doc, c->doci.location);
-      if (locationcmp(future, c->doci.location) == 0) {
-        scroll_to_page_end(widget);
-        return;
-      }
-      c->doci.location = future;
-    }
-  } else {
-    for (; i < 0; i++) {
-      future = fz_previous_page(c->doci.ctx, c->doci.doc, c->doci.location);
-      if (locationcmp(future, c->doci.location) == 0) {
-        // beginning of document, scroll to page start
-        c->doci.scroll.y = 0;
-        return;
-      }
-      c->doci.location = future;
-    }
+  DocInfo *doci = &c->doci;
+  struct TextExport *te = &doci->text_export;
+  int end = MIN(doci->layout.page_count,
+                te->collected +
+                    EXPORT_PAGES_PER_INSTANCE * doci->instances.count);
+  for (; te->queued < end; te->queued++) {
+    struct ExportArgs *ea = malloc(sizeof(*ea));
+    ea->run = te->run;
+    ea->n = te->queued;
+    ea->loc = location_from_page_number(doci, ea->n);
+    ea->text = NULL;
+    te->run->pending++;
+    submit_background_instance_job(&ea->job, widget, TIER_EXPORT,
+                                   thread_export_page, export_page_done);
   }
 }
 
-void goto_first_page(GtkWidget *widget) {
+// runs on the GTK thread; emits what it can and queues the next pages
+static gboolean export_page_done(void *data) {
+  struct ExportArgs *ea = data;
+  GtkWidget *widget = ea->job.widget;
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  c->doci.location = fz_make_location(0, 0);
-  c->doci.scroll.y = 0;
+  struct TextExport *te = &c->doci.text_export;
+  struct ExportRun *run = ea->run;
+  if (run == te->run && ea->text) {
+    te->texts[ea->n] = ea->text;
+    collect_exported_text(widget);
+    if (te->run)
+      queue_export_pages(widget);
+  } else {
+    g_free(ea->text);
+  }
+  if (--run->pending == 0 && run != te->run)
+    free(run);
+  free(ea);
+  return FALSE;
 }
 
-void goto_last_page(GtkWidget *widget) {
-  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  c->doci.location = fz_last_page(c->doci.ctx, c->doci.doc);
-  scroll_to_page_end(widget);
+static void thread_export_page(gpointer data, gpointer user_data) {
+  DocInfo *doci = user_data;
+  struct ExportArgs *ea = data;
+  if (!g_atomic_int_get(&ea->run->is_cancelled) &&
+      !g_atomic_int_get(&doci->is_closing)) {
+    DocInstance *inst = g_async_queue_pop(doci->instances.idle);
+    ea->text = extract_page_text(doci, inst->ctx, inst->doc, ea->loc);
+    g_async_queue_push(doci->instances.idle, inst);
+  }
 }
 
-void zoom_to_window_center(GtkWidget *widget, float multiplier) {
+// extracts the next page on the GTK thread, for documents without instances
+static gboolean export_next_page(void *data) {
+  GtkWidget *widget = data;
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  int w = gtk_widget_get_allocated_width(widget);
-  int h = gtk_widget_get_allocated_height(widget);
-  float old = c->doci.zoom;
-  /* zoom_around_point(widget, &c->doci, old * multiplier, fz_make_point(20,
-   * 20)); */
-  zoom_around_point(widget, &c->doci, old * multiplier,
-                    fz_make_point(w / 2.0f, h / 2.0f));
+  DocInfo *doci = &c->doci;
+  struct TextExport *te = &doci->text_export;
+  int n = te->queued++;
+  te->texts[n] = extract_page_text(doci, doci->ctx, doci->doc,
+                                   location_from_page_number(doci, n));
+  gboolean is_last = te->queued == doci->layout.page_count;
+  if (is_last)
+    te->idle_id = 0;
+  collect_exported_text(widget);
+  return !is_last;
 }
 
-void center(GtkWidget *widget) {
+// Go on extracting pages, on the instances if there are any.
+static void resume_text_export(GtkWidget *widget) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  int w = gtk_widget_get_allocated_width(widget);
-  center_page(w, &c->doci);
+  DocInfo *doci = &c->doci;
+  struct TextExport *te = &doci->text_export;
+  if (!te->run)
+    return;
+  if (doci->instances.count > 0)
+    queue_export_pages(widget);
+  else if (!te->idle_id)
+    te->idle_id =
+        g_idle_add_full(G_PRIORITY_LOW, export_next_page, widget, NULL);
 }
 
-void fit_width(GtkWidget *widget) {
-  int w = gtk_widget_get_allocated_width(widget);
-  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  c->doci.scroll.x = 0;
-  change_zoom(&c->doci, (float)w / get_cur_page(&c->doci)->page_bounds.x1);
-  gtk_widget_queue_draw(widget);
+/*
+ * Forget the pages queued but not collected yet, so that resume_text_export
+ * queues them again, e.g. on other instances.
+ */
+static void requeue_text_export(DocInfo *doci) {
+  struct TextExport *te = &doci->text_export;
+  if (!te->run)
+    return;
+  if (te->idle_id) {
+    g_source_remove(te->idle_id);
+    te->idle_id = 0;
+  }
+  g_atomic_int_set(&te->run->is_cancelled, 1);
+  if (te->run->pending == 0)
+    free(te->run);
+  te->run = calloc(1, sizeof(*te->run));
+  for (int i = te->collected; i < te->queued; i++) {
+    g_free(te->texts[i]);
+    te->texts[i] = NULL;
+  }
+  te->queued = te->collected;
 }
 
-void fit_height(GtkWidget *widget) {
-  int h = gtk_widget_get_allocated_height(widget);
+/*
+ * Start handing out the text of every page, from the first on, through
+ * text-exported. An export that's already running starts over.
+ */
+void start_text_export(GtkWidget *widget) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  c->doci.scroll.y = 0;
-  change_zoom(&c->doci, (float)h / get_cur_page(&c->doci)->page_bounds.y1);
-  center(widget);
-  gtk_widget_queue_draw(widget);
+  DocInfo *doci = &c->doci;
+  struct TextExport *te = &doci->text_export;
+  cancel_text_export(doci);
+  drop_exported_text(doci);
+  te->collected = 0;
+  int count = doci->layout.page_count;
+  if (count == 0) {
+    add_exported_text(widget, "");
+    return;
+  }
+  te->run = calloc(1, sizeof(*te->run));
+  te->texts = calloc(count, sizeof(*te->texts));
+  te->queued = 0;
+  resume_text_export(widget);
 }
 
-void unset_selection(GtkWidget *widget) {
+void set_predecode_share(GtkWidget *widget, float share) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  struct Selection *selection = &c->doci.selection;
-  if (!selection->is_active && !selection->is_in_progress)
-    return;
-  selection->is_active = 0;
-  selection->is_in_progress = 0;
-  selection->id++;
-  gtk_widget_queue_draw(widget);
+  c->doci.predecode_share = fz_max(0, fz_min(share, 1));
 }
 
-void unset_search(GtkWidget *widget) {
-  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  if (c->doci.search[0] == '\0')
-    return;
-  c->doci.search[0] = '\0';
-  c->doci.search_id++;
-  gtk_widget_queue_draw(widget);
+static void close_doc_instances(DocInfo *doci) {
+  struct DocInstances *instances = &doci->instances;
+  // the jobs queued on the instances run first; searches and exports are
+  // cancelled beforehand, so that they return right away
+  g_mutex_lock(&instances->lock);
+  while (instances->jobs > 0)
+    g_cond_wait(&instances->cond, &instances->lock);
+  g_mutex_unlock(&instances->lock);
+  for (int i = 0; i < instances->count; i++) {
+    DocInstance *inst = &instances->instances[i];
+    fz_drop_document(inst->ctx, inst->doc);
+    fz_drop_context(inst->ctx);
+  }
+  if (instances->idle)
+    g_async_queue_unref(instances->idle);
+  free(instances->instances);
+  instances->instances = NULL;
+  instances->idle = NULL;
+  instances->count = 0;
+}
+
+/*
+ * Open N more handles of the document, each used by a single loading thread
+ * at a time, so that pages can be parsed in parallel. Return the number of
+ * handles actually opened.
+ */
+int open_doc_instances(DocInfo *doci, int n) {
+  close_doc_instances(doci);
+  struct DocInstances *instances = &doci->instances;
+  if (n <= 0)
+    return 0;
+  instances->instances = calloc(n, sizeof(*instances->instances));
+  instances->idle = g_async_queue_new();
+  for (int i = 0; i < n; i++) {
+    DocInstance *inst = &instances->instances[instances->count];
+    inst->ctx = fz_clone_context(doci->ctx);
+    fz_try(inst->ctx) {
+      inst->doc = fz_open_document(inst->ctx, doci->filename);
+    }
+    fz_catch(inst->ctx) {
+      fprintf(stderr, "cannot open document instance: %s\n",
+              fz_caught_message(inst->ctx));
+      fz_drop_context(inst->ctx);
+      break;
+    }
+    g_async_queue_push(instances->idle, inst);
+    instances->count++;
+  }
+  if (instances->count == 0) {
+    close_doc_instances(doci);
+    return 0;
+  }
+  return instances->count;
 }
 
-void set_search(GtkWidget *widget, char *needle) {
+void set_doc_instances(GtkWidget *widget, int n) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
-  if (strcmp(needle, c->doci.search) == 0)
+  if (n == c->doci.instances.count)
     return;
-  strcpy(c->doci.search, needle);
-  c->doci.search_id++;
-  gtk_widget_queue_draw(widget);
+  // the search runs on the instances; don't wait for it to finish on the old
+  // ones
+  gboolean is_searching = c->doci.doc_search.run != NULL;
+  cancel_doc_search(&c->doci);
+  // and so does the export, which goes on from the first page not collected
+  requeue_text_export(&c->doci);
+  open_doc_instances(&c->doci, n);
+  if (is_searching)
+    start_doc_search(widget);
+  resume_text_export(widget);
+}
+
+const char *const LOCK_NAMES[FZ_LOCK_MAX] = {
+    [FZ_LOCK_ALLOC] = "alloc",
+    [FZ_LOCK_FREETYPE] = "freetype",
+    [FZ_LOCK_GLYPHCACHE] = "glyphcache",
+};
+
+#ifdef PAPER_ADAPTIVE_LOCKS
+/*
+ * Spin for a while before parking the thread on the mutex. mupdf holds its
+ * locks for very short stretches, mostly around malloc and the glyph cache,
+ * so the lock is often free again sooner than a sleep and wakeup would take.
+ */
+static void acquire_ctx_lock(CtxLock *lock) {
+  for (int i = 0; i < LOCK_SPIN_COUNT; i++) {
+    CPU_RELAX();
+    if (g_mutex_trylock(&lock->mutex))
+      return;
+  }
+  g_mutex_lock(&lock->mutex);
 }
+#else
+static void acquire_ctx_lock(CtxLock *lock) { g_mutex_lock(&lock->mutex); }
+#endif
 
 void lock_ctx_mutex(void *user, int i) {
-  GMutex *mutexes = user;
-  g_mutex_lock(&mutexes[i]);
+  CtxLock *lock = &((CtxLock *)user)[i];
+  gboolean contended = !g_mutex_trylock(&lock->mutex);
+  gint64 start = 0;
+  if (contended) {
+    start = g_get_monotonic_time();
+    acquire_ctx_lock(lock);
+  }
+  lock->stats.acquisitions++;
+  if (contended) {
+    lock->stats.contended++;
+    lock->stats.wait_us += g_get_monotonic_time() - start;
+  }
 }
 void unlock_ctx_mutex(void *user, int i) {
-  GMutex *mutexes = user;
-  g_mutex_unlock(&mutexes[i]);
+  CtxLock *locks = user;
+  g_mutex_unlock(&locks[i].mutex);
+}
+
+static void doc_lock_stats(DocInfo *doci, LockStats stats[FZ_LOCK_MAX],
+                           gboolean reset) {
+  for (int i = 0; i < FZ_LOCK_MAX; i++) {
+    CtxLock *lock = &doci->ctx_locks[i];
+    // not through lock_ctx_mutex, so that reading doesn't count
+    g_mutex_lock(&lock->mutex);
+    if (stats)
+      stats[i] = lock->stats;
+    if (reset)
+      memset(&lock->stats, 0, sizeof(lock->stats));
+    g_mutex_unlock(&lock->mutex);
+  }
+}
+
+// Copy the contention counters of each of mupdf's locks into STATS.
+void get_lock_stats(GtkWidget *widget, LockStats stats[FZ_LOCK_MAX]) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  doc_lock_stats(&c->doci, stats, FALSE);
+}
+
+void reset_lock_stats(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  doc_lock_stats(&c->doci, NULL, TRUE);
 }
 
 int load_doc(DocInfo *doci, char *filename, char *accel_filename) {
@@ -899,13 +5205,15 @@ int load_doc(DocInfo *doci, char *filename, char *accel_filename) {
 
   // initialize mutexes
   for (int i = 0; i < FZ_LOCK_MAX; i++) {
-    g_mutex_init(&doci->ctx_mutexes[i]);
+    g_mutex_init(&doci->ctx_locks[i].mutex);
   }
-  doci->locks_context.user = doci->ctx_mutexes;
+  g_mutex_init(&doci->instances.lock);
+  g_cond_init(&doci->instances.cond);
+  doci->locks_context.user = doci->ctx_locks;
   doci->locks_context.lock = lock_ctx_mutex;
   doci->locks_context.unlock = unlock_ctx_mutex;
   fz_context *ctx =
-      fz_new_context(NULL, &doci->locks_context, FZ_STORE_DEFAULT);
+      fz_new_context(NULL, &doci->locks_context, STORE_SIZE);
   doci->ctx = ctx;
 
   fz_try(ctx) { fz_register_document_handlers(ctx); }
@@ -916,6 +5224,15 @@ int load_doc(DocInfo *doci, char *filename, char *accel_filename) {
     return 1;
   }
   strcpy(doci->filename, filename);
+  journal_recover(doci->filename);
+  GError *error = NULL;
+  if (!journal_stat(doci->filename, &doci->save.file, &error)) {
+    fprintf(stderr, "%s\n", error->message);
+    g_error_free(error);
+  }
+  doci->save.file_size = doci->save.file.size;
+  compute_cache_key(doci);
+  schedule_job(NULL, TIER_HOUSEKEEPING, thread_trim_text_cache, NULL);
   if (accel_filename)
     strcpy(doci->accel, accel_filename);
 
@@ -930,20 +5247,28 @@ int load_doc(DocInfo *doci, char *filename, char *accel_filename) {
     fz_drop_context(ctx);
     return 0;
   }
+  // dropped along with doc in finalize
+  doci->pdf = pdf_keep_document(ctx, pdf_specifics(ctx, doci->doc));
   fz_location loc = {0, 0};
   doci->location = loc;
   doci->colorspace = fz_device_bgr(ctx);
   doci->zoom = 1.0f;
   /* Count the number of pages. */
   doci->chapter_count = fz_count_chapters(ctx, doci->doc);
-  // invalidate location keys on the page cache
-  memset(doci->page_cache.locs, -1, sizeof(doci->page_cache.locs));
+  count_chapters(doci);
+  init_page_cache(&doci->page_cache);
   // make zeroed-out seach IDs invalid to current one
   doci->search_id = 1;
+  doci->doc_search.cur_page = -1;
   doci->selection.id = 1;
   doci->rendered_id = 1;
-  doci->page_cache.render_pool = g_thread_pool_new(
-      thread_render, doci, g_get_num_processors(), FALSE, NULL);
+  doci->link_targets =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, drop_link_target);
+  // lay out the pages we haven't seen yet like the first one
+  layout_init(doci, view_height(doci, get_cur_page(doci)));
+  note_page_loaded(doci, get_cur_page(doci));
+  doci->predecode_share = DEFAULT_PREDECODE_SHARE;
+  open_doc_instances(doci, DEFAULT_DOC_INSTANCES);
   return 1;
 }
 
@@ -960,6 +5285,7 @@ PaperView *paper_view_new(char *filename, char *accel_filename) {
     return NULL;
   }
   c->has_mouse_event = FALSE;
+  reload_synctex(GTK_WIDGET(widget));
   return PAPER_VIEW(ret);
 }
 
@@ -978,11 +5304,51 @@ static void activate(GtkApplication *app, char *filename) {
 }
 static void paper_view_finalize(GObject *object) {
   PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(object));
-  g_thread_pool_free(c->doci.page_cache.render_pool, TRUE, TRUE);
+  // every job on the render threads holds a reference to us, so there are
+  // none left by now
+  if (g_atomic_pointer_get(&scheduler.focused) == &c->doci)
+    g_atomic_pointer_set(&scheduler.focused, NULL);
+  close_doc_instances(&c->doci);
+  cancel_doc_search(&c->doci);
+  cancel_text_export(&c->doci);
+  drop_exported_text(&c->doci);
+  free(c->doci.selection_text.text);
+  for (int i = 0; i < c->doci.jump_labels.count; i++)
+    g_free(c->doci.jump_labels.targets[i].uri);
+  free(c->doci.jump_labels.targets);
+  search_needle_unref(c->doci.search);
+  if (c->doci.page_cache.progressive_timer)
+    g_source_remove(c->doci.page_cache.progressive_timer);
+  if (c->doci.page_cache.frame_idle)
+    g_source_remove(c->doci.page_cache.frame_idle);
+  if (c->hover.prefetch_timer)
+    g_source_remove(c->hover.prefetch_timer);
+  if (c->doci.save.autosave_timer)
+    g_source_remove(c->doci.save.autosave_timer);
   fz_context *ctx = c->doci.ctx;
-  for (int i = 0; i < PAGE_CACHE_LEN; i++) {
-    drop_page(ctx, &c->doci.page_cache.pages[i]);
+  for (int i = 0; i < c->doci.page_cache.len; i++) {
+    drop_page(ctx, c->doci.page_cache.pages[i]);
+    free(c->doci.page_cache.pages[i]);
   }
+  free(c->doci.page_cache.pages);
+  free(c->doci.page_cache.locs);
+  free(c->doci.page_cache.pinned);
+  drop_thumbnails(&c->doci);
+  unpin_slides(&c->doci.presentation);
+  synctex_free(c->doci.synctex.index);
+  word_index_close(c->doci.word_index.index);
+  g_free(c->doci.synctex.pending_file);
+  if (c->doci.link_targets)
+    g_hash_table_destroy(c->doci.link_targets);
+  layout_drop(&c->doci.layout);
+  if (c->doci.chapters.thread)
+    g_thread_join(c->doci.chapters.thread);
+  g_mutex_clear(&c->doci.chapters.lock);
+  g_cond_clear(&c->doci.chapters.cond);
+  g_mutex_clear(&c->doci.instances.lock);
+  g_cond_clear(&c->doci.instances.cond);
+  free(c->doci.chapter_starts);
+  free(c->doci.annot_versions);
   fz_drop_document(ctx, c->doci.doc);
   fz_drop_outline(ctx, c->doci.outline);
   pdf_drop_document(ctx, c->doci.pdf);
@@ -991,6 +5357,32 @@ static void paper_view_finalize(GObject *object) {
   G_OBJECT_CLASS(paper_view_parent_class)->finalize(object);
 }
 
+static void paper_view_dispose(GObject *object) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(object));
+  // make queued jobs return early, dropping their references to us
+  g_atomic_int_set(&c->doci.is_closing, 1);
+  c->doci.predecode_share = 0;
+  // the edits waiting to be autosaved are saved now, as the save holds a
+  // reference to us until it's done
+  if (c->doci.save.autosave_timer)
+    save_document(GTK_WIDGET(object));
+  G_OBJECT_CLASS(paper_view_parent_class)->dispose(object);
+}
+
+static void paper_view_map(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  g_atomic_int_set(&c->doci.is_visible, 1);
+  reprioritize_jobs();
+  GTK_WIDGET_CLASS(paper_view_parent_class)->map(widget);
+}
+
+static void paper_view_unmap(GtkWidget *widget) {
+  PaperViewPrivate *c = paper_view_get_instance_private(PAPER_VIEW(widget));
+  g_atomic_int_set(&c->doci.is_visible, 0);
+  reprioritize_jobs();
+  GTK_WIDGET_CLASS(paper_view_parent_class)->unmap(widget);
+}
+
 static void paper_view_class_init(PaperViewClass *class) {
 
   /* overwrite methods */
@@ -1002,12 +5394,46 @@ static void paper_view_class_init(PaperViewClass *class) {
   widget_class->button_release_event = button_release_event;
   widget_class->configure_event = configure_event;
   widget_class->query_tooltip = query_tooltip;
+  widget_class->map = paper_view_map;
+  widget_class->unmap = paper_view_unmap;
   /* widget_class->leave_notify_event   = cb_zathura_page_widget_leave_notify;
    */
   /* widget_class->popup_menu           = cb_zathura_page_widget_popup_menu; */
 
   GObjectClass *object_class = G_OBJECT_CLASS(class);
   object_class->finalize = paper_view_finalize;
+  // (FILE, LINE) of the TeX input that a control-click came from
+  signals[SIGNAL_SYNCTEX_EDIT] = g_signal_new(
+      "synctex-edit", G_TYPE_FROM_CLASS(class), G_SIGNAL_RUN_LAST, 0, NULL,
+      NULL, NULL, G_TYPE_NONE, 2, G_TYPE_STRING, G_TYPE_INT);
+  // (MATCHES, PAGES-SEARCHED, PAGES) while the document is searched
+  signals[SIGNAL_COUNTED_MATCHES] = g_signal_new(
+      "counted-matches", G_TYPE_FROM_CLASS(class), G_SIGNAL_RUN_LAST, 0, NULL,
+      NULL, NULL, G_TYPE_NONE, 3, G_TYPE_INT, G_TYPE_INT, G_TYPE_INT);
+  // (PAGES-DONE, PAGES) when start_text_export has text for
+  // take_exported_text, once until it's taken
+  signals[SIGNAL_TEXT_EXPORTED] = g_signal_new(
+      "text-exported", G_TYPE_FROM_CLASS(class), G_SIGNAL_RUN_LAST, 0, NULL,
+      NULL, NULL, G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_INT);
+  // (BYTES-DONE, BYTES) while save_document writes the file anew, and
+  // once more when it's on disk
+  signals[SIGNAL_SAVE_PROGRESS] = g_signal_new(
+      "save-progress", G_TYPE_FROM_CLASS(class), G_SIGNAL_RUN_LAST, 0, NULL,
+      NULL, NULL, G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_INT);
+  // (MESSAGE) when save_document can't save the edits
+  signals[SIGNAL_SAVE_FAILED] = g_signal_new(
+      "save-failed", G_TYPE_FROM_CLASS(class), G_SIGNAL_RUN_LAST, 0, NULL,
+      NULL, NULL, G_TYPE_NONE, 1, G_TYPE_STRING);
+  // (SHOWN) when a synctex_forward that waited for the SyncTeX file to be
+  // read again is done
+  signals[SIGNAL_SYNCTEX_VIEWED] = g_signal_new(
+      "synctex-viewed", G_TYPE_FROM_CLASS(class), G_SIGNAL_RUN_LAST, 0, NULL,
+      NULL, NULL, G_TYPE_NONE, 1, G_TYPE_BOOLEAN);
+  // () when start_selection_copy has the text for take_copied_selection
+  signals[SIGNAL_SELECTION_COPIED] = g_signal_new(
+      "selection-copied", G_TYPE_FROM_CLASS(class), G_SIGNAL_RUN_LAST, 0, NULL,
+      NULL, NULL, G_TYPE_NONE, 0);
+  object_class->dispose = paper_view_dispose;
   /* gtk_widget_class->show = ev_loading_message_show; */
   /* gtk_widget_class->hide = ev_loading_message_hide; */
 }
@@ -1024,9 +5450,179 @@ static void paper_view_init(PaperView *self) {
   gtk_widget_set_has_tooltip(GTK_WIDGET(self), TRUE);
 }
 
+static GAsyncQueue *bench_loaded;
+static void bench_page_loaded(struct LoadArgs *la) {
+  g_async_queue_push(bench_loaded, la);
+}
+
+/*
+ * Print the number of pages per second loaded from FILENAME with 1, 2, 4...
+ * document instances, up to the number of processors.
+ */
+static int bench_load(char *filename) {
+  DocInfo *doci = malloc(sizeof(*doci));
+  if (!load_doc(doci, filename, NULL) || !doci->doc) {
+    fprintf(stderr, "could not open %s\n", filename);
+    return EXIT_FAILURE;
+  }
+  bench_loaded = g_async_queue_new();
+  printf("instances\tpages/s");
+  for (int i = 0; i < FZ_LOCK_MAX; i++)
+    printf("\t%s contended/waited", LOCK_NAMES[i]);
+  printf("\n");
+  for (int n = 1; n <= (int)g_get_num_processors(); n *= 2) {
+    if (open_doc_instances(doci, n) != n)
+      break;
+    doc_lock_stats(doci, NULL, TRUE);
+    gint64 start = g_get_monotonic_time();
+    int count = 0;
+    for (fz_location loc = fz_make_location(0, 0);;) {
+      struct LoadArgs *la = malloc(sizeof(*la));
+      la->loc = loc;
+      la->widget = NULL;
+      la->done = bench_page_loaded;
+      load_page_in_background(doci, la);
+      count++;
+      fz_location next = fz_next_page(doci->ctx, doci->doc, loc);
+      if (locationcmp(next, loc) == 0)
+        break;
+      loc = next;
+    }
+    for (int i = 0; i < count; i++) {
+      struct LoadArgs *la = g_async_queue_pop(bench_loaded);
+      drop_page(doci->ctx, la->page);
+      free(la->page);
+      free(la);
+    }
+    double seconds = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+    LockStats stats[FZ_LOCK_MAX];
+    doc_lock_stats(doci, stats, FALSE);
+    printf("%d\t%.1f", n, count / seconds);
+    for (int i = 0; i < FZ_LOCK_MAX; i++)
+      printf("\t%.1f%%/%.3fs",
+             100.0 * stats[i].contended / MAX(stats[i].acquisitions, 1),
+             stats[i].wait_us / (double)G_USEC_PER_SEC);
+    printf("\n");
+  }
+  return EXIT_SUCCESS;
+}
+
+#define BENCH_QUERIES 100000
+
+/*
+ * Print how long reading the SyncTeX file of the PDF at FILENAME takes, and
+ * how long forward and inverse searches take on average, looking up the
+ * records of random lines and the points of random records.
+ */
+static int bench_synctex(char *filename) {
+  char *path = synctex_path(filename);
+  if (!path) {
+    fprintf(stderr, "no SyncTeX file for %s\n", filename);
+    return EXIT_FAILURE;
+  }
+  gint64 start = g_get_monotonic_time();
+  SyncTeX *synctex = synctex_load(path);
+  gint64 loaded = g_get_monotonic_time();
+  if (!synctex || synctex->count == 0) {
+    fprintf(stderr, "could not read %s\n", path);
+    return EXIT_FAILURE;
+  }
+  printf("%s: %d records, %d pages, read in %.3fs\n", path, synctex->count,
+         synctex->records[synctex->count - 1].page + 1,
+         (loaded - start) / (double)G_USEC_PER_SEC);
+  SyncRecord *queries = malloc(BENCH_QUERIES * sizeof(*queries));
+  for (int i = 0; i < BENCH_QUERIES; i++)
+    queries[i] = synctex->records[g_random_int_range(0, synctex->count)];
+  int found = 0;
+  start = g_get_monotonic_time();
+  for (int i = 0; i < BENCH_QUERIES; i++) {
+    int page;
+    fz_rect rect;
+    found += synctex_view(synctex, synctex->files[queries[i].file],
+                          queries[i].line, &page, &rect);
+  }
+  gint64 forward = g_get_monotonic_time() - start;
+  start = g_get_monotonic_time();
+  for (int i = 0; i < BENCH_QUERIES; i++) {
+    fz_point point = {queries[i].rect.x0, queries[i].rect.y1};
+    found += synctex_edit(synctex, queries[i].page, point) != NULL;
+  }
+  gint64 inverse = g_get_monotonic_time() - start;
+  printf("forward search: %.2fus\ninverse search: %.2fus\n(%d/%d found)\n",
+         forward / (double)BENCH_QUERIES, inverse / (double)BENCH_QUERIES,
+         found, 2 * BENCH_QUERIES);
+  free(queries);
+  synctex_free(synctex);
+  g_free(path);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Print how long finding NEEDLE on every page of FILENAME takes with
+ * fz_search_stext_page, and with the normalized texts of search_text_new,
+ * both building them and searching them once built. Loading the pages isn't
+ * counted.
+ */
+static int bench_search(char *filename, char *needle) {
+  DocInfo *doci = malloc(sizeof(*doci));
+  if (!load_doc(doci, filename, NULL) || !doci->doc) {
+    fprintf(stderr, "could not open %s\n", filename);
+    return EXIT_FAILURE;
+  }
+  fz_context *ctx = doci->ctx;
+  int count = doci->layout.page_count;
+  fz_stext_page **pages = malloc(count * sizeof(*pages));
+  for (int n = 0; n < count; n++)
+    pages[n] = load_page_text(doci, ctx, doci->doc,
+                              location_from_page_number(doci, n));
+  SearchNeedle *search = search_needle_new(needle, 0, NULL);
+  SearchText **texts = malloc(count * sizeof(*texts));
+  int max_count = 1024, mupdf_matches = 0, matches = 0;
+  fz_quad *quads = malloc(max_count * sizeof(*quads));
+  gint64 start = g_get_monotonic_time();
+  for (int n = 0; n < count; n++)
+    if (pages[n])
+      mupdf_matches +=
+          fz_search_stext_page(ctx, pages[n], needle, quads, max_count);
+  gint64 mupdf = g_get_monotonic_time() - start;
+  start = g_get_monotonic_time();
+  for (int n = 0; n < count; n++)
+    texts[n] = pages[n] ? search_text_new(pages[n], 0) : NULL;
+  gint64 normalize = g_get_monotonic_time() - start;
+  start = g_get_monotonic_time();
+  for (int n = 0; n < count; n++)
+    if (texts[n])
+      matches += search_text_find(texts[n], search, &quads);
+  gint64 find = g_get_monotonic_time() - start;
+  printf("%d pages\n", count);
+  printf("fz_search_stext_page: %.3fs (%d matches)\n",
+         mupdf / (double)G_USEC_PER_SEC, mupdf_matches);
+  printf("search_text_new: %.3fs\n", normalize / (double)G_USEC_PER_SEC);
+  printf("search_text_find: %.3fs (%d matches)\n",
+         find / (double)G_USEC_PER_SEC, matches);
+  for (int n = 0; n < count; n++) {
+    fz_drop_stext_page(ctx, pages[n]);
+    search_text_free(texts[n]);
+  }
+  free(quads);
+  free(texts);
+  free(pages);
+  search_needle_unref(search);
+  return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv) {
+  if (argc == 3 && strcmp(argv[1], "--bench-load") == 0)
+    return bench_load(argv[2]);
+  if (argc == 3 && strcmp(argv[1], "--bench-synctex") == 0)
+    return bench_synctex(argv[2]);
+  if (argc == 4 && strcmp(argv[1], "--bench-search") == 0)
+    return bench_search(argv[2], argv[3]);
   if (argc != 2) {
-    fprintf(stderr, "Must supply a file name to open\n");
+    fprintf(stderr,
+            "Usage: %s [--bench-load|--bench-synctex] FILE\n"
+            "       %s --bench-search FILE NEEDLE\n",
+            argv[0], argv[0]);
     exit(EXIT_FAILURE);
   }
   char *filename = argv[1];
@@ -4,9 +4,14 @@
 #include <mupdf/fitz.h>
 #include <mupdf/pdf.h> /* for pdf specifics and forms */
 #include <time.h>
+#include "journal.h"
+#include "synctex.h"
+#include "textcache.h"
+#include "textsearch.h"
+#include "wordindex.h"
 
 typedef struct Quads {
-  fz_quad *quads; // allocated on demand by complete_selection()
+  fz_quad *quads; // allocated on demand by ensure_*_cache_is_updated()
   int count;
 } Quads;
 
@@ -27,45 +32,270 @@ typedef struct PageRenderCache {
     float zoom;
     float rotate;
     char is_in_progress;
+    // the surface a render thread is currently drawing onto; the progress
+    // of the drawing is attached to it, see should_show_partial
+    cairo_surface_t *partial;
   } rendered;
+  // compared against DocInfo.rendered_id, like rendered.id; images are
+  // decoded at a subsampling level that depends on the zoom
+  unsigned int predecoded_id;
+  // the annotations of the page, drawn with transparency over rendered so
+  // that editing them doesn't render the content again, see
+  // get_rendered_annots
+  struct CachedAnnots {
+    cairo_surface_t *surface; // NULL if the page has no annotations
+    unsigned int id;          // like rendered.id
+    float zoom;               // like rendered.zoom, of surface
+    float rotate;
+    char is_in_progress;
+    fz_rect dirty; // of the page, to draw again; empty if surface is current
+  } annots;
 } PageRenderCache;
 
+// links of a page bucketed by the cells of a grid over it, see find_link_at
+typedef struct LinkGrid {
+  // the links of cell i are links[cell_starts[i]] to links[cell_starts[i+1]-1]
+  int *cell_starts;
+  fz_link **links;
+} LinkGrid;
+
+// words of a page bucketed like links, by the cell of their center
+typedef struct WordGrid {
+  // the words of cell i are boxes[cell_starts[i]] to boxes[cell_starts[i+1]-1]
+  int *cell_starts;
+  fz_rect *boxes; // in reading order within each cell
+} WordGrid;
+
+// where an internal link leads, see resolve_link
+typedef struct LinkTarget {
+  fz_location loc; // chapter and page are -1 if the link is invalid
+  fz_point point;
+  cairo_surface_t *preview; // of the destination, see queue_link_preview
+  unsigned int preview_version; // of the annotations shown on preview
+  gboolean is_preview_in_progress;
+} LinkTarget;
+
 typedef struct Page {
-  fz_page *page;
+  fz_location loc;
+  fz_page *page; // NULL for pages loaded by a DocInstance
   fz_stext_page *page_text;
+  int char_count; // of page_text
+  // page_text normalized for the search, see ensure_search_cache_is_updated
+  SearchText *search_text;
   fz_rect page_bounds;
+  fz_rect content_bounds; // of what's drawn on the page; empty if blank
   fz_separations *seps;
   fz_link *links;
-  fz_display_list *display_list;
+  LinkGrid link_grid;
+  WordGrid word_grid;
+  fz_display_list *display_list; // of the content, without annotations
+  // of the annotations and form widgets; NULL if the page has none
+  fz_display_list *annot_list;
+  unsigned int annot_version; // of annot_list, see DocInfo.annot_versions
   PageRenderCache cache;
 } Page;
 
 extern const int PAGE_SEPARATOR_HEIGHT;
 
-#define PAGE_CACHE_LEN 32
+#define PAGE_CACHE_LEN 64
+
+// Position of every page in the document, see layout_find
+typedef struct Layout {
+  int page_count;
+  float *heights; // 0 for pages whose height isn't known yet
+  float estimate; // height assumed for those
+  int columns;    // pages per row
+  int first_column; // of the first page; 1 to show pages as book spreads
+  int row_count;
+  float *row_heights; // height of the tallest page of each row
+  double *tree;       // Fenwick tree of the row heights, 1-based
+} Layout;
+
+// what show_jump_labels labels
+enum JumpKinds {
+  JUMP_LINKS = 1 << 0,
+  JUMP_WORDS = 1 << 1,
+};
+
+#define JUMP_LABEL_MAX 8
+
+// A link or word on screen that can be jumped to by typing its label
+typedef struct JumpTarget {
+  int kind; // JUMP_LINKS or JUMP_WORDS
+  fz_location loc;
+  int n; // page number of loc
+  fz_rect box;    // on the page
+  fz_rect screen; // in widget coordinates, when it was labelled
+  char *uri;      // of links
+  char label[JUMP_LABEL_MAX];
+} JumpTarget;
+
+typedef struct LockStats {
+  guint64 acquisitions;
+  guint64 contended; // acquisitions that found the lock taken
+  guint64 wait_us;   // total time spent waiting for the lock
+} LockStats;
+
+// One of the locks mupdf asks for through fz_locks_context
+typedef struct CtxLock {
+  GMutex mutex;
+  LockStats stats; // only updated while holding mutex
+} CtxLock;
+
+// An extra handle of the document with its own context, so that pages can be
+// loaded, parsed and text-extracted in parallel to the main handle.
+typedef struct DocInstance {
+  fz_context *ctx;
+  fz_document *doc;
+} DocInstance;
+
+// wraps args to load a page for passing into g_thread_pool_push
+struct LoadArgs {
+  fz_location loc;
+  Page *page; // malloc'ed by the loading thread
+  struct DocInfo *doci;
+  GtkWidget *widget;
+  void (*done)(struct LoadArgs *la); // called from the loading thread
+  void *data;                        // for done
+};
 
 typedef struct DocInfo {
   fz_document *doc;
   fz_location location;
   fz_outline *outline;
-  pdf_document *pdf;
+  pdf_document *pdf; // NULL unless the document is a PDF
   pdf_annot *selected_annot;
+  // bumped for a page by each edit of its annotations, so that the pages
+  // loaded before it, or by a DocInstance, know to update their annot_list;
+  // NULL until the first edit
+  unsigned int *annot_versions;
   float zoom;   // 1.0 means no scaling
   float rotate; // in degrees
+  gboolean trim_margins; // show only the content of pages, see view_bounds
   unsigned int rendered_id;
-  /* 0 <= scroll.y <= get_page(doci, doci.location).page_bounds.y1 +
-   * PAGE_SEPARATOR_HEIGHT*/
-  /* scroll is always relative to current page bounds */
+  /* location is the first page of the row at the top of the view */
+  /* 0 <= scroll.y <= layout.row_heights[row of location] +
+   * PAGE_SEPARATOR_HEIGHT / zoom */
+  /* scroll is always relative to the left and top of the current row */
   fz_point scroll;
   int chapter_count;
+  // page number of the first page of each chapter, followed by the number of
+  // pages in the document; see count_chapters
+  int *chapter_starts;
+  struct ChapterCount {
+    GThread *thread; // filling chapter_starts, NULL if there's one chapter
+    int done;        // entries of chapter_starts filled so far
+    GMutex lock;
+    GCond cond; // broadcast whenever done grows
+  } chapters;
+  Layout layout;
+  // destination of goto_page, while waiting for it to render
+  struct Jump {
+    gboolean is_pending;
+    fz_location to;
+    // the view the jump was requested from; moving it cancels the jump
+    fz_location from;
+    float from_scroll_y;
+    gint64 deadline; // switch anyway after this monotonic time
+  } jump;
   // cache of pages implemented as a circular array with newly fetched pages at
   // the front
   struct PageCache {
-    Page pages[PAGE_CACHE_LEN];
-    fz_location locs[PAGE_CACHE_LEN];
-    GThreadPool *render_pool;
+    // PAGE_CACHE_LEN, or more for as long as take_page_cache_slot found
+    // every slot busy; the pages themselves never move
+    int len;
+    Page **pages;
+    fz_location *locs;
+    // the frame each page was last handed out in; the pages of the current
+    // frame aren't evicted, see pin_page
+    unsigned int *pinned;
+    unsigned int frame;
+    guint frame_idle; // ends the current frame; 0 between frames
+    int renders_in_progress; // atomic
+    guint progressive_timer;
     int first;
   } page_cache;
+  // fraction of the fz_store that predecoded images may fill
+  float predecode_share;
+  struct DocInstances {
+    DocInstance *instances;
+    int count;
+    GAsyncQueue *idle; // instances not used by any thread right now
+    // jobs that take one of the instances, see schedule_instance_job; all
+    // protected by lock
+    int jobs; // not done yet
+    int dispatched; // on the shared threads, at most count
+    GQueue waiting; // the rest, for an instance to be done
+    GMutex lock;
+    GCond cond; // signalled when jobs drops to 0
+    // pages being loaded that would be inserted into page_cache
+    fz_location prefetching[PAGE_CACHE_LEN];
+    int prefetching_count;
+  } instances;
+  // page overview, see get_thumbnail
+  struct Thumbnails {
+    cairo_surface_t **surfaces; // one per page, NULL until it's done
+    unsigned int *versions; // of the annotations shown on each of surfaces
+    int next; // the page whose thumbnail is being made
+    gboolean is_busy; // while a thumbnail is being made
+    int first_stale; // the first page edited since its thumbnail was made
+  } thumbnails;
+  // LinkTarget of every link resolved so far, by uri
+  GHashTable *link_targets;
+  // SyncTeX data of the document, see reload_synctex
+  struct SyncTeXState {
+    SyncTeX *index; // NULL until it's read, or if there's none
+    gboolean is_loading;
+    time_t mtime; // of the file index was read from
+    // a forward search waiting for the index to be read again
+    char *pending_file;
+    int pending_line;
+    // where the last forward search went, marked until the next click
+    gboolean has_mark;
+    fz_location mark_loc;
+    fz_rect mark;
+  } synctex;
+  // links and words labelled for jumping to, see show_jump_labels
+  struct JumpLabels {
+    JumpTarget *targets;
+    int count; // 0 unless labels are shown
+    // typed so far; only the labels starting with it are drawn
+    char prefix[JUMP_LABEL_MAX];
+  } jump_labels;
+  // the words of every page, for narrowing searches down; see
+  // build_word_index
+  struct WordIndexState {
+    WordIndex *index; // NULL until it's read or built
+    gboolean is_building;
+    int pages_done; // atomic; pages indexed so far while building
+  } word_index;
+  char cache_key[41]; // of the document's cache directory, see doc_cache_path
+  // render scheduling shared with the other views, see schedule_job
+  guint64 sched_seq;
+  struct JobBatch {
+    gboolean is_open;
+    guint64 seq; // of the jobs in the batch, 0 until the first is queued
+  } batch;
+  // full-screen slide show, see set_presentation
+  struct Presentation {
+    gboolean is_active;
+    int direction; // 1 after flipping forward, -1 after flipping back
+    // the previous, current and next slides, rendered at the current zoom;
+    // their surfaces are kept even if their pages are evicted
+    struct Slide {
+      int n;
+      cairo_surface_t *surface; // NULL until rendered
+      unsigned int rendered_id;
+    } slides[3];
+    unsigned int missed; // flips to slides that weren't rendered yet
+    int width, height;   // of the view the slides are fitted to
+    // the layout to go back to
+    float zoom;
+    int columns;
+    int first_column;
+  } presentation;
+  int is_visible; // atomic
+  int is_closing; // atomic
   struct Selection {
     gboolean is_in_progress;
     gboolean is_active;
@@ -76,13 +306,58 @@ typedef struct DocInfo {
     int mode; // FZ_SELECT_(CHARS|WORDS|LINES)
     unsigned int id;
   } selection;
+  // the text of the selection extracted in the background, see
+  // start_selection_copy
+  struct SelectionText {
+    struct SelectionCopy *copy; // the copy to keep the text of, else NULL
+    char *text; // extracted but not taken yet, else NULL
+    size_t len;
+  } selection_text;
   char filename[PATH_MAX];
   char accel[PATH_MAX];
-  char search[PATH_MAX];
+  SearchNeedle *search; // NULL if nothing is searched for
   unsigned int search_id;
+  // the search for search over the whole document, see start_doc_search
+  struct DocSearch {
+    struct SearchRun *run; // NULL if nothing is searched for
+    // matches of every page; count is -1 for pages not searched yet
+    Quads *hits;
+    int first; // the page the search started from
+    int next;  // pages after first that search_next_page looked at
+    int pages_done;
+    int match_count;
+    // the match goto_match went to last; page is -1 before the first call
+    int cur_page;
+    int cur_match;
+    gint64 reported; // monotonic time counted-matches was last emitted at
+    guint idle_id;   // searches on the GTK thread without document instances
+  } doc_search;
+  // the text of every page handed out in order, see start_text_export
+  struct TextExport {
+    struct ExportRun *run; // NULL unless exporting
+    // of the pages extracted but not collected yet, else NULL
+    char **texts;
+    int queued;     // pages queued so far, from the first
+    int collected;  // pages collected so far, from the first
+    GString *ready; // collected but not taken yet, else NULL
+    guint idle_id;  // extracts on the GTK thread without document instances
+  } text_export;
+  // the edits appended to the document file, see save_document
+  struct Save {
+    unsigned int edits;       // bumped by each edit of the document
+    unsigned int saved_edits; // edits when the last save was written
+    gboolean is_saving;
+    gboolean is_pending; // save again once the running save is done
+    // of the document file when it was opened; every save writes the file
+    // anew as these bytes and an update with all the edits since
+    goffset file_size;
+    JournalFile file; // the document file as it was opened or last saved
+    int autosave_delay_ms; // 0 unless edits are saved by themselves
+    guint autosave_timer;
+  } save;
   fz_colorspace *colorspace;
   fz_context *ctx;
-  GMutex ctx_mutexes[FZ_LOCK_MAX];
+  CtxLock ctx_locks[FZ_LOCK_MAX];
   fz_locks_context locks_context;
 } DocInfo;
 
@@ -90,6 +365,17 @@ typedef struct _PaperViewPrivate {
   DocInfo doci;
   GdkEventButton mouse_event;
   gboolean has_mouse_event;
+  // the last pointer motion, handled once per frame by handle_motion
+  struct Hover {
+    fz_point point;
+    gboolean is_selecting;
+    guint tick_id; // 0 unless a motion is waiting for the next frame
+    // what was under the pointer when it was last handled
+    fz_location loc;
+    fz_point page_point;
+    // runs while the destination of the highlighted link is prefetched
+    guint prefetch_timer;
+  } hover;
   GdkCursor *default_cursor;
   GdkCursor *click_cursor;
 } PaperViewPrivate;
@@ -125,12 +411,61 @@ void scroll_to_page_start(GtkWidget *widget);
 void scroll_to_page_end(GtkWidget *widget);
 void fit_width(GtkWidget *widget);
 void fit_height(GtkWidget *widget);
-char *get_selection(GtkWidget *widget, size_t *res_len);
+void fit_content_width(GtkWidget *widget);
+void set_trim_margins(GtkWidget *widget, gboolean trim);
+gboolean start_selection_copy(GtkWidget *widget);
+char *take_copied_selection(GtkWidget *widget, size_t *res_len);
+gboolean highlight_selection(GtkWidget *widget);
+gboolean save_document(GtkWidget *widget);
+gboolean has_unsaved_edits(GtkWidget *widget);
+void set_autosave_delay(GtkWidget *widget, int delay_ms);
+int get_selection_page_count(GtkWidget *widget);
+gboolean copy_selection_lazily(GtkWidget *widget);
 void unset_selection(GtkWidget *widget);
-void set_search(GtkWidget *widget, char *needle);
+gboolean set_search(GtkWidget *widget, const char *needle, int flags,
+                    GError **error);
 void unset_search(GtkWidget *widget);
+int goto_match(GtkWidget *widget, int delta);
+void start_text_export(GtkWidget *widget);
+void stop_text_export(GtkWidget *widget);
+char *take_exported_text(GtkWidget *widget, size_t *len, int *pages_done,
+                         int *pages);
+void build_word_index(GtkWidget *widget);
+int show_jump_labels(GtkWidget *widget, int kinds, const char *keys,
+                     const JumpTarget **targets);
+int narrow_jump_labels(GtkWidget *widget, const char *prefix);
+gboolean jump_to_target(GtkWidget *widget, int i);
+void hide_jump_labels(GtkWidget *widget);
+gboolean get_word_index_status(GtkWidget *widget, int *pages_done,
+                               size_t *size);
 void zoom_relatively_around_point(GtkWidget *widget, float mult,
                                   fz_point point);
+void goto_page(GtkWidget *widget, int n);
+int get_current_page(GtkWidget *widget);
+int get_page_count(GtkWidget *widget);
+cairo_surface_t *get_thumbnail(GtkWidget *widget, int n);
+int get_thumbnails_done(GtkWidget *widget);
+double get_position(GtkWidget *widget);
+void set_columns(GtkWidget *widget, int columns, gboolean book);
+void set_position(GtkWidget *widget, double position);
+void set_presentation(GtkWidget *widget, gboolean active);
+void flip_slides(GtkWidget *widget, int delta);
+unsigned int get_missed_slides(GtkWidget *widget);
+// what synctex_forward did
+enum SyncTeXView {
+  SYNCTEX_VIEW_NONE, // the document has no SyncTeX data for the line
+  SYNCTEX_VIEW_SHOWN,
+  SYNCTEX_VIEW_PENDING, // waiting for the SyncTeX file to be read again
+};
+enum SyncTeXView synctex_forward(GtkWidget *widget, const char *file,
+                                 int line);
+void set_predecode_share(GtkWidget *widget, float share);
+void set_doc_instances(GtkWidget *widget, int n);
+void set_render_threads(int n);
+void set_focused_view(GtkWidget *widget);
+extern const char *const LOCK_NAMES[FZ_LOCK_MAX];
+void get_lock_stats(GtkWidget *widget, LockStats stats[FZ_LOCK_MAX]);
+void reset_lock_stats(GtkWidget *widget);
 
 PaperView *paper_view_new(char *filename, char *accel_filename);
 
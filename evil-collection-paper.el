@@ -31,7 +31,8 @@
 (require 'paper)
 (require 'evil-collection)
 
-(defvar evil-collection-paper-maps '(paper-mode-map))
+(defvar evil-collection-paper-maps '(paper-mode-map
+                                     paper-presentation-mode-map))
 
 
 ;;;###autoload
@@ -59,16 +60,28 @@
 
     [remap evil-goto-first-line] #'paper-goto-first-page
     [remap evil-goto-line] #'paper-goto-last-page
+    "%" #'paper-goto-percent
+    "gp" #'paper-goto-page
+    "o" #'paper-overview
 
     [remap evil-scroll-line-to-top] #'paper-scroll-to-page-start
     [remap evil-scroll-line-to-bottom] #'paper-scroll-to-page-end
 
     "W" #'paper-fit-width
     "H" #'paper-fit-height
+    "w" #'paper-fit-content-width
+    "T" #'paper-toggle-trim-margins
+    "P" #'paper-presentation-mode
 
     "y" #'paper-copy-selection
+    "gh" #'paper-highlight-selection
 
     "/" #'paper-search
+    "?" #'paper-search-regexp
+    "f" #'paper-jump-to-link
+    "F" #'paper-jump-to-word
+    "n" #'paper-search-next
+    "N" #'paper-search-prev
     ;; TODO binding to ESC doesn't work
     ;; (kbd "ESC") #'paper-deselect
 
@@ -77,6 +90,15 @@
     "a" #'ignore
     "A" #'ignore)
 
+  (evil-collection-define-key 'normal 'paper-presentation-mode-map
+    "j" #'paper-next-slide
+    "l" #'paper-next-slide
+    (kbd "SPC") #'paper-next-slide
+    "k" #'paper-prev-slide
+    "h" #'paper-prev-slide
+    (kbd "DEL") #'paper-prev-slide
+    "q" #'paper-presentation-mode)
+
   (when evil-want-C-d-scroll
     (evil-collection-define-key 'normal 'paper-mode-map
       (kbd "C-d") 'paper-scroll-window-down))
@@ -0,0 +1,207 @@
+#define _POSIX_C_SOURCE 200809L
+#include "journal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// bytes of the file copied or written between calls of the JournalProgress
+#define JOURNAL_CHUNK_SIZE (1 << 20)
+
+// Set ERROR from errno for failing to do WHAT to PATH, and return FALSE.
+static gboolean fail(GError **error, const char *what, const char *path) {
+  int err = errno;
+  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+              "cannot %s %s: %s", what, path, g_strerror(err));
+  return FALSE;
+}
+
+/*
+ * Return the path the journals of the document at DOC_PATH start with, next
+ * to it; each save adds a suffix of its own.
+ */
+char *journal_path(const char *doc_path) {
+  char *dir = g_path_get_dirname(doc_path);
+  char *base = g_path_get_basename(doc_path);
+  char *name = g_strconcat(".", base, ".paper-journal", NULL);
+  char *path = g_build_filename(dir, name, NULL);
+  g_free(name);
+  g_free(base);
+  g_free(dir);
+  return path;
+}
+
+static gboolean write_all(int fd, const char *data, gsize size,
+                          off_t offset) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return FALSE;
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return TRUE;
+}
+
+// Read SIZE bytes at OFFSET of FD into DATA, failing at the end of the file.
+static gboolean read_all(int fd, char *data, gsize size, off_t offset) {
+  while (size > 0) {
+    ssize_t n = pread(fd, data, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n == 0)
+        errno = EIO;
+      return FALSE;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return TRUE;
+}
+
+// Sync the directory of PATH, so that renaming or deleting PATH lasts.
+static gboolean sync_dir(const char *path) {
+  char *dir = g_path_get_dirname(path);
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  g_free(dir);
+  if (fd < 0)
+    return FALSE;
+  gboolean ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+static void file_from_stat(JournalFile *file, const struct stat *st) {
+  file->dev = st->st_dev;
+  file->ino = st->st_ino;
+  file->size = st->st_size;
+  file->mtime_ns =
+      (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/*
+ * Set FILE to what tells the document file at DOC_PATH apart, for
+ * journal_save. Return FALSE with ERROR set on failure.
+ */
+gboolean journal_stat(const char *doc_path, JournalFile *file,
+                      GError **error) {
+  struct stat st;
+  if (stat(doc_path, &st) != 0)
+    return fail(error, "stat", doc_path);
+  file_from_stat(file, &st);
+  return TRUE;
+}
+
+/*
+ * Replace the document at DOC_PATH with its first BASE bytes followed by
+ * SIZE bytes of DATA, through a journal, and set FILE to the new file. The
+ * document must still be FILE, as journal_stat or the last save left it, so
+ * that a file replaced by someone else since isn't taken for it. PROGRESS,
+ * unless NULL, is called with PROGRESS_DATA after each chunk but the last,
+ * whose end is only reported by returning. Return FALSE with ERROR set on
+ * failure, which leaves the document as it was.
+ */
+gboolean journal_save(const char *doc_path, JournalFile *file, goffset base,
+                      const void *data, gsize size, JournalProgress progress,
+                      void *progress_data, GError **error) {
+  int fd = open(doc_path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fail(error, "open", doc_path);
+    if (fd >= 0)
+      close(fd);
+    return FALSE;
+  }
+  JournalFile current;
+  file_from_stat(&current, &st);
+  if (current.dev != file->dev || current.ino != file->ino ||
+      current.size != file->size || current.mtime_ns != file->mtime_ns ||
+      base > st.st_size) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                "%s changed since it was opened", doc_path);
+    close(fd);
+    return FALSE;
+  }
+  char *path = journal_path(doc_path);
+  char *tmp = g_strconcat(path, ".XXXXXX", NULL);
+  g_free(path);
+  int out = g_mkstemp(tmp);
+  gboolean ok = out >= 0;
+  if (!ok)
+    fail(error, "create", tmp);
+  if (ok && fchmod(out, st.st_mode & 07777) != 0)
+    ok = fail(error, "set the mode of", tmp);
+  gsize total = base + size;
+  char *chunk = g_malloc(JOURNAL_CHUNK_SIZE);
+  for (gsize done = 0; ok && done < total;) {
+    gsize n = MIN(total - done, JOURNAL_CHUNK_SIZE);
+    const char *bytes = chunk;
+    if (done < (gsize)base) {
+      n = MIN(n, (gsize)base - done);
+      if (!read_all(fd, chunk, n, done)) {
+        ok = fail(error, "read", doc_path);
+        break;
+      }
+    } else {
+      bytes = (const char *)data + (done - base);
+    }
+    if (!write_all(out, bytes, n, done)) {
+      ok = fail(error, "write", tmp);
+      break;
+    }
+    done += n;
+    if (progress && done < total)
+      progress(done, total, progress_data);
+  }
+  g_free(chunk);
+  close(fd);
+  if (ok && fsync(out) != 0)
+    ok = fail(error, "sync", tmp);
+  if (ok && fstat(out, &st) != 0)
+    ok = fail(error, "stat", tmp);
+  if (out >= 0 && close(out) != 0 && ok)
+    ok = fail(error, "write", tmp);
+  // only a whole copy ever has the name of the document
+  if (ok && rename(tmp, doc_path) != 0)
+    ok = fail(error, "rename", tmp);
+  if (!ok && out >= 0)
+    unlink(tmp);
+  // the new file is in place, so FILE has to follow it even if this fails
+  if (ok) {
+    file_from_stat(file, &st);
+    if (!sync_dir(doc_path))
+      ok = fail(error, "sync the directory of", doc_path);
+  }
+  g_free(tmp);
+  return ok;
+}
+
+/*
+ * Delete the journals a crash left next to the document at DOC_PATH. The
+ * document itself is whole either way, as it's only ever replaced by a
+ * finished journal.
+ */
+void journal_recover(const char *doc_path) {
+  char *path = journal_path(doc_path);
+  char *dir_path = g_path_get_dirname(path);
+  char *prefix = g_path_get_basename(path);
+  GDir *dir = g_dir_open(dir_path, 0, NULL);
+  const char *name;
+  while (dir && (name = g_dir_read_name(dir))) {
+    if (g_str_has_prefix(name, prefix)) {
+      char *leftover = g_build_filename(dir_path, name, NULL);
+      unlink(leftover);
+      g_free(leftover);
+    }
+  }
+  if (dir)
+    g_dir_close(dir);
+  g_free(prefix);
+  g_free(dir_path);
+  g_free(path);
+}
@@ -0,0 +1,33 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+#include <glib.h>
+#include <stdint.h>
+
+/*
+ * An update to save to a document file. The journal of the save is a whole
+ * new copy of the file: the bytes it had when it was opened, then the
+ * update. The copy is written next to the file, synced to disk and only then
+ * renamed over it. A crash at any point leaves either the old file or the
+ * new one, and whoever has the old one open keeps reading it unchanged.
+ */
+
+// what tells a document file apart from one that replaced it
+typedef struct JournalFile {
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime_ns;
+} JournalFile;
+
+// called with the bytes written so far while a save is written
+typedef void (*JournalProgress)(gsize done, gsize total, void *data);
+
+char *journal_path(const char *doc_path);
+gboolean journal_stat(const char *doc_path, JournalFile *file,
+                      GError **error);
+gboolean journal_save(const char *doc_path, JournalFile *file, goffset base,
+                      const void *data, gsize size, JournalProgress progress,
+                      void *progress_data, GError **error);
+void journal_recover(const char *doc_path);
+
+#endif // JOURNAL_H_
@@ -1,5 +1,6 @@
 (define-module (ymarco packages paper-mode-test)
   #:use-module ((guix licenses) #:prefix license:)
+  #:use-module (gnu packages compression)
   #:use-module (gnu packages emacs-xyz)
   #:use-module (gnu packages gtk)
   #:use-module (gnu packages pdf)
@@ -23,7 +24,8 @@
                      #:recursive? #t))
  (inputs
   `(("mupdf" ,mupdf)
-    ("gtk+" ,gtk+)))
+    ("gtk+" ,gtk+)
+    ("zlib" ,zlib)))
  (native-inputs
   `(("pkg-config" ,pkg-config)))
  (propagated-inputs
@@ -3,6 +3,7 @@
 #include "emacs-module.h"
 #include "from-webkit.h"
 #include <gtk/gtk.h>
+#include <math.h>
 
 int plugin_is_GPL_compatible;
 
@@ -28,6 +29,55 @@ static gboolean paper_view_close(Client *c) {
   return TRUE;
 }
 
+static void paper_view_synctex_edit(GtkWidget *view, const char *file,
+                                    int line, Client *c) {
+  UNUSED(view);
+  char *message = g_strdup_printf("%d:%s", line, file);
+  send_to_lisp(c, "paper--synctex-edit", message);
+  g_free(message);
+}
+
+static void paper_view_counted_matches(GtkWidget *view, int matches,
+                                       int pages_done, int pages, Client *c) {
+  UNUSED(view);
+  char message[64];
+  snprintf(message, sizeof(message), "%d:%d:%d", matches, pages_done, pages);
+  send_to_lisp(c, "paper--counted-matches", message);
+}
+
+static void paper_view_text_exported(GtkWidget *view, int pages_done,
+                                     int pages, Client *c) {
+  UNUSED(view);
+  char message[64];
+  snprintf(message, sizeof(message), "%d:%d", pages_done, pages);
+  send_to_lisp(c, "paper--text-exported", message);
+}
+
+static void paper_view_save_progress(GtkWidget *view, int done, int total,
+                                     Client *c) {
+  UNUSED(view);
+  char message[32];
+  snprintf(message, sizeof(message), "%d:%d", done, total);
+  send_to_lisp(c, "paper--save-progress", message);
+}
+
+static void paper_view_save_failed(GtkWidget *view, const char *message,
+                                   Client *c) {
+  UNUSED(view);
+  send_to_lisp(c, "paper--save-failed", message);
+}
+
+static void paper_view_synctex_viewed(GtkWidget *view, gboolean shown,
+                                      Client *c) {
+  UNUSED(view);
+  send_to_lisp(c, "paper--synctex-viewed", shown ? "1" : "0");
+}
+
+static void paper_view_selection_copied(GtkWidget *view, Client *c) {
+  UNUSED(view);
+  send_to_lisp(c, "paper--selection-copied", "");
+}
+
 static emacs_value Fpaper_new(emacs_env *env, ptrdiff_t nargs,
                               emacs_value args[], void *data) {
   UNUSED(nargs);
@@ -50,8 +100,7 @@ static emacs_value Fpaper_new(emacs_env *env, ptrdiff_t nargs,
     return signal_memory_full(env);
   }
 
-  // TODO communicate back to lisp
-  /* c->fd = env->open_channel(env, channel); */
+  c->fd = env->open_channel(env, channel);
   if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
     return Qnil;
 
@@ -111,13 +160,24 @@ static emacs_value Fpaper_new(emacs_env *env, ptrdiff_t nargs,
     fprintf(stderr, "finished opening!\n");
   }
 
+  g_signal_connect(G_OBJECT(c->view), "synctex-edit",
+                   G_CALLBACK(paper_view_synctex_edit), c);
+  g_signal_connect(G_OBJECT(c->view), "counted-matches",
+                   G_CALLBACK(paper_view_counted_matches), c);
+  g_signal_connect(G_OBJECT(c->view), "text-exported",
+                   G_CALLBACK(paper_view_text_exported), c);
+  g_signal_connect(G_OBJECT(c->view), "save-progress",
+                   G_CALLBACK(paper_view_save_progress), c);
+  g_signal_connect(G_OBJECT(c->view), "save-failed",
+                   G_CALLBACK(paper_view_save_failed), c);
+  g_signal_connect(G_OBJECT(c->view), "synctex-viewed",
+                   G_CALLBACK(paper_view_synctex_viewed), c);
+  g_signal_connect(G_OBJECT(c->view), "selection-copied",
+                   G_CALLBACK(paper_view_selection_copied), c);
   // g_signal_connect (G_OBJECT (c->view), "destroy",
   //                  G_CALLBACK(webview_destroy), c);
   /* g_signal_connect(G_OBJECT(c->view), "close", G_CALLBACK(paper_view_close),
      c); */
-  /* g_signal_connect(webkit_web_view_get_find_controller(c->view), */
-  /*                  "counted-matches", */
-  /*                  G_CALLBACK(findcontroller_counted_matches), c) */;
 
   return env->make_user_ptr(env, client_free, (void *)c);
 }
@@ -165,6 +225,128 @@ emacs_value Fpaper_zoom_around_point(emacs_env *env, ptrdiff_t nargs,
   return Qnil;
 }
 
+emacs_value Fpaper_goto_page(emacs_env *env, ptrdiff_t nargs,
+                             emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  int n = env->extract_integer(env, args[1]);
+  goto_page(c->view, n);
+  return Qnil;
+}
+
+emacs_value Fpaper_current_page(emacs_env *env, ptrdiff_t nargs,
+                                emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return env->make_integer(env, get_current_page(c->view));
+}
+
+emacs_value Fpaper_page_count(emacs_env *env, ptrdiff_t nargs,
+                              emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return env->make_integer(env, get_page_count(c->view));
+}
+
+static cairo_status_t append_to_byte_array(void *closure,
+                                           const unsigned char *data,
+                                           unsigned int length) {
+  g_byte_array_append(closure, data, length);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+emacs_value Fpaper_thumbnail(emacs_env *env, ptrdiff_t nargs,
+                             emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  int n = env->extract_integer(env, args[1]);
+  cairo_surface_t *surface = get_thumbnail(c->view, n);
+  if (!surface)
+    return Qnil;
+  GByteArray *png = g_byte_array_new();
+  cairo_surface_write_to_png_stream(surface, append_to_byte_array, png);
+  emacs_value res =
+      env->make_unibyte_string(env, (const char *)png->data, png->len);
+  g_byte_array_free(png, TRUE);
+  return res;
+}
+
+emacs_value Fpaper_thumbnails_done(emacs_env *env, ptrdiff_t nargs,
+                                   emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return env->make_integer(env, get_thumbnails_done(c->view));
+}
+
+emacs_value Fpaper_position(emacs_env *env, ptrdiff_t nargs,
+                            emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return env->make_float(env, get_position(c->view));
+}
+
+emacs_value Fpaper_set_position(emacs_env *env, ptrdiff_t nargs,
+                                emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  double position = env->extract_float(env, args[1]);
+  set_position(c->view, position);
+  return Qnil;
+}
+
+emacs_value Fpaper_set_columns(emacs_env *env, ptrdiff_t nargs,
+                               emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  int columns = env->extract_integer(env, args[1]);
+  set_columns(c->view, columns, env->is_not_nil(env, args[2]));
+  return Qnil;
+}
+
+emacs_value Fpaper_set_presentation(emacs_env *env, ptrdiff_t nargs,
+                                    emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  set_presentation(c->view, env->is_not_nil(env, args[1]));
+  return Qnil;
+}
+
+emacs_value Fpaper_flip_slides(emacs_env *env, ptrdiff_t nargs,
+                               emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  int delta = env->extract_integer(env, args[1]);
+  flip_slides(c->view, delta);
+  return Qnil;
+}
+
+emacs_value Fpaper_missed_slides(emacs_env *env, ptrdiff_t nargs,
+                                 emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return env->make_integer(env, get_missed_slides(c->view));
+}
+
+emacs_value Fpaper_set_trim_margins(emacs_env *env, ptrdiff_t nargs,
+                                    emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  set_trim_margins(c->view, env->is_not_nil(env, args[1]));
+  return Qnil;
+}
+
 #define BIND_WIDGET(new_name, Fname)                                           \
   emacs_value new_name(emacs_env *env, ptrdiff_t nargs, emacs_value args[],    \
                        void *data) {                                           \
@@ -182,16 +364,28 @@ BIND_WIDGET(Fpaper_scroll_to_page_start, scroll_to_page_start);
 BIND_WIDGET(Fpaper_scroll_to_page_end, scroll_to_page_end);
 BIND_WIDGET(Fpaper_fit_width, fit_width);
 BIND_WIDGET(Fpaper_fit_height, fit_height);
+BIND_WIDGET(Fpaper_fit_content_width, fit_content_width);
 BIND_WIDGET(Fpaper_unset_selection, unset_selection);
 BIND_WIDGET(Fpaper_unset_search, unset_search);
+BIND_WIDGET(Fpaper_build_search_index, build_word_index);
+BIND_WIDGET(Fpaper_export_text, start_text_export);
+BIND_WIDGET(Fpaper_stop_text_export, stop_text_export);
 
-emacs_value Fpaper_get_selection(emacs_env *env, ptrdiff_t nargs,
-                                 emacs_value args[], void *data) {
+emacs_value Fpaper_copy_selection(emacs_env *env, ptrdiff_t nargs,
+                                  emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return start_selection_copy(c->view) ? Qt : Qnil;
+}
+
+emacs_value Fpaper_take_copied_selection(emacs_env *env, ptrdiff_t nargs,
+                                         emacs_value args[], void *data) {
   UNUSED(nargs);
   UNUSED(data);
   Client *c = env->get_user_ptr(env, args[0]);
   size_t len = 0;
-  char *sel = get_selection(c->view, &len);
+  char *sel = take_copied_selection(c->view, &len);
   if (!sel)
     return Qnil;
   emacs_value res = env->make_string(env, sel, len);
@@ -199,19 +393,266 @@ emacs_value Fpaper_get_selection(emacs_env *env, ptrdiff_t nargs,
   return res;
 }
 
+emacs_value Fpaper_selection_page_count(emacs_env *env, ptrdiff_t nargs,
+                                        emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return env->make_integer(env, get_selection_page_count(c->view));
+}
+
+emacs_value Fpaper_copy_selection_lazily(emacs_env *env, ptrdiff_t nargs,
+                                         emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return copy_selection_lazily(c->view) ? Qt : Qnil;
+}
+
+emacs_value Fpaper_highlight_selection(emacs_env *env, ptrdiff_t nargs,
+                                      emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return highlight_selection(c->view) ? Qt : Qnil;
+}
+
+emacs_value Fpaper_save(emacs_env *env, ptrdiff_t nargs, emacs_value args[],
+                        void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return save_document(c->view) ? Qt : Qnil;
+}
+
+emacs_value Fpaper_unsaved_edits_p(emacs_env *env, ptrdiff_t nargs,
+                                   emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  return has_unsaved_edits(c->view) ? Qt : Qnil;
+}
+
+emacs_value Fpaper_set_autosave_delay(emacs_env *env, ptrdiff_t nargs,
+                                      emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  double seconds = env->is_not_nil(env, args[1])
+                       ? env->extract_float(env, args[1])
+                       : 0.0;
+  set_autosave_delay(c->view, lround(seconds * 1000));
+  return Qnil;
+}
+
+// elements of each target in the vector of Fpaper_show_jump_labels
+#define JUMP_TARGET_FIELDS 7
+
+emacs_value Fpaper_show_jump_labels(emacs_env *env, ptrdiff_t nargs,
+                                    emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  int kinds = 0;
+  if (env->is_not_nil(env, args[1]))
+    kinds |= JUMP_LINKS;
+  if (env->is_not_nil(env, args[2]))
+    kinds |= JUMP_WORDS;
+  char keys[256];
+  ptrdiff_t len = sizeof(keys);
+  if (!env->copy_string_contents(env, args[3], keys, &len))
+    return Qnil;
+  const JumpTarget *targets;
+  int count = show_jump_labels(c->view, kinds, keys, &targets);
+  emacs_value size[] = {env->make_integer(env, count * JUMP_TARGET_FIELDS),
+                        Qnil};
+  emacs_value res = env->funcall(env, env->intern(env, "make-vector"), 2, size);
+  emacs_value Qlink = env->intern(env, "link");
+  emacs_value Qword = env->intern(env, "word");
+  for (int i = 0; i < count; i++) {
+    const JumpTarget *t = &targets[i];
+    emacs_value fields[JUMP_TARGET_FIELDS] = {
+        env->make_string(env, t->label, strlen(t->label)),
+        t->kind == JUMP_LINKS ? Qlink : Qword,
+        env->make_integer(env, t->n),
+        env->make_integer(env, lroundf(t->screen.x0)),
+        env->make_integer(env, lroundf(t->screen.y0)),
+        env->make_integer(env, lroundf(t->screen.x1)),
+        env->make_integer(env, lroundf(t->screen.y1))};
+    for (int j = 0; j < JUMP_TARGET_FIELDS; j++)
+      env->vec_set(env, res, i * JUMP_TARGET_FIELDS + j, fields[j]);
+  }
+  return res;
+}
+
+emacs_value Fpaper_narrow_jump_labels(emacs_env *env, ptrdiff_t nargs,
+                                      emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  char prefix[JUMP_LABEL_MAX];
+  ptrdiff_t len = sizeof(prefix);
+  if (!env->copy_string_contents(env, args[1], prefix, &len))
+    return Qnil;
+  return env->make_integer(env, narrow_jump_labels(c->view, prefix));
+}
+
+emacs_value Fpaper_jump_to_target(emacs_env *env, ptrdiff_t nargs,
+                                  emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  int i = env->extract_integer(env, args[1]);
+  return jump_to_target(c->view, i) ? Qt : Qnil;
+}
+
+BIND_WIDGET(Fpaper_hide_jump_labels, hide_jump_labels);
+
 emacs_value Fpaper_set_search(emacs_env *env, ptrdiff_t nargs,
                               emacs_value args[], void *data) {
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  ptrdiff_t len = 0;
+  env->copy_string_contents(env, args[1], NULL, &len);
+  char *needle = malloc(len);
+  if (!needle)
+    return signal_memory_full(env);
+  env->copy_string_contents(env, args[1], needle, &len);
+  int flags = 0;
+  if (nargs > 2 && env->is_not_nil(env, args[2]))
+    flags |= SEARCH_REGEX;
+  if (nargs > 3 && env->is_not_nil(env, args[3]))
+    flags |= SEARCH_MATCH_CASE;
+  if (nargs > 4 && env->is_not_nil(env, args[4]))
+    flags |= SEARCH_MATCH_DIACRITICS;
+  GError *error = NULL;
+  if (!set_search(c->view, needle, flags, &error)) {
+    emacs_value message =
+        env->make_string(env, error->message, strlen(error->message));
+    env->non_local_exit_signal(
+        env, env->intern(env, "invalid-regexp"),
+        env->funcall(env, env->intern(env, "list"), 1, &message));
+    g_error_free(error);
+  }
+  free(needle);
+  return Qnil;
+}
+
+emacs_value Fpaper_goto_match(emacs_env *env, ptrdiff_t nargs,
+                              emacs_value args[], void *data) {
   UNUSED(nargs);
   UNUSED(data);
   Client *c = env->get_user_ptr(env, args[0]);
-  emacs_value e_needle = args[1];
-  char needle[PATH_MAX];
+  int delta = env->extract_integer(env, args[1]);
+  int number = goto_match(c->view, delta);
+  return number ? env->make_integer(env, number) : Qnil;
+}
+
+emacs_value Fpaper_search_index_status(emacs_env *env, ptrdiff_t nargs,
+                                      emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  int pages_done;
+  size_t size;
+  if (!get_word_index_status(c->view, &pages_done, &size))
+    return Qnil;
+  emacs_value fields[] = {env->make_integer(env, pages_done),
+                          env->make_integer(env, get_page_count(c->view)),
+                          env->make_integer(env, size)};
+  return env->funcall(env, env->intern(env, "list"), 3, fields);
+}
+
+emacs_value Fpaper_take_exported_text(emacs_env *env, ptrdiff_t nargs,
+                                      emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  size_t len;
+  int pages_done, pages;
+  char *text = take_exported_text(c->view, &len, &pages_done, &pages);
+  if (!text)
+    return Qnil;
+  emacs_value fields[] = {env->make_string(env, text, len),
+                          env->make_integer(env, pages_done),
+                          env->make_integer(env, pages)};
+  g_free(text);
+  return env->funcall(env, env->intern(env, "list"), 3, fields);
+}
+
+emacs_value Fpaper_synctex_view(emacs_env *env, ptrdiff_t nargs,
+                                emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  char file[PATH_MAX];
   ptrdiff_t len = PATH_MAX;
-  env->copy_string_contents(env, e_needle, needle, &len);
-  set_search(c->view, needle);
+  if (!env->copy_string_contents(env, args[1], file, &len))
+    return Qnil;
+  int line = env->extract_integer(env, args[2]);
+  switch (synctex_forward(c->view, file, line)) {
+  case SYNCTEX_VIEW_SHOWN:
+    return Qt;
+  case SYNCTEX_VIEW_PENDING:
+    return env->intern(env, "pending");
+  default:
+    return Qnil;
+  }
+}
+
+emacs_value Fpaper_set_predecode_share(emacs_env *env, ptrdiff_t nargs,
+                                      emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  double share = env->extract_float(env, args[1]);
+  set_predecode_share(c->view, share);
   return Qnil;
 }
 
+emacs_value Fpaper_set_document_instances(emacs_env *env, ptrdiff_t nargs,
+                                          emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  int n = env->extract_integer(env, args[1]);
+  set_doc_instances(c->view, n);
+  return Qnil;
+}
+
+emacs_value Fpaper_set_render_threads(emacs_env *env, ptrdiff_t nargs,
+                                     emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  int n = env->is_not_nil(env, args[0]) ? env->extract_integer(env, args[0])
+                                         : 0;
+  set_render_threads(n);
+  return Qnil;
+}
+
+BIND_WIDGET(Fpaper_focus, set_focused_view);
+BIND_WIDGET(Fpaper_reset_lock_stats, reset_lock_stats);
+
+emacs_value Fpaper_lock_stats(emacs_env *env, ptrdiff_t nargs,
+                              emacs_value args[], void *data) {
+  UNUSED(nargs);
+  UNUSED(data);
+  Client *c = env->get_user_ptr(env, args[0]);
+  LockStats stats[FZ_LOCK_MAX];
+  get_lock_stats(c->view, stats);
+  emacs_value Qlist = env->intern(env, "list");
+  emacs_value locks[FZ_LOCK_MAX];
+  for (int i = 0; i < FZ_LOCK_MAX; i++) {
+    emacs_value fields[] = {
+        env->intern(env, LOCK_NAMES[i]),
+        env->make_integer(env, stats[i].acquisitions),
+        env->make_integer(env, stats[i].contended),
+        env->make_float(env, stats[i].wait_us / (double)G_USEC_PER_SEC)};
+    locks[i] = env->funcall(env, Qlist, 4, fields);
+  }
+  return env->funcall(env, Qlist, FZ_LOCK_MAX, locks);
+}
+
 static void mkfn(emacs_env *env, ptrdiff_t min_arity, ptrdiff_t max_arity,
                  emacs_value (*func)(emacs_env *env, ptrdiff_t nargs,
                                      emacs_value *args, void *data),
@@ -228,6 +669,7 @@ int emacs_module_init(struct emacs_runtime *ert) {
 
   // Symbols
   Qnil = env->make_global_ref(env, env->intern(env, "nil"));
+  Qt = env->make_global_ref(env, env->intern(env, "t"));
   Qfset = env->make_global_ref(env, env->intern(env, "fset"));
   Qprovide = env->make_global_ref(env, env->intern(env, "provide"));
   Qargs_out_of_range =
@@ -251,12 +693,132 @@ int emacs_module_init(struct emacs_runtime *ert) {
   mkfn(env, 1, 1, Fpaper_scroll_to_page_end, "paper--scroll-to-page-end", "");
   mkfn(env, 1, 1, Fpaper_fit_width, "paper--fit-width", "");
   mkfn(env, 1, 1, Fpaper_fit_height, "paper--fit-height", "");
-  mkfn(env, 1, 1, Fpaper_get_selection, "paper--get-selection", "");
+  mkfn(env, 1, 1, Fpaper_fit_content_width, "paper--fit-content-width", "");
+  mkfn(env, 2, 2, Fpaper_set_trim_margins, "paper--set-trim-margins",
+       "Show only the content of pages if TRIM is non-nil.\n\n"
+       "\\fn(ID TRIM)");
+  mkfn(env, 1, 1, Fpaper_copy_selection, "paper--copy-selection",
+       "Start extracting the text of the selection in the background.\n"
+       "`paper--selection-copied' is called when it's ready for\n"
+       "`paper--take-copied-selection'. Return nil if there's no selection.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_take_copied_selection,
+       "paper--take-copied-selection",
+       "Return the text `paper--copy-selection' extracted, or nil if none.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_selection_page_count, "paper--selection-page-count",
+       "Return the number of pages the selection spans, 0 if none.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_copy_selection_lazily,
+       "paper--copy-selection-lazily",
+       "Offer the selection to the clipboard, extracting it only once it's\n"
+       "pasted. Return nil if there's no selection.\n\n"
+       "\\fn(ID)");
   mkfn(env, 1, 1, Fpaper_unset_selection, "paper--unset-selection", "");
+  mkfn(env, 1, 1, Fpaper_highlight_selection, "paper--highlight-selection",
+       "Add a highlight annotation of the selection and clear it. Return nil\n"
+       "if there's no selection, or if the document isn't a PDF.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_save, "paper--save",
+       "Append the edits of the document to its file in the background.\n"
+       "Progress goes to `paper--save-progress', and failures to\n"
+       "`paper--save-failed'. Return nil if there's nothing to save.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_unsaved_edits_p, "paper--unsaved-edits-p",
+       "\\fn(ID)");
+  mkfn(env, 2, 2, Fpaper_set_autosave_delay, "paper--set-autosave-delay",
+       "Save edits SECONDS after the last one, or never if it's nil.\n\n"
+       "\\fn(ID SECONDS)");
+  mkfn(env, 4, 4, Fpaper_show_jump_labels, "paper--show-jump-labels",
+       "Label the links in view if LINKS is non-nil, and the words if WORDS\n"
+       "is, with strings of the characters of KEYS. Return a vector of\n"
+       "LABEL KIND PAGE X0 Y0 X1 Y1 for each, in page order, where KIND is\n"
+       "`link' or `word' and the box is in pixels of the view.\n\n"
+       "\\fn(ID LINKS WORDS KEYS)");
+  mkfn(env, 2, 2, Fpaper_narrow_jump_labels, "paper--narrow-jump-labels",
+       "Show only the jump labels starting with PREFIX. Return how many do.\n\n"
+       "\\fn(ID PREFIX)");
+  mkfn(env, 2, 2, Fpaper_jump_to_target, "paper--jump-to-target",
+       "Hide the jump labels and follow the Nth link, or select the Nth\n"
+       "word, of `paper--show-jump-labels'.\n\n"
+       "\\fn(ID N)");
+  mkfn(env, 1, 1, Fpaper_hide_jump_labels, "paper--hide-jump-labels", "");
   mkfn(env, 1, 1, Fpaper_unset_search, "paper--unset-search", "");
-  mkfn(env, 2, 2, Fpaper_set_search, "paper--set-search", "");
+  mkfn(env, 2, 5, Fpaper_set_search, "paper--set-search",
+       "Search for NEEDLE, as a regex if REGEXP is non-nil. Case and\n"
+       "diacritics are ignored unless MATCH-CASE and MATCH-DIACRITICS are.\n\n"
+       "\\fn(ID NEEDLE &optional REGEXP MATCH-CASE MATCH-DIACRITICS)");
+  mkfn(env, 2, 2, Fpaper_goto_match, "paper--goto-match",
+       "Go to the DELTA'th next match of the search, previous if negative.\n"
+       "Return the number of the match, or nil if none were found yet.\n\n"
+       "\\fn(ID DELTA)");
+  mkfn(env, 1, 1, Fpaper_export_text, "paper--export-text",
+       "Hand out the text of every page, in order. `paper--text-exported' is\n"
+       "called when there's text for `paper--take-exported-text'.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_stop_text_export, "paper--stop-text-export",
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_take_exported_text, "paper--take-exported-text",
+       "Return (TEXT PAGES-DONE PAGES) with the text exported since the last\n"
+       "call, or nil if there's none.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_build_search_index, "paper--build-search-index",
+       "Map the word index of the document, or start building it.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_search_index_status, "paper--search-index-status",
+       "Return (PAGES-INDEXED PAGES SIZE) of the word index, or nil.\n"
+       "SIZE is the size of its file in bytes, 0 until it's done.\n\n"
+       "\\fn(ID)");
   mkfn(env, 4, 4, Fpaper_zoom_around_point, "paper--zoom-around-point",
        "\\fn(id mult x y)");
+  mkfn(env, 2, 2, Fpaper_goto_page, "paper--goto-page",
+       "Go to page N, counting from 0.\n\n\\fn(ID N)");
+  mkfn(env, 1, 1, Fpaper_current_page, "paper--current-page",
+       "Return the number of the current page, counting from 0.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_page_count, "paper--page-count", "\\fn(ID)");
+  mkfn(env, 2, 2, Fpaper_thumbnail, "paper--thumbnail",
+       "Return the thumbnail of page N as PNG data, or nil if it isn't\n"
+       "ready yet. The first call starts making the thumbnails of all pages.\n\n"
+       "\\fn(ID N)");
+  mkfn(env, 1, 1, Fpaper_thumbnails_done, "paper--thumbnails-done",
+       "Return the number of pages whose thumbnails are done.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_position, "paper--position",
+       "Return how far down the document the view is, between 0 and 1.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 2, 2, Fpaper_set_position, "paper--set-position",
+       "\\fn(ID POSITION)");
+  mkfn(env, 3, 3, Fpaper_set_columns, "paper--set-columns",
+       "Lay out pages in rows of N pages, as book spreads if BOOK.\n\n"
+       "\\fn(ID N BOOK)");
+  mkfn(env, 2, 2, Fpaper_set_presentation, "paper--set-presentation",
+       "Show one page at a time fitted to the view if ACTIVE is non-nil.\n\n"
+       "\\fn(ID ACTIVE)");
+  mkfn(env, 2, 2, Fpaper_flip_slides, "paper--flip-slides",
+       "Go DELTA slides forward, or back if it's negative.\n\n"
+       "\\fn(ID DELTA)");
+  mkfn(env, 1, 1, Fpaper_missed_slides, "paper--missed-slides",
+       "Return the number of flips to slides that weren't rendered yet.\n\n"
+       "\\fn(ID)");
+  mkfn(env, 3, 3, Fpaper_synctex_view, "paper--synctex-view",
+       "Show where LINE of the TeX input FILE went, according to SyncTeX.\n"
+       "Return nil if the document has no SyncTeX data for FILE, or\n"
+       "`pending' if its SyncTeX file is being read again, after which\n"
+       "`paper--synctex-viewed' is called.\n\n"
+       "\\fn(ID FILE LINE)");
+  mkfn(env, 2, 2, Fpaper_set_predecode_share, "paper--set-predecode-share",
+       "\\fn(ID SHARE)");
+  mkfn(env, 2, 2, Fpaper_set_document_instances,
+       "paper--set-document-instances", "\\fn(ID N)");
+  mkfn(env, 1, 1, Fpaper_set_render_threads, "paper--set-render-threads",
+       "\\fn(N)");
+  mkfn(env, 1, 1, Fpaper_focus, "paper--focus", "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_lock_stats, "paper--lock-stats",
+       "Return a list of (LOCK ACQUISITIONS CONTENDED WAIT-SECONDS).\n\n"
+       "\\fn(ID)");
+  mkfn(env, 1, 1, Fpaper_reset_lock_stats, "paper--reset-lock-stats",
+       "\\fn(ID)");
 
   // done
   provide(env, "paper-module");
@@ -27,6 +27,65 @@
 (require 'paper-module)
 ;; (module-load (concat default-directory "paper-module.so"))
 
+(defgroup paper nil
+  "Paper document viewing mode."
+  :group 'multimedia)
+
+(defcustom paper-image-predecode-share 0.25
+  "Fraction of mupdf's cache that images of upcoming pages may be decoded into.
+Set to 0 to only decode images when their page is rendered."
+  :type 'float)
+
+(defcustom paper-document-instances 1
+  "Number of extra handles of the document used to load pages in parallel.
+Each one is parsed independently, so more of them load pages faster on
+machines with many cores, at the cost of memory.  Set to 0 to load pages
+only when they're displayed."
+  :type 'integer)
+
+(defcustom paper-render-threads nil
+  "Number of threads rendering pages, shared by all Paper buffers.
+nil means one per processor."
+  :type '(choice (const :tag "One per processor" nil) integer)
+  :set (lambda (symbol value)
+         (set-default symbol value)
+         (when (fboundp 'paper--set-render-threads)
+           (paper--set-render-threads value))))
+
+(defcustom paper-search-index nil
+  "Whether to narrow searches down with an index of the words of documents.
+The index is built in the background from the text of every page the first
+time a document is opened, and kept in the cache directory of the document
+for the next times."
+  :type 'boolean)
+
+(defcustom paper-search-case-fold t
+  "Whether searches ignore case.
+Ligatures are always matched by the letters they stand for."
+  :type 'boolean)
+
+(defcustom paper-search-diacritics-fold t
+  "Whether searches ignore diacritics, so that \"e\" matches \"é\"."
+  :type 'boolean)
+
+(defcustom paper-lazy-copy-pages 20
+  "Number of pages above which copied selections aren't extracted at once.
+Longer selections are only offered to the clipboard, and their text is
+extracted when it's pasted, instead of going into the kill ring.  nil
+means always put the text in the kill ring."
+  :type '(choice (const :tag "Never" nil) integer))
+
+(defcustom paper-jump-keys "asdfghjkl"
+  "Characters the labels of `paper-jump-to-link' and `paper-jump-to-word' use.
+All labels are equally long, so fewer characters make longer labels."
+  :type 'string)
+
+(defcustom paper-autosave-delay 2
+  "Seconds after the last edit of a document, such as a highlight, to save it.
+Edits are appended to the file in the background, in a new copy of it
+that replaces it once it's complete.  nil means only save them with
+`paper-save'."
+  :type '(choice (const :tag "Never" nil) number))
 
 (defvar-local paper--id nil
   "User-pointer of the PaperView Client for the current buffer.")
@@ -57,6 +116,9 @@
                    (hide-windows (remq show-window windows))
                    (show-frame (window-frame show-window)))
               (paper--move-to-x-or-pgtk-frame show-frame)
+              (when (eq show-window (selected-window))
+                ;; render this buffer's pages before those of the others
+                (paper--focus paper--id))
               (cl-destructuring-bind (left top right bottom)
                   (window-inside-pixel-edges show-window)
                 (paper--show paper--id)
@@ -85,6 +147,23 @@
         (with-current-buffer buffer
           (paper--move-to-x-or-pgtk-frame new-frame))))))
 
+(defun paper--filter (process string)
+  "Run the messages PaperView sends through PROCESS as they arrive.
+A message is the name of a function and its argument, each followed by
+a null byte.  The function is called in the Paper buffer of PROCESS."
+  (let ((buffer (process-get process 'paper-buffer)))
+    (with-current-buffer (process-buffer process)
+      (goto-char (point-max))
+      (insert string)
+      (goto-char (point-min))
+      (while (re-search-forward "\\([^\0]*\\)\0\\([^\0]*\\)\0" nil t)
+        (let ((function (intern (match-string 1)))
+              (argument (match-string 2)))
+          (delete-region (point-min) (point))
+          (when (and (fboundp function) (buffer-live-p buffer))
+            (with-current-buffer buffer
+              (funcall function argument))))))))
+
 (defmacro paper--bind-id (new-name mod-func-name &rest args)
   `(defun ,new-name ()
      (interactive)
@@ -120,21 +199,456 @@
 (paper--bind-same scroll-to-page-end)
 (paper--bind-same fit-height)
 (paper--bind-same fit-width)
+(paper--bind-same fit-content-width)
 
 (defun paper-copy-selection ()
+  "Copy the selected text.
+See `paper-lazy-copy-pages' for long selections."
+  (interactive)
+  (let ((pages (paper--selection-page-count paper--id))
+        (message-log-max nil))
+    (cond ((and paper-lazy-copy-pages (> pages paper-lazy-copy-pages)
+                (paper--copy-selection-lazily paper--id))
+           (message "Copied %d pages to the clipboard" pages))
+          ((paper--copy-selection paper--id)
+           (message "Copying...")))))
+
+(defun paper--selection-copied (_message)
+  "Put the text `paper-copy-selection' extracted in the kill ring."
+  (let ((text (paper--take-copied-selection paper--id))
+        (message-log-max nil))
+    (when text
+      (kill-new text)
+      (message "Copied!"))))
+
+(defun paper-highlight-selection ()
+  "Highlight the selected text with an annotation."
+  (interactive)
+  (unless (paper--highlight-selection paper--id)
+    (message "Nothing to highlight")))
+
+(defun paper-save ()
+  "Append the edits of the document, such as highlights, to its file.
+The file is written in the background; the mode line shows how far."
   (interactive)
-  (kill-new (paper--get-selection paper--id))
-  (let ((message-log-max nil))
-    (message "Copied!")))
+  (unless (paper--save paper--id)
+    (message "(No changes need to be saved)")))
+
+(defun paper--save-progress (message)
+  "Show how far saving the document got in the mode line.
+MESSAGE is \"BYTES-DONE:BYTES\"."
+  (when (string-match "\\`\\([0-9]+\\):\\([0-9]+\\)\\'" message)
+    (let ((done (string-to-number (match-string 1 message)))
+          (total (string-to-number (match-string 2 message))))
+      (setq mode-line-process
+            (when (< done total)
+              (format " [saving %d%%]" (/ (* 100 done) total))))
+      (force-mode-line-update))))
+
+(defun paper--save-failed (message)
+  "Warn that saving the document failed because of MESSAGE."
+  (setq mode-line-process nil)
+  (force-mode-line-update)
+  (display-warning 'paper (format "Cannot save %s: %s"
+                                  buffer-file-name message)
+                   :error))
+
+(defun paper--query-unsaved-edits ()
+  "Offer to save the edits of the document before its buffer is killed.
+They're saved without asking if `paper-autosave-delay' is non-nil."
+  (when (and (paper--unsaved-edits-p paper--id)
+             (or paper-autosave-delay
+                 (y-or-n-p (format "Save the edits of %s? " (buffer-name)))))
+    (paper--save paper--id))
+  t)
+
+(defvar-local paper--match-count 0
+  "Number of matches the search of the document found so far.")
 
-(defun paper-search (needle)
+(defun paper--counted-matches (message)
+  "Show how far the search of the document got in the mode line.
+MESSAGE is \"MATCHES:PAGES-SEARCHED:PAGES\"."
+  (when (string-match "\\`\\([0-9]+\\):\\([0-9]+\\):\\([0-9]+\\)\\'"
+                      message)
+    (let ((matches (string-to-number (match-string 1 message)))
+          (done (string-to-number (match-string 2 message)))
+          (pages (string-to-number (match-string 3 message))))
+      (setq paper--match-count matches
+            mode-line-process
+            (if (< done pages)
+                (format " [%d matches, %d%%]" matches (/ (* 100 done) pages))
+              (format " [%d matches]" matches)))
+      (force-mode-line-update))))
+
+(defun paper-search (needle &optional regexp)
+  "Highlight the matches of NEEDLE, a regexp if REGEXP is non-nil.
+See `paper-search-case-fold' and `paper-search-diacritics-fold'."
   (interactive "Msearch: ")
-  (paper--set-search paper--id needle))
+  (paper--set-search paper--id needle regexp
+                     (not paper-search-case-fold)
+                     (not paper-search-diacritics-fold)))
+
+(defun paper-search-regexp (regexp)
+  "Highlight the matches of the Perl-compatible REGEXP."
+  (interactive "Mregexp search: ")
+  (paper-search regexp t))
+
+(defun paper-search-next (&optional n)
+  "Go to the Nth next match of the search."
+  (interactive "p")
+  (let ((match (paper--goto-match paper--id (or n 1))))
+    (unless match
+      (user-error "No matches"))
+    (message "Match %d of %d" match paper--match-count)))
+
+(defun paper-search-prev (&optional n)
+  "Go to the Nth previous match of the search."
+  (interactive "p")
+  (paper-search-next (- (or n 1))))
+
+(defvar-local paper--text-buffer nil
+  "Buffer `paper-text-view' fills with the text of the document.")
+
+(defvar-local paper--source-buffer nil
+  "Paper buffer whose text `paper-text-view' shows in this buffer.")
+
+(defun paper-text-view ()
+  "Show the text of the document in a buffer of its own.
+The text is extracted in the background and fills the buffer page by
+page.  Pages end with a form feed, so `forward-page' goes through them."
+  (interactive)
+  (let ((paper-buffer (current-buffer))
+        (buffer (get-buffer-create (format "*%s text*" (buffer-name)))))
+    (with-current-buffer buffer
+      (let ((inhibit-read-only t))
+        (erase-buffer))
+      (text-mode)
+      (setq buffer-read-only t
+            paper--source-buffer paper-buffer)
+      (add-hook 'kill-buffer-hook #'paper--text-buffer-killed nil t))
+    (setq paper--text-buffer buffer)
+    (paper--export-text paper--id)
+    (pop-to-buffer buffer)))
+
+(defun paper--text-buffer-killed ()
+  (when (buffer-live-p paper--source-buffer)
+    (with-current-buffer paper--source-buffer
+      (paper--stop-text-export paper--id)
+      (setq paper--text-buffer nil))))
+
+(defun paper--text-exported (_message)
+  "Append the pages exported so far to the text view.
+MESSAGE, \"DONE:PAGES\", only says that there's text to take."
+  (pcase (paper--take-exported-text paper--id)
+    ((and `(,text ,done ,pages)
+          (guard (buffer-live-p paper--text-buffer)))
+     (with-current-buffer paper--text-buffer
+       (let ((inhibit-read-only t))
+         (save-excursion
+           (goto-char (point-max))
+           (insert text)))
+       (setq mode-line-process
+             (when (< done pages)
+               (format " [%d%%]" (/ (* 100 done) pages))))
+       (force-mode-line-update)))))
+
+(defun paper-search-index-status ()
+  "Show how far the word index of the document is."
+  (interactive)
+  (pcase (paper--search-index-status paper--id)
+    ('nil (message "No search index"))
+    (`(,done ,pages 0)
+     (message "Indexing words: %d of %d pages" done pages))
+    (`(,_ ,pages ,size)
+     (message "Search index: %s for %d pages"
+              (file-size-human-readable size) pages))))
 
 (defun paper-deselect ()
   (interactive)
   (paper--unset-selection paper--id)
-  (paper--unset-search paper--id))
+  (paper--unset-search paper--id)
+  (setq mode-line-process nil)
+  (force-mode-line-update))
+
+(defconst paper--jump-target-fields 7
+  "Elements of each target in the vector of `paper--show-jump-labels'.")
+
+(defun paper--jump (links words)
+  "Label the LINKS or WORDS in view and go to the one whose label is typed.
+Return nil if there's nothing to jump to."
+  (let* ((targets (paper--show-jump-labels paper--id links words
+                                           paper-jump-keys))
+         (matches (number-sequence
+                   0 (1- (/ (length targets) paper--jump-target-fields))))
+         (typed "")
+         jumped)
+    (unwind-protect
+        (progn
+          (while (cdr matches)
+            (setq typed (concat typed (string (read-char-exclusive
+                                               (format "Jump to: %s" typed)))))
+            (paper--narrow-jump-labels paper--id typed)
+            (setq matches
+                  (cl-remove-if-not
+                   (lambda (i)
+                     (string-prefix-p
+                      typed (aref targets (* i paper--jump-target-fields))))
+                   matches)))
+          (when matches
+            (setq jumped (paper--jump-to-target paper--id (car matches)))))
+      (unless jumped
+        (paper--hide-jump-labels paper--id)))
+    (or jumped (/= (length targets) 0))))
+
+(defun paper-jump-to-link ()
+  "Follow a link in view by typing the label drawn over it."
+  (interactive)
+  (unless (paper--jump t nil)
+    (message "No links in view")))
+
+(defun paper-jump-to-word ()
+  "Select a word in view by typing the label drawn over it."
+  (interactive)
+  (unless (paper--jump nil t)
+    (message "No words in view")))
+
+(defun paper-goto-page (page)
+  "Go to PAGE, counting from 1.
+Interactively, PAGE is the prefix argument or read from the minibuffer."
+  (interactive
+   (list (if current-prefix-arg
+             (prefix-numeric-value current-prefix-arg)
+           (read-number (format "Go to page (1-%d): "
+                                (paper--page-count paper--id))
+                        (1+ (paper--current-page paper--id))))))
+  (paper--goto-page paper--id (1- page)))
+
+(defun paper-page-number ()
+  "Show the number of the current page."
+  (interactive)
+  (message "Page %d of %d"
+           (1+ (paper--current-page paper--id))
+           (paper--page-count paper--id)))
+
+(defun paper-goto-percent (percent)
+  "Scroll to PERCENT of the way through the document.
+Interactively, PERCENT is the prefix argument or read from the minibuffer."
+  (interactive
+   (list (if current-prefix-arg
+             (prefix-numeric-value current-prefix-arg)
+           (read-number "Go to percent: "
+                        (round (* 100 (paper--position paper--id)))))))
+  (paper--set-position paper--id (/ (min (max percent 0) 100) 100.0)))
+
+(defvar-local paper--trim-margins nil
+  "Whether the margins of pages are hidden.")
+
+(defun paper-toggle-trim-margins ()
+  "Toggle showing only the content of pages, without their margins."
+  (interactive)
+  (setq paper--trim-margins (not paper--trim-margins))
+  (paper--set-trim-margins paper--id paper--trim-margins))
+
+(defun paper-set-columns (columns)
+  "Show COLUMNS pages side by side, 1 by default.
+Interactively, COLUMNS is the prefix argument."
+  (interactive "p")
+  (paper--set-columns paper--id columns nil))
+
+(defun paper-book-spread ()
+  "Show facing pages side by side, with the first page on its own."
+  (interactive)
+  (paper--set-columns paper--id 2 t))
+
+;;; Page overview
+
+(defvar-local paper--overview-source nil
+  "The `paper-mode' buffer whose pages an overview buffer shows.")
+
+(defvar-local paper--overview-shown 0
+  "Number of pages whose thumbnails are shown in an overview buffer.")
+
+(defvar-local paper--overview-timer nil
+  "Timer showing thumbnails as they're made.")
+
+(defvar paper-overview-mode-map
+  (let ((map (make-sparse-keymap)))
+    (define-key map (kbd "RET") #'paper-overview-goto-page)
+    (define-key map [mouse-1] #'paper-overview-goto-page)
+    map)
+  "Keymap for `paper-overview-mode'.")
+
+(define-derived-mode paper-overview-mode special-mode "Paper-Overview"
+  "Thumbnails of the pages of a document."
+  (add-hook 'kill-buffer-hook
+            (lambda () (when paper--overview-timer
+                         (cancel-timer paper--overview-timer)))
+            nil t))
+
+(defun paper--overview-update (buffer)
+  "Show the thumbnails made since the last update in overview BUFFER."
+  (when (buffer-live-p buffer)
+    (with-current-buffer buffer
+      (let* ((id (buffer-local-value 'paper--id paper--overview-source))
+             (done (paper--thumbnails-done id))
+             (pos (point-min))
+             (inhibit-read-only t))
+        (while (< paper--overview-shown done)
+          (setq pos (text-property-any pos (point-max)
+                                       'paper-page paper--overview-shown))
+          (let ((png (paper--thumbnail id paper--overview-shown))
+                (end (next-single-property-change pos 'paper-page nil
+                                                  (point-max))))
+            (when png
+              (put-text-property pos end 'display
+                                 (create-image png 'png t :margin 4)))
+            (setq pos end))
+          (cl-incf paper--overview-shown))
+        (when (and (= done (paper--page-count id)) paper--overview-timer)
+          (cancel-timer paper--overview-timer)
+          (setq paper--overview-timer nil))))))
+
+(defun paper-overview ()
+  "Show thumbnails of all pages; select one to go to it."
+  (interactive)
+  (let* ((source (current-buffer))
+         (id paper--id)
+         (buffer (get-buffer-create
+                  (format "*Paper overview: %s*" (buffer-name)))))
+    (with-current-buffer buffer
+      (let ((inhibit-read-only t))
+        (paper-overview-mode)
+        (erase-buffer)
+        (setq paper--overview-source source
+              paper--overview-shown 0)
+        (dotimes (n (paper--page-count id))
+          (insert (propertize (format "[%d]" (1+ n)) 'paper-page n) " "))
+        (goto-char (text-property-any (point-min) (point-max) 'paper-page
+                                      (paper--current-page id)))
+        (paper--thumbnail id 0)
+        (setq paper--overview-timer
+              (run-with-timer 0 0.5 #'paper--overview-update buffer))))
+    (pop-to-buffer buffer)))
+
+(defun paper-overview-goto-page (&optional event)
+  "Go to the page at point, or the one clicked on with EVENT."
+  (interactive (list last-nonmenu-event))
+  (when (mouse-event-p event)
+    (posn-set-point (event-start event)))
+  (let ((page (get-text-property (point) 'paper-page))
+        (source paper--overview-source))
+    (when page
+      (quit-window)
+      (pop-to-buffer-same-window source)
+      (paper--goto-page paper--id page))))
+
+;;; Presentation
+
+(defun paper-next-slide (n)
+  "Go N slides forward in `paper-presentation-mode'."
+  (interactive "p")
+  (paper--flip-slides paper--id n))
+
+(defun paper-prev-slide (n)
+  "Go N slides back in `paper-presentation-mode'."
+  (interactive "p")
+  (paper--flip-slides paper--id (- n)))
+
+(defvar paper-presentation-mode-map
+  (let ((map (make-sparse-keymap)))
+    (define-key map (kbd "SPC") #'paper-next-slide)
+    (define-key map "n" #'paper-next-slide)
+    (define-key map [right] #'paper-next-slide)
+    (define-key map [next] #'paper-next-slide)
+    (define-key map (kbd "DEL") #'paper-prev-slide)
+    (define-key map "p" #'paper-prev-slide)
+    (define-key map [left] #'paper-prev-slide)
+    (define-key map [prior] #'paper-prev-slide)
+    (define-key map "q" #'paper-presentation-mode)
+    map)
+  "Keymap for `paper-presentation-mode'.")
+
+(defvar-local paper--presentation-restore nil
+  "Frame fullscreen parameter and mode line from before the presentation.")
+
+(define-minor-mode paper-presentation-mode
+  "Show the document full-screen, one page at a time.
+The pages next to the current one are rendered ahead, so flipping
+to them is immediate."
+  :lighter " Present"
+  :keymap paper-presentation-mode-map
+  (unless (derived-mode-p 'paper-mode)
+    (setq paper-presentation-mode nil)
+    (user-error "Not in a Paper buffer"))
+  (if paper-presentation-mode
+      (progn
+        (setq paper--presentation-restore
+              (list (frame-parameter nil 'fullscreen) mode-line-format))
+        (setq mode-line-format nil)
+        (set-frame-parameter nil 'fullscreen 'fullboth)
+        (paper--set-presentation paper--id t))
+    (paper--set-presentation paper--id nil)
+    (cl-destructuring-bind (fullscreen mode-line) paper--presentation-restore
+      (set-frame-parameter nil 'fullscreen fullscreen)
+      (setq mode-line-format mode-line))
+    (let ((missed (paper--missed-slides paper--id)))
+      (when (> missed 0)
+        (message "%d slide flips waited for rendering" missed))))
+  (force-mode-line-update))
+
+;;; SyncTeX
+
+(defun paper--synctex-edit (message)
+  "Show the line of TeX input a control-click came from.
+MESSAGE is \"LINE:FILE\"."
+  (when (string-match "\\`\\([0-9]+\\):\\(.*\\)\\'" message)
+    (let ((line (string-to-number (match-string 1 message)))
+          (file (match-string 2 message)))
+      (pop-to-buffer (find-file-noselect file))
+      (goto-char (point-min))
+      (forward-line (1- line)))))
+
+(defun paper-synctex-view ()
+  "Show where the current line of this TeX file went in its document.
+Looks through the Paper buffers for one with SyncTeX data for the file."
+  (interactive)
+  (let ((file buffer-file-name)
+        (line (line-number-at-pos)))
+    (unless file
+      (user-error "Buffer isn't visiting a file"))
+    (let* ((result nil)
+           (buffer (cl-find-if
+                    (lambda (buffer)
+                      (with-current-buffer buffer
+                        (and (derived-mode-p 'paper-mode)
+                             (setq result
+                                   (paper--synctex-view paper--id file line)))))
+                    (buffer-list))))
+      (cond ((not buffer)
+             (user-error "No Paper buffer has SyncTeX data for %s" file))
+            ((eq result 'pending)
+             (message "Reading the SyncTeX data of %s..." (buffer-name buffer)))
+            (t (display-buffer buffer))))))
+
+(defun paper--synctex-viewed (message)
+  "Show the document once a forward search that had to wait is done.
+It waited for the SyncTeX file to be read again.  MESSAGE is \"1\" if
+the line was found, \"0\" otherwise."
+  (if (equal message "1")
+      (display-buffer (current-buffer))
+    (message "%s has no SyncTeX data for that line" (buffer-name))))
+
+(defun paper-lock-stats ()
+  "Show how contended mupdf's locks have been for the current document."
+  (interactive)
+  (message "%s"
+           (mapconcat
+            (lambda (lock)
+              (cl-destructuring-bind (name acquisitions contended wait) lock
+                (format "%s: %d/%d contended, %.3fs waited"
+                        name contended acquisitions wait)))
+            (paper--lock-stats paper--id)
+            "; ")))
 
 (defun paper-mwheel-scroll (button scroll-window)
   "Scroll up or down in SCROLL-WINDOW according to the BUTTON.
@@ -194,6 +708,22 @@ Similar to `mouse-wheel-text-scale' but for paper-mode."
     (define-key map [remap scroll-down-command] #'paper-scroll-window-down)
     (define-key map [remap mwheel-scroll] #'paper-mwheel-scroll)
     (define-key map [remap mouse-wheel-text-scale] #'paper-mouse-wheel-text-scale)
+    (define-key map "%" #'paper-goto-percent)
+    (define-key map [remap goto-line] #'paper-goto-page)
+    (define-key map "c" #'paper-set-columns)
+    (define-key map "b" #'paper-book-spread)
+    (define-key map "o" #'paper-overview)
+    (define-key map "t" #'paper-toggle-trim-margins)
+    (define-key map "P" #'paper-presentation-mode)
+    (define-key map "s" #'paper-search)
+    (define-key map "r" #'paper-search-regexp)
+    (define-key map "T" #'paper-text-view)
+    (define-key map "f" #'paper-jump-to-link)
+    (define-key map "j" #'paper-jump-to-word)
+    (define-key map "h" #'paper-highlight-selection)
+    (define-key map [remap save-buffer] #'paper-save)
+    (define-key map "n" #'paper-search-next)
+    (define-key map "N" #'paper-search-prev)
     map)
   "Keymap for `paper-mode'.")
 
@@ -212,15 +742,25 @@ Similar to `mouse-wheel-text-scale' but for paper-mode."
                                      :buffer (generate-new-buffer
                                               (format "* %s: pipe-process"
                                                       buffer-file-name))
-                                     ;; :filter #'paper--filter
+                                     :filter #'paper--filter
+                                     :coding 'utf-8
                                      :noquery t)
    paper--id (paper--new paper--process nil buffer-file-name nil))
+  (process-put paper--process 'paper-buffer (current-buffer))
+  (paper--set-predecode-share paper--id paper-image-predecode-share)
+  (paper--set-document-instances paper--id paper-document-instances)
+  (when paper-search-index
+    (paper--build-search-index paper--id))
+  (paper--set-autosave-delay paper--id (and paper-autosave-delay
+                                             (float paper-autosave-delay)))
+  (add-hook 'kill-buffer-query-functions #'paper--query-unsaved-edits nil t)
   ;; don't waste rendering time below our frame with the raw PDF text
   (add-hook 'kill-buffer-hook #'paper--kill-buffer nil t)
   (narrow-to-region (point-min) (point-min))
   (paper--adjust-size (selected-frame)))
 
 (add-hook 'window-size-change-functions #'paper--adjust-size)
+(add-hook 'window-selection-change-functions #'paper--adjust-size)
 (add-hook 'delete-frame-functions #'paper--delete-frame)
 
 (provide 'paper)
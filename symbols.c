@@ -1,6 +1,7 @@
 #include "symbols.h"
 
 emacs_value Qnil;
+emacs_value Qt;
 emacs_value Qargs_out_of_range;
 emacs_value Qfset;
 emacs_value Qprovide;
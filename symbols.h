@@ -3,6 +3,7 @@
 #include "emacs-module.h"
 
 extern emacs_value Qnil;
+extern emacs_value Qt;
 extern emacs_value Qargs_out_of_range;
 extern emacs_value Qfset;
 extern emacs_value Qprovide;
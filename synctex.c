@@ -0,0 +1,341 @@
+#include "synctex.h"
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+// scaled points per big point, the unit of PDF coordinates
+#define SP_PER_BP 65781.76
+// how far above and below a point synctex_edit looks for records, in points
+#define EDIT_BAND 24
+#define LINE_MAX_LEN (PATH_MAX + 64)
+
+/*
+ * Return the path of the SyncTeX file of the PDF at PDF_PATH, or NULL if it
+ * has none. Free the result with g_free.
+ */
+char *synctex_path(const char *pdf_path) {
+  const char *dot = strrchr(pdf_path, '.');
+  const char *slash = strrchr(pdf_path, '/');
+  int stem = dot && (!slash || dot > slash) ? dot - pdf_path
+                                            : (int)strlen(pdf_path);
+  const char *extensions[] = {".synctex.gz", ".synctex"};
+  for (size_t i = 0; i < G_N_ELEMENTS(extensions); i++) {
+    char *path = g_strdup_printf("%.*s%s", stem, pdf_path, extensions[i]);
+    if (g_file_test(path, G_FILE_TEST_EXISTS))
+      return path;
+    g_free(path);
+  }
+  return NULL;
+}
+
+// state of synctex_load between lines
+struct Parser {
+  SyncTeX *synctex;
+  int capacity; // of synctex->records
+  char *dir;    // of the SyncTeX file, which input paths are relative to
+  int page;     // of the records being read, -1 between pages
+  double unit;
+  double magnification;
+  fz_point offset; // in scaled points
+};
+
+// "TAG:PATH"
+static void add_input(struct Parser *p, const char *s) {
+  SyncTeX *synctex = p->synctex;
+  char *end;
+  long tag = strtol(s, &end, 10);
+  if (*end != ':' || tag < 0 || tag > G_MAXINT / 2)
+    return;
+  if (tag >= synctex->file_count) {
+    synctex->files =
+        g_realloc(synctex->files, (tag + 1) * sizeof(*synctex->files));
+    memset(synctex->files + synctex->file_count, 0,
+           (tag + 1 - synctex->file_count) * sizeof(*synctex->files));
+    synctex->file_count = tag + 1;
+  }
+  g_free(synctex->files[tag]);
+  synctex->files[tag] = g_canonicalize_filename(end + 1, p->dir);
+}
+
+/*
+ * "TAG,LINE[,COLUMN]:H,V[:W,H,D]" of a record of type TYPE. The rect is kept
+ * in scaled points until the whole file is read, since the post scriptum at
+ * its end may change the magnification and offsets.
+ */
+static void add_record(struct Parser *p, char type, const char *s) {
+  char *end;
+  int tag = strtol(s, &end, 10);
+  if (*end != ',')
+    return;
+  int line = strtol(end + 1, &end, 10);
+  if (*end == ',')
+    strtol(end + 1, &end, 10); // column, rarely known
+  if (*end != ':')
+    return;
+  float x = strtol(end + 1, &end, 10);
+  if (*end != ',')
+    return;
+  float y = strtol(end + 1, &end, 10);
+  fz_rect rect = {x, y, x, y};
+  if ((type == '(' || type == 'h') && *end == ':') {
+    float width = strtol(end + 1, &end, 10);
+    float height = *end == ',' ? strtol(end + 1, &end, 10) : 0;
+    float depth = *end == ',' ? strtol(end + 1, &end, 10) : 0;
+    rect.x0 = fz_min(x, x + width);
+    rect.x1 = fz_max(x, x + width);
+    rect.y0 = y - height;
+    rect.y1 = y + depth;
+  }
+  SyncTeX *synctex = p->synctex;
+  if (synctex->count == p->capacity) {
+    p->capacity = MAX(p->capacity * 2, 4096);
+    synctex->records =
+        g_realloc(synctex->records, p->capacity * sizeof(*synctex->records));
+  }
+  synctex->records[synctex->count++] =
+      (SyncRecord){.page = p->page, .file = tag, .line = line, .rect = rect};
+}
+
+static void parse_line(struct Parser *p, char *s) {
+  switch (s[0]) {
+  case '{': // page start
+    p->page = atoi(s + 1) - 1;
+    return;
+  case '}':
+    p->page = -1;
+    return;
+  case '(': // hbox
+  case 'h': // void hbox
+  case 'k': // kern
+  case 'g': // glue
+  case '$': // math
+  case 'x': // current position
+    // vboxes span whole paragraphs or pages, so they'd only get in the way
+    // of the lines in them
+    if (p->page >= 0)
+      add_record(p, s[0], s + 1);
+    return;
+  }
+  char *value = strchr(s, ':');
+  if (!value)
+    return;
+  *value++ = '\0';
+  if (strcmp(s, "Input") == 0)
+    add_input(p, value);
+  else if (strcmp(s, "Unit") == 0)
+    p->unit = strtod(value, NULL);
+  else if (strcmp(s, "Magnification") == 0)
+    p->magnification = strtod(value, NULL);
+  else if (strcmp(s, "X Offset") == 0)
+    p->offset.x = strtod(value, NULL);
+  else if (strcmp(s, "Y Offset") == 0)
+    p->offset.y = strtod(value, NULL);
+}
+
+static int compare_positions(const void *a, const void *b) {
+  const SyncRecord *ra = a, *rb = b;
+  if (ra->page != rb->page)
+    return ra->page - rb->page;
+  if (ra->rect.y1 != rb->rect.y1)
+    return ra->rect.y1 < rb->rect.y1 ? -1 : 1;
+  return (ra->rect.x0 > rb->rect.x0) - (ra->rect.x0 < rb->rect.x0);
+}
+
+static gint compare_lines(gconstpointer a, gconstpointer b, gpointer data) {
+  const SyncRecord *records = data;
+  const SyncRecord *ra = &records[*(const int *)a];
+  const SyncRecord *rb = &records[*(const int *)b];
+  if (ra->file != rb->file)
+    return ra->file - rb->file;
+  if (ra->line != rb->line)
+    return ra->line - rb->line;
+  return compare_positions(ra, rb);
+}
+
+/*
+ * Read the SyncTeX file at PATH, compressed or not, in one pass and index it.
+ * Return NULL if it can't be read. Doesn't touch any mupdf context, so it can
+ * run on any thread.
+ */
+SyncTeX *synctex_load(const char *path) {
+  gzFile gz = gzopen(path, "rb");
+  if (!gz)
+    return NULL;
+  struct Parser p = {0};
+  p.synctex = g_malloc0(sizeof(*p.synctex));
+  p.dir = g_path_get_dirname(path);
+  p.page = -1;
+  p.unit = 1;
+  p.magnification = 1000;
+  char line[LINE_MAX_LEN];
+  gboolean is_continuation = FALSE;
+  while (gzgets(gz, line, sizeof(line))) {
+    size_t len = strlen(line);
+    gboolean is_complete = len > 0 && line[len - 1] == '\n';
+    // skip the rest of lines too long to be records
+    if (!is_continuation && is_complete) {
+      line[len - 1] = '\0';
+      parse_line(&p, line);
+    }
+    is_continuation = !is_complete;
+  }
+  gzclose(gz);
+  g_free(p.dir);
+
+  SyncTeX *synctex = p.synctex;
+  double scale = p.unit * p.magnification / 1000 / SP_PER_BP;
+  for (int i = 0; i < synctex->count; i++) {
+    fz_rect *r = &synctex->records[i].rect;
+    r->x0 = (r->x0 + p.offset.x) * scale;
+    r->x1 = (r->x1 + p.offset.x) * scale;
+    r->y0 = (r->y0 + p.offset.y) * scale;
+    r->y1 = (r->y1 + p.offset.y) * scale;
+  }
+  qsort(synctex->records, synctex->count, sizeof(*synctex->records),
+        compare_positions);
+  synctex->by_line = g_malloc(MAX(synctex->count, 1) * sizeof(int));
+  for (int i = 0; i < synctex->count; i++)
+    synctex->by_line[i] = i;
+  g_qsort_with_data(synctex->by_line, synctex->count, sizeof(int),
+                    compare_lines, synctex->records);
+  return synctex;
+}
+
+void synctex_free(SyncTeX *synctex) {
+  if (!synctex)
+    return;
+  for (int i = 0; i < synctex->file_count; i++)
+    g_free(synctex->files[i]);
+  g_free(synctex->files);
+  g_free(synctex->records);
+  g_free(synctex->by_line);
+  g_free(synctex);
+}
+
+// Return the index of the first record at or after Y on PAGE.
+static int find_position(SyncTeX *synctex, int page, float y) {
+  int lo = 0, hi = synctex->count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    SyncRecord *r = &synctex->records[mid];
+    if (r->page < page || (r->page == page && r->rect.y1 < y))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// squared distance from POINT to RECT, 0 if it's inside
+static float distance(fz_rect rect, fz_point point) {
+  float dx = fz_max(fz_max(rect.x0 - point.x, point.x - rect.x1), 0);
+  float dy = fz_max(fz_max(rect.y0 - point.y, point.y - rect.y1), 0);
+  return dx * dx + dy * dy;
+}
+
+static float area(fz_rect rect) {
+  return (rect.x1 - rect.x0) * (rect.y1 - rect.y0);
+}
+
+// the record of FIRST to END that's closest to POINT, preferring small boxes
+static const SyncRecord *closest_record(SyncTeX *synctex, int first, int end,
+                                        fz_point point) {
+  const SyncRecord *best = NULL;
+  float best_distance = 0;
+  for (int i = first; i < end; i++) {
+    const SyncRecord *r = &synctex->records[i];
+    float d = distance(r->rect, point);
+    if (!best || d < best_distance ||
+        (d == best_distance && area(r->rect) < area(best->rect))) {
+      best = r;
+      best_distance = d;
+    }
+  }
+  return best;
+}
+
+/*
+ * Return the record closest to POINT, in points from the top left of PAGE
+ * (counting from 0), or NULL if the page has none. Only the records around
+ * POINT are looked at, unless there are none.
+ */
+const SyncRecord *synctex_edit(SyncTeX *synctex, int page, fz_point point) {
+  int first = find_position(synctex, page, point.y - EDIT_BAND);
+  int end = find_position(synctex, page, point.y + EDIT_BAND);
+  const SyncRecord *res = closest_record(synctex, first, end, point);
+  if (!res)
+    res = closest_record(synctex, find_position(synctex, page, -FLT_MAX),
+                         find_position(synctex, page + 1, -FLT_MAX), point);
+  return res;
+}
+
+// Return the tag of FILE, or -1 if it isn't an input.
+static int find_file(SyncTeX *synctex, const char *file) {
+  char *path = g_canonicalize_filename(file, NULL);
+  char *base = g_path_get_basename(path);
+  int res = -1;
+  for (int i = 0; i < synctex->file_count && res == -1; i++) {
+    if (synctex->files[i] && strcmp(synctex->files[i], path) == 0)
+      res = i;
+  }
+  // the document may have been compiled elsewhere
+  for (int i = 0; i < synctex->file_count && res == -1; i++) {
+    if (!synctex->files[i])
+      continue;
+    char *input_base = g_path_get_basename(synctex->files[i]);
+    if (strcmp(input_base, base) == 0)
+      res = i;
+    g_free(input_base);
+  }
+  g_free(base);
+  g_free(path);
+  return res;
+}
+
+/*
+ * Find where LINE of FILE went: set *PAGE (counting from 0) and *RECT, in
+ * points from its top left, to the first page with records of the line and
+ * the union of those records. Lines without records of their own use those of
+ * the next line that has some. Return FALSE if FILE has no records.
+ */
+gboolean synctex_view(SyncTeX *synctex, const char *file, int line, int *page,
+                      fz_rect *rect) {
+  int tag = find_file(synctex, file);
+  if (tag == -1)
+    return FALSE;
+  SyncRecord *records = synctex->records;
+  int lo = 0, hi = synctex->count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    SyncRecord *r = &records[synctex->by_line[mid]];
+    if (r->file < tag || (r->file == tag && r->line < line))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  // past the last line of the file, use the last one
+  if ((lo == synctex->count || records[synctex->by_line[lo]].file != tag) &&
+      lo > 0 && records[synctex->by_line[lo - 1]].file == tag)
+    lo--;
+  if (lo == synctex->count || records[synctex->by_line[lo]].file != tag)
+    return FALSE;
+  SyncRecord *first = &records[synctex->by_line[lo]];
+  while (lo > 0 && records[synctex->by_line[lo - 1]].file == tag &&
+         records[synctex->by_line[lo - 1]].line == first->line)
+    first = &records[synctex->by_line[--lo]];
+  *page = first->page;
+  *rect = first->rect;
+  for (int i = lo + 1; i < synctex->count; i++) {
+    SyncRecord *r = &records[synctex->by_line[i]];
+    if (r->file != tag || r->line != first->line || r->page != first->page)
+      break;
+    // unlike fz_union_rect, keeps points
+    rect->x0 = fz_min(rect->x0, r->rect.x0);
+    rect->y0 = fz_min(rect->y0, r->rect.y0);
+    rect->x1 = fz_max(rect->x1, r->rect.x1);
+    rect->y1 = fz_max(rect->y1, r->rect.y1);
+  }
+  return TRUE;
+}
@@ -0,0 +1,36 @@
+#ifndef SYNCTEX_H_
+#define SYNCTEX_H_
+#include <glib.h>
+#include <mupdf/fitz.h>
+
+// A place in the output that SyncTeX ties to a line of the input
+typedef struct SyncRecord {
+  int page; // counting from 0
+  int file; // tag of the input file, see SyncTeX.files
+  int line;
+  // in points from the top left of the page; boxes extend from the baseline
+  // at y up by height and down by depth, other records are points
+  fz_rect rect;
+} SyncRecord;
+
+/*
+ * The records of a .synctex(.gz) file, indexed both ways: records are sorted
+ * by page and position for finding the line a point on a page came from, and
+ * by_line orders them by input file and line for finding where a line went.
+ */
+typedef struct SyncTeX {
+  char **files; // canonical paths by tag, NULL for unused tags
+  int file_count;
+  SyncRecord *records; // by page, then bottom, then left
+  int count;
+  int *by_line; // indices of records by file, line, page, then y
+} SyncTeX;
+
+char *synctex_path(const char *pdf_path);
+SyncTeX *synctex_load(const char *path);
+void synctex_free(SyncTeX *synctex);
+const SyncRecord *synctex_edit(SyncTeX *synctex, int page, fz_point point);
+gboolean synctex_view(SyncTeX *synctex, const char *file, int line, int *page,
+                      fz_rect *rect);
+
+#endif // SYNCTEX_H_
@@ -0,0 +1,284 @@
+#define _POSIX_C_SOURCE 200809L
+#include "textcache.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// changes whenever the file format does
+#define TEXT_CACHE_MAGIC "PAPERTC2"
+
+static void put_rect(float *dst, fz_rect r) {
+  dst[0] = r.x0;
+  dst[1] = r.y0;
+  dst[2] = r.x1;
+  dst[3] = r.y1;
+}
+
+static fz_rect get_rect(const float *src) {
+  return fz_make_rect(src[0], src[1], src[2], src[3]);
+}
+
+/*
+ * Write the text blocks of TEXT, and the bounds of its page, to PATH. It's
+ * written to a temporary file first and renamed into place, so PATH is never
+ * left half-written. Return FALSE on failure.
+ */
+gboolean text_cache_write(const char *path, fz_stext_page *text,
+                          fz_rect page_bounds, fz_rect content_bounds) {
+  TextCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TEXT_CACHE_MAGIC, sizeof(header.magic));
+  put_rect(header.page_bounds, page_bounds);
+  put_rect(header.content_bounds, content_bounds);
+  for (fz_stext_block *block = text->first_block; block; block = block->next) {
+    if (block->type != FZ_STEXT_BLOCK_TEXT)
+      continue;
+    header.block_count++;
+    for (fz_stext_line *line = block->u.t.first_line; line;
+         line = line->next) {
+      header.line_count++;
+      for (fz_stext_char *ch = line->first_char; ch; ch = ch->next)
+        header.char_count++;
+    }
+  }
+  TextCacheBlock *blocks = calloc(MAX(header.block_count, 1), sizeof(*blocks));
+  TextCacheLine *lines = calloc(MAX(header.line_count, 1), sizeof(*lines));
+  TextCacheChar *chars = calloc(MAX(header.char_count, 1), sizeof(*chars));
+  TextCacheBlock *b = blocks;
+  TextCacheLine *l = lines;
+  TextCacheChar *c = chars;
+  for (fz_stext_block *block = text->first_block; block; block = block->next) {
+    if (block->type != FZ_STEXT_BLOCK_TEXT)
+      continue;
+    put_rect(b->bbox, block->bbox);
+    for (fz_stext_line *line = block->u.t.first_line; line;
+         line = line->next, l++) {
+      b->line_count++;
+      put_rect(l->bbox, line->bbox);
+      l->dir[0] = line->dir.x;
+      l->dir[1] = line->dir.y;
+      l->wmode = line->wmode;
+      for (fz_stext_char *ch = line->first_char; ch; ch = ch->next, c++) {
+        l->char_count++;
+        c->c = ch->c;
+        c->color = ch->color;
+        c->origin[0] = ch->origin.x;
+        c->origin[1] = ch->origin.y;
+        fz_point corners[] = {ch->quad.ul, ch->quad.ur, ch->quad.ll,
+                              ch->quad.lr};
+        for (int i = 0; i < 4; i++) {
+          c->quad[2 * i] = corners[i].x;
+          c->quad[2 * i + 1] = corners[i].y;
+        }
+        c->size = ch->size;
+      }
+    }
+    b++;
+  }
+
+  // a lost file is only extracted again, so it's not synced to disk; the
+  // temporary one is unique, since threads can extract the same page at once
+  char *tmp = g_strconcat(path, ".XXXXXX", NULL);
+  int fd = g_mkstemp(tmp);
+  FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (fd >= 0 && !f)
+    close(fd);
+  gboolean ok = f != NULL;
+  if (ok) {
+    ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+         fwrite(blocks, sizeof(*blocks), header.block_count, f) ==
+             header.block_count &&
+         fwrite(lines, sizeof(*lines), header.line_count, f) ==
+             header.line_count &&
+         fwrite(chars, sizeof(*chars), header.char_count, f) ==
+             header.char_count;
+    ok = fclose(f) == 0 && ok;
+  }
+  if (ok)
+    ok = rename(tmp, path) == 0;
+  if (!ok && fd >= 0)
+    unlink(tmp);
+  g_free(tmp);
+  free(blocks);
+  free(lines);
+  free(chars);
+  return ok;
+}
+
+// Return a new stext page with the text blocks of the file HEADER starts.
+static fz_stext_page *build_text(fz_context *ctx,
+                                 const TextCacheHeader *header) {
+  const TextCacheBlock *blocks = (const TextCacheBlock *)(header + 1);
+  const TextCacheLine *lines =
+      (const TextCacheLine *)(blocks + header->block_count);
+  const TextCacheChar *chars =
+      (const TextCacheChar *)(lines + header->line_count);
+  // don't trust a damaged file to stay within the arrays
+  uint64_t line_sum = 0, char_sum = 0;
+  for (uint32_t i = 0; i < header->block_count; i++)
+    line_sum += blocks[i].line_count;
+  if (line_sum != header->line_count)
+    return NULL;
+  for (uint32_t i = 0; i < header->line_count; i++)
+    char_sum += lines[i].char_count;
+  if (char_sum != header->char_count)
+    return NULL;
+
+  fz_stext_page *text = NULL;
+  fz_var(text);
+  fz_try(ctx) {
+    text = fz_new_stext_page(ctx, get_rect(header->page_bounds));
+    const TextCacheLine *l = lines;
+    const TextCacheChar *c = chars;
+    for (uint32_t b = 0; b < header->block_count; b++) {
+      fz_stext_block *block = fz_pool_alloc(ctx, text->pool, sizeof(*block));
+      memset(block, 0, sizeof(*block));
+      block->type = FZ_STEXT_BLOCK_TEXT;
+      block->bbox = get_rect(blocks[b].bbox);
+      block->prev = text->last_block;
+      if (text->last_block)
+        text->last_block->next = block;
+      else
+        text->first_block = block;
+      text->last_block = block;
+      for (uint32_t i = 0; i < blocks[b].line_count; i++, l++) {
+        fz_stext_line *line = fz_pool_alloc(ctx, text->pool, sizeof(*line));
+        memset(line, 0, sizeof(*line));
+        line->wmode = l->wmode;
+        line->dir = fz_make_point(l->dir[0], l->dir[1]);
+        line->bbox = get_rect(l->bbox);
+        line->prev = block->u.t.last_line;
+        if (block->u.t.last_line)
+          block->u.t.last_line->next = line;
+        else
+          block->u.t.first_line = line;
+        block->u.t.last_line = line;
+        for (uint32_t j = 0; j < l->char_count; j++, c++) {
+          fz_stext_char *ch = fz_pool_alloc(ctx, text->pool, sizeof(*ch));
+          memset(ch, 0, sizeof(*ch));
+          ch->c = c->c;
+          ch->color = c->color;
+          ch->origin = fz_make_point(c->origin[0], c->origin[1]);
+          ch->quad.ul = fz_make_point(c->quad[0], c->quad[1]);
+          ch->quad.ur = fz_make_point(c->quad[2], c->quad[3]);
+          ch->quad.ll = fz_make_point(c->quad[4], c->quad[5]);
+          ch->quad.lr = fz_make_point(c->quad[6], c->quad[7]);
+          ch->size = c->size;
+          if (line->last_char)
+            line->last_char->next = ch;
+          else
+            line->first_char = ch;
+          line->last_char = ch;
+        }
+      }
+    }
+  }
+  fz_catch(ctx) {
+    fz_drop_stext_page(ctx, text);
+    text = NULL;
+  }
+  return text;
+}
+
+/*
+ * Return the text written to PATH by text_cache_write, and set *PAGE_BOUNDS
+ * and *CONTENT_BOUNDS to the bounds written with it. Return NULL if there's
+ * no such file, or if it's of another version or damaged.
+ */
+fz_stext_page *text_cache_read(fz_context *ctx, const char *path,
+                               fz_rect *page_bounds, fz_rect *content_bounds) {
+  GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+  if (!file)
+    return NULL;
+  const char *data = g_mapped_file_get_contents(file);
+  gsize size = g_mapped_file_get_length(file);
+  const TextCacheHeader *header = (const TextCacheHeader *)data;
+  fz_stext_page *text = NULL;
+  if (size >= sizeof(*header) &&
+      memcmp(header->magic, TEXT_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+      size == sizeof(*header) +
+                  (size_t)header->block_count * sizeof(TextCacheBlock) +
+                  (size_t)header->line_count * sizeof(TextCacheLine) +
+                  (size_t)header->char_count * sizeof(TextCacheChar))
+    text = build_text(ctx, header);
+  if (text) {
+    *page_bounds = get_rect(header->page_bounds);
+    *content_bounds = get_rect(header->content_bounds);
+    text_cache_touch(path);
+  }
+  g_mapped_file_unref(file);
+  return text;
+}
+
+/*
+ * Mark the file at PATH, in the cache directory of a document, as used now:
+ * text_cache_trim deletes the files used the longest time ago first.
+ */
+void text_cache_touch(const char *path) {
+  utimensat(AT_FDCWD, path, NULL, 0);
+}
+
+struct CacheFile {
+  char *path;
+  time_t mtime;
+  goffset size;
+};
+
+static int compare_mtimes(const void *a, const void *b) {
+  time_t x = ((const struct CacheFile *)a)->mtime;
+  time_t y = ((const struct CacheFile *)b)->mtime;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Delete the files under ROOT, which has the cache directories of the
+ * documents, used the longest time ago first until the rest take MAX_SIZE
+ * bytes at most. That's every file of the cache: the text of pages, the
+ * thumbnails and the word indexes. The directories left empty are deleted
+ * too; doc_cache_path makes them again when needed.
+ */
+void text_cache_trim(const char *root, goffset max_size) {
+  GArray *files = g_array_new(FALSE, FALSE, sizeof(struct CacheFile));
+  GPtrArray *doc_dirs = g_ptr_array_new_with_free_func(g_free);
+  goffset total = 0;
+  GDir *dir = g_dir_open(root, 0, NULL);
+  for (const char *name; dir && (name = g_dir_read_name(dir));) {
+    char *doc_dir = g_build_filename(root, name, NULL);
+    GDir *doc = g_dir_open(doc_dir, 0, NULL);
+    if (!doc) {
+      g_free(doc_dir);
+      continue;
+    }
+    for (const char *file; (file = g_dir_read_name(doc));) {
+      struct CacheFile cf = {g_build_filename(doc_dir, file, NULL), 0, 0};
+      struct stat st;
+      if (lstat(cf.path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        g_free(cf.path);
+        continue;
+      }
+      cf.mtime = st.st_mtime;
+      cf.size = st.st_size;
+      total += cf.size;
+      g_array_append_val(files, cf);
+    }
+    g_dir_close(doc);
+    g_ptr_array_add(doc_dirs, doc_dir);
+  }
+  if (dir)
+    g_dir_close(dir);
+  g_array_sort(files, compare_mtimes);
+  for (guint i = 0; i < files->len; i++) {
+    struct CacheFile *cf = &g_array_index(files, struct CacheFile, i);
+    if (total > max_size && unlink(cf->path) == 0)
+      total -= cf->size;
+    g_free(cf->path);
+  }
+  g_array_free(files, TRUE);
+  // fails for those that aren't empty
+  for (guint i = 0; i < doc_dirs->len; i++)
+    rmdir(g_ptr_array_index(doc_dirs, i));
+  g_ptr_array_free(doc_dirs, TRUE);
+}
@@ -0,0 +1,54 @@
+#ifndef TEXTCACHE_H_
+#define TEXTCACHE_H_
+#include <glib.h>
+#include <mupdf/fitz.h>
+#include <stdint.h>
+
+// of the names of the files of the text of pages
+#define TEXT_CACHE_SUFFIX ".stext"
+
+/*
+ * The structured text and bounds of a page, kept in a file of the document's
+ * cache directory so that reopening the document doesn't run the interpreter
+ * again to extract them. The file is a TextCacheHeader followed by arrays of
+ * every block, every line and every char, each in page order; it's mapped
+ * into memory and copied into a fz_stext_page as is. Image blocks aren't
+ * kept, nor are the fonts of chars.
+ */
+typedef struct TextCacheHeader {
+  char magic[8]; // TEXT_CACHE_MAGIC
+  float page_bounds[4];
+  float content_bounds[4];
+  uint32_t block_count;
+  uint32_t line_count;
+  uint32_t char_count;
+} TextCacheHeader;
+
+typedef struct TextCacheBlock {
+  float bbox[4];
+  uint32_t line_count;
+} TextCacheBlock;
+
+typedef struct TextCacheLine {
+  float bbox[4];
+  float dir[2];
+  int32_t wmode;
+  uint32_t char_count;
+} TextCacheLine;
+
+typedef struct TextCacheChar {
+  int32_t c;
+  int32_t color;
+  float origin[2];
+  float quad[8]; // ul, ur, ll, lr
+  float size;
+} TextCacheChar;
+
+gboolean text_cache_write(const char *path, fz_stext_page *text,
+                          fz_rect page_bounds, fz_rect content_bounds);
+fz_stext_page *text_cache_read(fz_context *ctx, const char *path,
+                               fz_rect *page_bounds, fz_rect *content_bounds);
+void text_cache_touch(const char *path);
+void text_cache_trim(const char *root, goffset max_size);
+
+#endif // TEXTCACHE_H_
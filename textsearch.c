@@ -0,0 +1,253 @@
+#define _GNU_SOURCE // for memmem
+#include "textsearch.h"
+#include <stdlib.h>
+#include <string.h>
+
+// normalized text being built by put_char
+struct Output {
+  char *text;
+  int len;
+  int capacity;
+  int *chars; // NULL unless the source of each byte is wanted
+};
+
+static void put(struct Output *out, const char *utf8, int n, int source) {
+  // keep room for the terminating null byte
+  if (out->len + n >= out->capacity) {
+    out->capacity = MAX(out->capacity * 2, out->len + n + 256);
+    out->text = realloc(out->text, out->capacity);
+    if (out->chars)
+      out->chars = realloc(out->chars, out->capacity * sizeof(*out->chars));
+  }
+  memcpy(out->text + out->len, utf8, n);
+  for (int i = 0; out->chars && i < n; i++)
+    out->chars[out->len + i] = source;
+  out->len += n;
+}
+
+static void put_space(struct Output *out, int source) {
+  if (out->len > 0 && out->text[out->len - 1] == ' ')
+    return;
+  put(out, " ", 1, source);
+}
+
+/*
+ * Append character C of the page, or of a needle, normalized: decomposed
+ * with compatibility mappings, so that e.g. ligatures and full-width forms
+ * become plain letters, and folded as FLAGS says.
+ */
+static void put_char(struct Output *out, gunichar c, int flags, int source) {
+  char utf8[6];
+  if (c < 0x80) {
+    if (c == ' ' || (c >= '\t' && c <= '\r')) {
+      put_space(out, source);
+      return;
+    }
+    if (!(flags & SEARCH_MATCH_CASE) && c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+    utf8[0] = c;
+    put(out, utf8, 1, source);
+    return;
+  }
+  if (c == 0xAD) // soft hyphen
+    return;
+  if (g_unichar_isspace(c)) {
+    put_space(out, source);
+    return;
+  }
+  gunichar decomposed[G_UNICHAR_MAX_DECOMPOSITION_LENGTH];
+  gsize count = g_unichar_fully_decompose(c, TRUE, decomposed,
+                                          G_N_ELEMENTS(decomposed));
+  for (gsize i = 0; i < count; i++) {
+    gunichar d = decomposed[i];
+    if (!(flags & SEARCH_MATCH_DIACRITICS) && g_unichar_ismark(d))
+      continue;
+    if (g_unichar_isspace(d)) {
+      put_space(out, source);
+      continue;
+    }
+    if (!(flags & SEARCH_MATCH_CASE))
+      d = g_unichar_tolower(d);
+    put(out, utf8, g_unichar_to_utf8(d, utf8), source);
+  }
+}
+
+// Return S normalized like search_text_new does. Free the result with free.
+char *search_normalize(const char *s, int flags) {
+  struct Output out = {0};
+  put(&out, "", 0, -1);
+  for (const char *p = s; *p; p = g_utf8_next_char(p))
+    put_char(&out, g_utf8_get_char(p), flags, -1);
+  out.text[out.len] = '\0';
+  return out.text;
+}
+
+// Return the normalized text of PAGE, folded as the SEARCH_MATCH_* FLAGS say.
+SearchText *search_text_new(fz_stext_page *page, int flags) {
+  SearchText *text = calloc(1, sizeof(*text));
+  text->flags = flags & (SEARCH_MATCH_CASE | SEARCH_MATCH_DIACRITICS);
+  for (fz_stext_block *block = page->first_block; block; block = block->next) {
+    if (block->type != FZ_STEXT_BLOCK_TEXT)
+      continue;
+    for (fz_stext_line *line = block->u.t.first_line; line; line = line->next)
+      for (fz_stext_char *ch = line->first_char; ch; ch = ch->next)
+        text->char_count++;
+  }
+  text->quads = malloc(MAX(text->char_count, 1) * sizeof(*text->quads));
+  text->lines = malloc(MAX(text->char_count, 1) * sizeof(*text->lines));
+  struct Output out = {NULL, 0, 0, malloc(sizeof(int))};
+  put(&out, "", 0, -1);
+  int i = 0, line_number = 0;
+  for (fz_stext_block *block = page->first_block; block; block = block->next) {
+    if (block->type != FZ_STEXT_BLOCK_TEXT)
+      continue;
+    for (fz_stext_line *line = block->u.t.first_line; line;
+         line = line->next, line_number++) {
+      for (fz_stext_char *ch = line->first_char; ch; ch = ch->next, i++) {
+        text->quads[i] = ch->quad;
+        text->lines[i] = line_number;
+        put_char(&out, ch->c, text->flags, i);
+      }
+      // join words hyphenated across lines of a paragraph
+      if (line->next && out.len > 0 && out.text[out.len - 1] == '-')
+        out.len--;
+      else
+        put_space(&out, -1);
+    }
+  }
+  out.text[out.len] = '\0';
+  text->text = out.text;
+  text->len = out.len;
+  text->chars = out.chars;
+  return text;
+}
+
+void search_text_free(SearchText *text) {
+  if (!text)
+    return;
+  free(text->text);
+  free(text->chars);
+  free(text->quads);
+  free(text->lines);
+  free(text);
+}
+
+// Return how the texts NEEDLE is searched in are to be normalized.
+int search_text_flags(SearchNeedle *needle) {
+  // regexes fold case themselves, so that e.g. [A-Z] still means something
+  if (needle->flags & SEARCH_REGEX)
+    return SEARCH_MATCH_CASE | (needle->flags & SEARCH_MATCH_DIACRITICS);
+  return needle->flags & (SEARCH_MATCH_CASE | SEARCH_MATCH_DIACRITICS);
+}
+
+/*
+ * Return NEEDLE compiled for searching with the SearchFlags FLAGS, or NULL
+ * with ERROR set if it's an invalid regex.
+ */
+SearchNeedle *search_needle_new(const char *needle, int flags,
+                                GError **error) {
+  SearchNeedle *res = calloc(1, sizeof(*res));
+  res->refs = 1;
+  res->flags = flags;
+  res->source = g_strdup(needle);
+  res->text = search_normalize(needle, search_text_flags(res));
+  res->len = strlen(res->text);
+  if (flags & SEARCH_REGEX) {
+    GRegexCompileFlags options = G_REGEX_OPTIMIZE;
+    if (!(flags & SEARCH_MATCH_CASE))
+      options |= G_REGEX_CASELESS;
+    res->regex = g_regex_new(res->text, options, 0, error);
+    if (!res->regex) {
+      search_needle_unref(res);
+      return NULL;
+    }
+  }
+  return res;
+}
+
+SearchNeedle *search_needle_ref(SearchNeedle *needle) {
+  needle->refs++;
+  return needle;
+}
+
+void search_needle_unref(SearchNeedle *needle) {
+  if (!needle || --needle->refs > 0)
+    return;
+  if (needle->regex)
+    g_regex_unref(needle->regex);
+  g_free(needle->source);
+  free(needle->text);
+  free(needle);
+}
+
+// Return TRUE if NEEDLE can only match where PREFIX does.
+gboolean search_needle_extends(SearchNeedle *needle, SearchNeedle *prefix) {
+  return !(needle->flags & SEARCH_REGEX) && needle->flags == prefix->flags &&
+         prefix->len <= needle->len &&
+         memcmp(needle->text, prefix->text, prefix->len) == 0;
+}
+
+struct Matches {
+  fz_quad *quads;
+  int count;
+  int capacity;
+};
+
+// Add the quads of bytes START to END of TEXT, one per line.
+static void add_match(SearchText *text, int start, int end,
+                      struct Matches *matches) {
+  while (start < end && text->chars[start] < 0)
+    start++;
+  while (end > start && text->chars[end - 1] < 0)
+    end--;
+  if (start == end)
+    return;
+  int last = text->chars[end - 1];
+  for (int i = text->chars[start]; i <= last;) {
+    int j = i;
+    while (j < last && text->lines[j + 1] == text->lines[i])
+      j++;
+    if (matches->count == matches->capacity) {
+      matches->capacity = MAX(16, matches->capacity * 2);
+      matches->quads = realloc(matches->quads,
+                               matches->capacity * sizeof(*matches->quads));
+    }
+    fz_quad *quad = &matches->quads[matches->count++];
+    quad->ul = text->quads[i].ul;
+    quad->ll = text->quads[i].ll;
+    quad->ur = text->quads[j].ur;
+    quad->lr = text->quads[j].lr;
+    i = j + 1;
+  }
+}
+
+/*
+ * Find the matches of NEEDLE in TEXT, which must be normalized with
+ * search_text_flags(NEEDLE). Set *QUADS, which is reallocated, to their quads
+ * and return how many there are. Literal needles are found with memmem, which
+ * libc implements with vectorized scans for the first bytes.
+ */
+int search_text_find(SearchText *text, SearchNeedle *needle, fz_quad **quads) {
+  struct Matches matches = {*quads, 0, 0};
+  // whatever *QUADS had room for is unknown, so it's grown from scratch
+  if (needle->regex) {
+    GMatchInfo *info;
+    g_regex_match_full(needle->regex, text->text, text->len, 0, 0, &info,
+                       NULL);
+    while (g_match_info_matches(info)) {
+      int start, end;
+      g_match_info_fetch_pos(info, 0, &start, &end);
+      add_match(text, start, end, &matches);
+      g_match_info_next(info, NULL);
+    }
+    g_match_info_free(info);
+  } else if (needle->len > 0) {
+    const char *end = text->text + text->len;
+    for (const char *p = text->text;
+         (p = memmem(p, end - p, needle->text, needle->len));
+         p += needle->len)
+      add_match(text, p - text->text, p - text->text + needle->len, &matches);
+  }
+  *quads = matches.quads;
+  return matches.count;
+}
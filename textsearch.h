@@ -0,0 +1,52 @@
+#ifndef TEXTSEARCH_H_
+#define TEXTSEARCH_H_
+#include <glib.h>
+#include <mupdf/fitz.h>
+
+// how a needle is compared to the text; 0 ignores case and diacritics
+enum SearchFlags {
+  SEARCH_MATCH_CASE = 1 << 0,
+  SEARCH_MATCH_DIACRITICS = 1 << 1,
+  SEARCH_REGEX = 1 << 2, // a Perl-compatible regular expression
+};
+
+/*
+ * The text of a page flattened into one normalized UTF-8 string: characters
+ * are decomposed so that ligatures become the letters they stand for, runs of
+ * whitespace become one space, lines are joined by a space, or by nothing
+ * after a hyphen, which is dropped, and case and diacritics are folded as
+ * flags says. Every byte maps back to the character of the page it came from,
+ * and so to a quad on the page.
+ */
+typedef struct SearchText {
+  char *text;
+  int len;
+  int *chars; // of each byte; -1 for the spaces put between lines
+  fz_quad *quads; // of each character of the page
+  int *lines; // of each character of the page, counting from 0
+  int char_count;
+  int flags; // the SEARCH_MATCH_* ones
+} SearchText;
+
+// What's searched for, normalized like the texts it's searched in
+typedef struct SearchNeedle {
+  int refs; // only touched on the GTK thread
+  int flags;
+  char *source; // as given
+  char *text;   // normalized, unless it's a regex
+  int len;
+  GRegex *regex; // NULL unless flags has SEARCH_REGEX
+} SearchNeedle;
+
+char *search_normalize(const char *s, int flags);
+SearchText *search_text_new(fz_stext_page *page, int flags);
+void search_text_free(SearchText *text);
+int search_text_flags(SearchNeedle *needle);
+
+SearchNeedle *search_needle_new(const char *needle, int flags, GError **error);
+SearchNeedle *search_needle_ref(SearchNeedle *needle);
+void search_needle_unref(SearchNeedle *needle);
+gboolean search_needle_extends(SearchNeedle *needle, SearchNeedle *prefix);
+int search_text_find(SearchText *text, SearchNeedle *needle, fz_quad **quads);
+
+#endif // TEXTSEARCH_H_
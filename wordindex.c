@@ -0,0 +1,266 @@
+#define _POSIX_C_SOURCE 200809L
+#include "wordindex.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// changes whenever the file format or what counts as a word does
+#define WORD_INDEX_MAGIC "PAPERWI2"
+
+struct WordIndexBuilder {
+  int page_count;
+  GHashTable *words; // postings of each word, as GArrays of WordPosting
+};
+
+static void add_word(WordIndexBuilder *builder, int page, char *word,
+                     uint32_t offset) {
+  GArray *postings = g_hash_table_lookup(builder->words, word);
+  if (postings) {
+    g_free(word);
+  } else {
+    postings = g_array_new(FALSE, FALSE, sizeof(WordPosting));
+    g_hash_table_insert(builder->words, word, postings);
+  }
+  WordPosting posting = {page, offset};
+  g_array_append_val(postings, posting);
+}
+
+WordIndexBuilder *word_index_builder_new(int page_count) {
+  WordIndexBuilder *builder = malloc(sizeof(*builder));
+  builder->page_count = page_count;
+  builder->words = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify)g_array_unref);
+  return builder;
+}
+
+void word_index_builder_free(WordIndexBuilder *builder) {
+  if (!builder)
+    return;
+  g_hash_table_destroy(builder->words);
+  free(builder);
+}
+
+/*
+ * Add the words of TEXT, the text of PAGE normalized with no SEARCH_MATCH_*
+ * flags. Pages must be added in order.
+ */
+void word_index_add_page(WordIndexBuilder *builder, int page,
+                         SearchText *text) {
+  if (!text)
+    return;
+  for (int i = 0; i < text->len;) {
+    if (text->text[i] == ' ') {
+      i++;
+      continue;
+    }
+    int end = i;
+    while (end < text->len && text->text[end] != ' ')
+      end++;
+    add_word(builder, page, g_strndup(text->text + i, end - i),
+             text->chars[i]);
+    i = end;
+  }
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Write the index to PATH. It's written to a temporary file first and renamed
+ * into place once it's on disk, so PATH is never left half-written. Return
+ * FALSE on failure.
+ */
+gboolean word_index_write(WordIndexBuilder *builder, const char *path) {
+  guint word_count;
+  char **names =
+      (char **)g_hash_table_get_keys_as_array(builder->words, &word_count);
+  qsort(names, word_count, sizeof(*names), compare_names);
+  WordIndexHeader header;
+  memcpy(header.magic, WORD_INDEX_MAGIC, sizeof(header.magic));
+  header.page_count = builder->page_count;
+  header.word_count = word_count;
+  WordEntry *words = malloc(MAX(word_count, 1) * sizeof(*words));
+  GArray **postings = malloc(MAX(word_count, 1) * sizeof(*postings));
+  uint32_t posting_count = 0, strings_size = 0;
+  for (guint i = 0; i < word_count; i++) {
+    postings[i] = g_hash_table_lookup(builder->words, names[i]);
+    words[i].name = strings_size;
+    words[i].first = posting_count;
+    words[i].count = postings[i]->len;
+    strings_size += strlen(names[i]) + 1;
+    posting_count += postings[i]->len;
+  }
+  header.posting_count = posting_count;
+  header.strings_size = strings_size;
+
+  // the temporary file is unique, since two views of the document can build
+  // its index at once
+  char *tmp = g_strconcat(path, ".XXXXXX", NULL);
+  int fd = g_mkstemp(tmp);
+  FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (fd >= 0 && !f)
+    close(fd);
+  gboolean ok = f != NULL;
+  if (ok) {
+    ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+         fwrite(words, sizeof(*words), word_count, f) == word_count;
+    for (guint i = 0; ok && i < word_count; i++)
+      ok = fwrite(postings[i]->data, sizeof(WordPosting), postings[i]->len,
+                  f) == postings[i]->len;
+    for (guint i = 0; ok && i < word_count; i++)
+      ok = fwrite(names[i], strlen(names[i]) + 1, 1, f) == 1;
+    ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+  }
+  if (ok)
+    ok = rename(tmp, path) == 0;
+  if (!ok) {
+    fprintf(stderr, "cannot write word index %s\n", path);
+    if (fd >= 0)
+      unlink(tmp);
+  }
+  g_free(tmp);
+  free(postings);
+  free(words);
+  g_free(names);
+  return ok;
+}
+
+void word_index_close(WordIndex *index) {
+  if (!index)
+    return;
+  munmap(index->data, index->size);
+  free(index);
+}
+
+/*
+ * Map the index at PATH into memory. Return NULL if there's none, or if it's
+ * of another version or of a document with other than PAGE_COUNT pages.
+ */
+WordIndex *word_index_open(const char *path, int page_count) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(WordIndexHeader))
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+  WordIndex *index = malloc(sizeof(*index));
+  index->data = data;
+  index->size = st.st_size;
+  const WordIndexHeader *header = index->header = data;
+  size_t expected = sizeof(*header) +
+                    (size_t)header->word_count * sizeof(WordEntry) +
+                    (size_t)header->posting_count * sizeof(WordPosting) +
+                    header->strings_size;
+  if (memcmp(header->magic, WORD_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      header->page_count != (uint32_t)page_count || expected != index->size) {
+    word_index_close(index);
+    return NULL;
+  }
+  index->words = (const WordEntry *)(header + 1);
+  index->postings = (const WordPosting *)(index->words + header->word_count);
+  index->strings = (const char *)(index->postings + header->posting_count);
+  // don't trust a damaged file to stay within the mapping
+  gboolean ok = header->word_count == 0 ||
+                (header->strings_size > 0 &&
+                 index->strings[header->strings_size - 1] == '\0');
+  for (uint32_t i = 0; ok && i < header->word_count; i++) {
+    const WordEntry *word = &index->words[i];
+    ok = word->name < header->strings_size &&
+         word->first <= header->posting_count &&
+         word->count <= header->posting_count - word->first;
+  }
+  if (!ok) {
+    word_index_close(index);
+    return NULL;
+  }
+  return index;
+}
+
+/*
+ * Return TRUE if WORD may be part of a match of a needle that has TOKEN at
+ * position I of COUNT tokens: the first token can end a word, the last can
+ * start one, and any in between must be a whole word.
+ */
+static gboolean word_matches(const char *word, const char *token, guint i,
+                             guint count) {
+  if (count == 1)
+    return strstr(word, token) != NULL;
+  if (i == 0)
+    return g_str_has_suffix(word, token);
+  if (i == count - 1)
+    return g_str_has_prefix(word, token);
+  return strcmp(word, token) == 0;
+}
+
+// Return the first of the sorted words of INDEX that doesn't sort before TOKEN.
+static uint32_t lower_bound(WordIndex *index, const char *token) {
+  uint32_t lo = 0, hi = index->header->word_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (strcmp(index->strings + index->words[mid].name, token) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Set PAGES[n] to whether page n might have matches of NEEDLE, for every page
+ * of the document. Return FALSE, leaving PAGES alone, if NEEDLE has no words
+ * to look up.
+ */
+gboolean word_index_candidates(WordIndex *index, const char *needle,
+                               gboolean *pages) {
+  // split NEEDLE into words like word_index_add_page does
+  char *normalized = search_normalize(needle, 0);
+  GPtrArray *tokens = g_ptr_array_new();
+  char *state;
+  for (char *token = strtok_r(normalized, " ", &state); token;
+       token = strtok_r(NULL, " ", &state))
+    g_ptr_array_add(tokens, token);
+  if (tokens->len == 0) {
+    g_ptr_array_free(tokens, TRUE);
+    free(normalized);
+    return FALSE;
+  }
+  // seen[n] is the number of tokens found on page n so far
+  uint32_t page_count = index->header->page_count;
+  guint *seen = calloc(MAX(page_count, 1), sizeof(*seen));
+  for (guint i = 0; i < tokens->len; i++) {
+    // the words a whole word or a prefix matches are a run of the sorted
+    // words, found by binary search; suffixes and substrings can be anywhere
+    gboolean is_run = tokens->len > 1 && i > 0;
+    uint32_t w = is_run ? lower_bound(index, tokens->pdata[i]) : 0;
+    for (; w < index->header->word_count; w++) {
+      const WordEntry *word = &index->words[w];
+      if (!word_matches(index->strings + word->name, tokens->pdata[i], i,
+                        tokens->len)) {
+        if (is_run)
+          break;
+        continue;
+      }
+      for (uint32_t p = word->first; p < word->first + word->count; p++) {
+        uint32_t n = index->postings[p].page;
+        if (n < page_count && seen[n] == i)
+          seen[n] = i + 1;
+      }
+    }
+  }
+  for (uint32_t n = 0; n < page_count; n++)
+    pages[n] = seen[n] == tokens->len;
+  free(seen);
+  g_ptr_array_free(tokens, TRUE);
+  free(normalized);
+  return TRUE;
+}
@@ -0,0 +1,56 @@
+#ifndef WORDINDEX_H_
+#define WORDINDEX_H_
+#include "textsearch.h"
+#include <glib.h>
+#include <stdint.h>
+
+/*
+ * An inverted index of the words of a document, kept in a cache file that is
+ * mapped into memory as is. Words are the runs of characters between spaces of
+ * the SearchText of a page that folds case and diacritics. The index only
+ * narrows searches down to the pages that might match; the matches themselves
+ * are still found by searching the text of those pages.
+ */
+typedef struct WordIndexHeader {
+  char magic[8]; // WORD_INDEX_MAGIC
+  uint32_t page_count;
+  uint32_t word_count;
+  uint32_t posting_count;
+  uint32_t strings_size;
+} WordIndexHeader;
+
+typedef struct WordEntry {
+  uint32_t name;  // offset of the word in the strings
+  uint32_t first; // its first posting
+  uint32_t count; // of postings
+} WordEntry;
+
+// where a word appears
+typedef struct WordPosting {
+  uint32_t page;
+  uint32_t offset; // of its first character in the stext page
+} WordPosting;
+
+typedef struct WordIndex {
+  void *data; // the mapped file
+  size_t size;
+  const WordIndexHeader *header;
+  const WordEntry *words; // sorted by name
+  const WordPosting *postings; // by word, then page and offset
+  const char *strings;
+} WordIndex;
+
+typedef struct WordIndexBuilder WordIndexBuilder;
+
+WordIndexBuilder *word_index_builder_new(int page_count);
+void word_index_add_page(WordIndexBuilder *builder, int page,
+                         SearchText *text);
+gboolean word_index_write(WordIndexBuilder *builder, const char *path);
+void word_index_builder_free(WordIndexBuilder *builder);
+
+WordIndex *word_index_open(const char *path, int page_count);
+void word_index_close(WordIndex *index);
+gboolean word_index_candidates(WordIndex *index, const char *needle,
+                               gboolean *pages);
+
+#endif // WORDINDEX_H_